@@ -91,6 +91,8 @@ int main(int argc, char **argv) {
   pks_global_init(PK_LOG_ALL);
   PKS_SSL_INIT(ctx);
 
+  memset(&pkc, 0, sizeof(pkc));
+  pkc.sockfd = -1;
   kite_r.kite = &kite;
   strcpy(kite.protocol, "http");
   strncpyz(kite.public_domain, argv[1], PK_DOMAIN_LENGTH);
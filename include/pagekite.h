@@ -114,16 +114,31 @@ DECLSPEC_DLL int pagekite_add_kite(pagekite_mgr,
   int lport);
 
 DECLSPEC_DLL int pagekite_add_service_frontends(pagekite_mgr pkm, int);
+DECLSPEC_DLL int pagekite_set_kite_connect_timeout(pagekite_mgr,
+  const char* proto,
+  const char* kitename,
+  int pport,
+  int seconds);
+
 DECLSPEC_DLL int pagekite_add_frontend(pagekite_mgr,
   const char* domain,
   int port);
 
 DECLSPEC_DLL int pagekite_set_log_mask(pagekite_mgr, int);
 DECLSPEC_DLL int pagekite_enable_watchdog(pagekite_mgr, int enable);
+DECLSPEC_DLL int pagekite_enable_tunnel_coalescing(pagekite_mgr, int enable);
+DECLSPEC_DLL int pagekite_enable_ktls(pagekite_mgr, int enable);
+DECLSPEC_DLL int pagekite_enable_splice(pagekite_mgr, int enable);
 DECLSPEC_DLL int pagekite_enable_fake_ping(pagekite_mgr pkm, int enable);
 DECLSPEC_DLL int pagekite_set_bail_on_errors(pagekite_mgr pkm, int errors);
 DECLSPEC_DLL int pagekite_set_conn_eviction_idle_s(pagekite_mgr pkm, int);
+DECLSPEC_DLL int pagekite_set_conn_buffer_max(pagekite_mgr pkm, int);
+DECLSPEC_DLL int pagekite_set_tunnel_read_budget(pagekite_mgr pkm, int);
 DECLSPEC_DLL int pagekite_want_spare_frontends(pagekite_mgr, int spares);
+DECLSPEC_DLL int pagekite_set_stream_quantum(pagekite_mgr, int);
+DECLSPEC_DLL int pagekite_set_window_kb(pagekite_mgr, int min_kb, int max_kb);
+DECLSPEC_DLL int pagekite_set_reconnect_timeout(pagekite_mgr, int seconds);
+DECLSPEC_DLL int pagekite_set_workers(pagekite_mgr, int workers);
 DECLSPEC_DLL int pagekite_tick(pagekite_mgr);
 DECLSPEC_DLL int pagekite_poll(pagekite_mgr, int timeout);
 DECLSPEC_DLL int pagekite_start(pagekite_mgr);
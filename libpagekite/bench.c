@@ -0,0 +1,62 @@
+/******************************************************************************
+bench.c - Microbenchmarks for pagekite.
+
+This file is Copyright 2011-2014, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************/
+#define PAGEKITE_CONSTANTS_ONLY
+#include "pagekite.h"
+
+#include "common.h"
+#include <assert.h>
+
+#include "utils.h"
+#include "pkerror.h"
+#include "pkconn.h"
+#include "pkstate.h"
+#include "pkproto.h"
+#include "pkblocker.h"
+#include "pkmanager.h"
+#include "pklogging.h"
+#include "pkwatchdog.h"
+
+struct pk_global_state pk_state;
+
+int pkproto_bench();
+int pkconn_bench();
+int pkmanager_bench();
+
+/* These only report numbers, for comparing builds; the tests binary is
+ * where behaviour gets checked.  Some of them move a lot of data, so
+ * they are not run by default: see "make runbench". */
+int main(void) {
+#ifdef _MSC_VER
+  pks_global_init(PK_LOG_ALL);
+
+  /* Initialize Winsock */
+  int r;
+  WSADATA wsa_data;
+  r = WSAStartup(MAKEWORD(2, 2), &wsa_data);
+  if (r != 0) {
+    fprintf(stderr, "WSAStartup failed: %d\n", r);
+    return 1;
+  }
+#endif
+  assert(pkproto_bench());
+  assert(pkconn_bench());
+  assert(pkmanager_bench());
+  return 0;
+}
@@ -42,6 +42,7 @@
 #  include <signal.h>
 #  include <pthread.h>
 #  include <time.h>
+#  include <sys/uio.h>
 #  include <ev.h>
 #endif
 
@@ -80,6 +81,12 @@
 #  define SHUT_RDWR 2
 typedef SSIZE_T ssize_t;
 #endif
+#ifdef _MSC_VER
+struct iovec {
+  void*  iov_base;
+  size_t iov_len;
+};
+#endif
 
 #ifndef ANDROID
 typedef signed char               int8_t;
@@ -102,6 +109,9 @@ typedef unsigned int              uint32_t;
 #  define PKS_connect(s, d, l)  connect(_get_osfhandle(s), d, l)
 #  define PKS_read(s, d, l)     recv(_get_osfhandle(s), d, l, 0)
 #  define PKS_write(s, d, l)    send(_get_osfhandle(s), d, l, 0)
+   /* No writev here: send just the first buffer, a valid short write. */
+#  define PKS_writev(s, v, c)   send(_get_osfhandle(s), \
+                                     (v)[0].iov_base, (v)[0].iov_len, 0)
 #  define PKS_close(s)          closesocket(_get_osfhandle(s))
 #  define PKS_shutdown(s, how)  shutdown(_get_osfhandle(s), how)
 #  define PKS_EV_FD(s)          s
@@ -112,6 +122,7 @@ typedef unsigned int              uint32_t;
 #  define PKS_connect(s, d, l)  connect(s, d, l)
 #  define PKS_read(s, d, l)     read(s, d, l)
 #  define PKS_write(s, d, l)    write(s, d, l)
+#  define PKS_writev(s, v, c)   writev(s, v, c)
 #  define PKS_close(s)          close(s)
 #  define PKS_shutdown(s, how)  shutdown(s, how)
 #  define PKS_EV_FD(s)          s
@@ -134,6 +145,7 @@ typedef unsigned int              uint32_t;
                          SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS); }
 #else
 #  define SSL_CTX                   void
+#  define SSL_SESSION               void
 #  define PKS_SSL_INIT(ctx)         { ctx = NULL; }
 #  define SSL_ERROR_NONE            0
 #  undef HAVE_OPENSSL
@@ -197,6 +197,38 @@ int pagekite_enable_watchdog(pagekite_mgr pkm, int enable)
   return 0;
 }
 
+int pagekite_enable_tunnel_coalescing(pagekite_mgr pkm, int enable)
+{
+  if (pkm == NULL) return -1;
+  PK_MANAGER(pkm)->coalesce_tunnel_writes = (enable > 0);
+  return 0;
+}
+
+int pagekite_enable_splice(pagekite_mgr pkm, int enable)
+{
+  if (pkm == NULL) return -1;
+  PK_MANAGER(pkm)->enable_splice = (enable > 0);
+  return 0;
+}
+
+int pagekite_enable_ktls(pagekite_mgr pkm, int enable)
+{
+#if defined(HAVE_OPENSSL) && defined(SSL_OP_ENABLE_KTLS)
+  SSL_CTX* ctx;
+  if (pkm == NULL) return -1;
+  if (NULL == (ctx = PK_MANAGER(pkm)->ssl_ctx)) return -1;
+  if (enable > 0)
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+  else
+    SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+  return 0;
+#else
+  (void) pkm;
+  (void) enable;
+  return -1;
+#endif
+}
+
 int pagekite_enable_fake_ping(pagekite_mgr pkm, int enable)
 {
   (void) pkm;
@@ -218,6 +250,51 @@ int pagekite_set_conn_eviction_idle_s(pagekite_mgr pkm, int seconds)
   return 0;
 }
 
+int pagekite_set_conn_buffer_max(pagekite_mgr pkm, int bytes)
+{
+  (void) pkm;
+  pk_state.conn_buffer_max = bytes;
+  return 0;
+}
+
+int pagekite_set_tunnel_read_budget(pagekite_mgr pkm, int bytes)
+{
+  (void) pkm;
+  pk_state.tunnel_read_budget = bytes;
+  return 0;
+}
+
+int pagekite_set_stream_quantum(pagekite_mgr pkm, int bytes)
+{
+  if (pkm == NULL) return -1;
+  PK_MANAGER(pkm)->stream_quantum = bytes;
+  return 0;
+}
+
+int pagekite_set_reconnect_timeout(pagekite_mgr pkm, int seconds)
+{
+  if (pkm == NULL) return -1;
+  if (seconds < 1) seconds = PK_HANDSHAKE_TIMEOUT;
+  PK_MANAGER(pkm)->reconnect_timeout = seconds;
+  return 0;
+}
+
+int pagekite_set_workers(pagekite_mgr pkm, int workers)
+{
+  if (pkm == NULL) return -1;
+  return (0 < pkm_set_workers(PK_MANAGER(pkm), workers)) ? 0 : -1;
+}
+
+int pagekite_set_window_kb(pagekite_mgr pkm, int min_kb, int max_kb)
+{
+  if (pkm == NULL) return -1;
+  if (min_kb < 1) min_kb = CONN_WINDOW_SIZE_KB_MINIMUM;
+  if (max_kb < min_kb) max_kb = min_kb;
+  PK_MANAGER(pkm)->window_kb_min = min_kb;
+  PK_MANAGER(pkm)->window_kb_max = max_kb;
+  return 0;
+}
+
 int pagekite_want_spare_frontends(pagekite_mgr pkm, int spares)
 {
   if (pkm == NULL) return -1;
@@ -240,6 +317,17 @@ int pagekite_add_kite(pagekite_mgr pkm,
           ) ? 0 : -1;
 }
 
+int pagekite_set_kite_connect_timeout(pagekite_mgr pkm,
+  const char* proto,
+  const char* kitename,
+  int pport,
+  int seconds)
+{
+  if (pkm == NULL) return -1;
+  return pkm_set_kite_connect_timeout(PK_MANAGER(pkm),
+                                      proto, kitename, pport, seconds);
+}
+
 int pagekite_add_frontend(pagekite_mgr pkm,
   const char* domain,
   int port)
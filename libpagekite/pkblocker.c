@@ -527,6 +527,7 @@ void pkb_check_tunnels(struct pk_manager* pkm)
   if (pkm->status == PK_STATUS_NO_NETWORK) return;
   pk_log(PK_LOG_MANAGER_DEBUG, "Checking tunnels...");
 
+  pkm_resolve_backends(pkm);
   pkb_check_kites_dns(pkm);
   pkb_choose_tunnels(pkm);
   pkb_log_fe_status(pkm);
@@ -575,6 +576,9 @@ void* pkb_run_blocker(void *void_pkm)
           last_check_tunnels = time(0);
         }
         break;
+      case PK_RESOLVE_BACKENDS:
+        pkm_resolve_backends((struct pk_manager*) job.data);
+        break;
       case PK_QUIT:
         /* Put the job back in the queue, in case there are many workers */
         pkb_add_job(&(pkm->blocking_jobs), PK_QUIT, NULL);
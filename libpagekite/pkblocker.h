@@ -24,6 +24,7 @@ typedef enum {
   PK_NO_JOB,
   PK_CHECK_WORLD,
   PK_CHECK_FRONTENDS,
+  PK_RESOLVE_BACKENDS,
   PK_QUIT
 } pk_job_t;
 
@@ -31,6 +31,155 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkmanager.h"
 #include "pklogging.h"
 
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+#if defined(SPLICE_F_MOVE) && defined(SPLICE_F_NONBLOCK)
+#define HAVE_SPLICE 1
+#endif
+
+
+/* The buffer pool: a free list of CONN_IO_BUFFER_SIZE blocks, linked
+ * through their first bytes and shared by all connections. */
+static pthread_mutex_t pkc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* pkc_pool_free = NULL;
+static int pkc_pool_free_count = 0;
+static int pkc_pool_in_use = 0;
+
+char* pkc_buffer_get(void)
+{
+  char* block;
+
+  pthread_mutex_lock(&pkc_pool_lock);
+  if (NULL != (block = pkc_pool_free)) {
+    pkc_pool_free = *((char**) block);
+    pkc_pool_free_count -= 1;
+  }
+  pkc_pool_in_use += 1;
+  pthread_mutex_unlock(&pkc_pool_lock);
+
+  if ((NULL == block) && (NULL == (block = malloc(CONN_IO_BUFFER_SIZE)))) {
+    pk_log(PK_LOG_ERROR, "pkc_buffer_get: Out of memory");
+    pthread_mutex_lock(&pkc_pool_lock);
+    pkc_pool_in_use -= 1;
+    pthread_mutex_unlock(&pkc_pool_lock);
+  }
+  return block;
+}
+
+void pkc_buffer_put(char* block)
+{
+  pthread_mutex_lock(&pkc_pool_lock);
+  pkc_pool_in_use -= 1;
+  if (pkc_pool_free_count < CONN_BUFFER_POOL_MAX) {
+    *((char**) block) = pkc_pool_free;
+    pkc_pool_free = block;
+    pkc_pool_free_count += 1;
+    block = NULL;
+  }
+  pthread_mutex_unlock(&pkc_pool_lock);
+  if (NULL != block) free(block);
+}
+
+int pkc_buffer_max(void)
+{
+  int max = pk_state.conn_buffer_max;
+  if (max <= 0) return CONN_BUFFER_MAX_DEFAULT;
+  if (max < CONN_IO_BUFFER_SIZE) return CONN_IO_BUFFER_SIZE;
+  if (max > CONN_BUFFER_HARD_LIMIT) return CONN_BUFFER_HARD_LIMIT;
+  return max;
+}
+
+int pkc_read_budget(void)
+{
+  int budget = pk_state.tunnel_read_budget;
+  if (budget <= 0) return CONN_READ_BUDGET_DEFAULT;
+  return budget;
+}
+
+void pkc_buffer_stats(int* in_use, int* pooled)
+{
+  pthread_mutex_lock(&pkc_pool_lock);
+  if (in_use) *in_use = pkc_pool_in_use;
+  if (pooled) *pooled = pkc_pool_free_count;
+  pthread_mutex_unlock(&pkc_pool_lock);
+}
+
+#define PKC_OUT_BLOCKS(c) (((c)->out_buffer_start + (c)->out_buffer_pos \
+                            + CONN_IO_BUFFER_SIZE - 1) / CONN_IO_BUFFER_SIZE)
+
+/* Append to the chain of output blocks, returns how much was copied. */
+static ssize_t pkc_out_append(struct pk_conn* pkc, char* data, ssize_t length)
+{
+  ssize_t copied, bytes;
+  int end, block, offset;
+
+  if ((NULL == pkc->out_buffers) &&
+      (NULL == (pkc->out_buffers = (char**) pkc_buffer_get()))) return 0;
+
+  for (copied = 0; copied < length; copied += bytes) {
+    end = pkc->out_buffer_start + pkc->out_buffer_pos;
+    block = end / CONN_IO_BUFFER_SIZE;
+    offset = end % CONN_IO_BUFFER_SIZE;
+    if ((offset == 0) &&
+        ((block >= CONN_OUT_BUFFERS_MAX) ||
+         (NULL == (pkc->out_buffers[block] = pkc_buffer_get())))) break;
+
+    bytes = CONN_IO_BUFFER_SIZE - offset;
+    if (bytes > length - copied) bytes = length - copied;
+    memcpy(pkc->out_buffers[block] + offset, data + copied, bytes);
+    pkc->out_buffer_pos += bytes;
+  }
+  return copied;
+}
+
+/* Describe (the start of) the buffered output as an iovec. */
+static int pkc_out_iov(struct pk_conn* pkc, struct iovec* iov)
+{
+  int i, offset, left;
+
+  offset = pkc->out_buffer_start;
+  left = pkc->out_buffer_pos;
+  for (i = 0; (left > 0) && (i < CONN_FLUSH_IOV_MAX); i++) {
+    iov[i].iov_base = pkc->out_buffers[i] + offset;
+    iov[i].iov_len = CONN_IO_BUFFER_SIZE - offset;
+    if ((int) iov[i].iov_len > left) iov[i].iov_len = left;
+    left -= iov[i].iov_len;
+    offset = 0;
+  }
+  return i;
+}
+
+/* Drop bytes from the front of the output, returning drained blocks. */
+static void pkc_out_consume(struct pk_conn* pkc, ssize_t bytes)
+{
+  int i, blocks;
+
+  pkc->out_buffer_pos -= bytes;
+  pkc->out_buffer_start += bytes;
+  if (0 == pkc->out_buffer_pos) {
+    pkc_discard_output(pkc);
+  }
+  else if (0 < (blocks = pkc->out_buffer_start / CONN_IO_BUFFER_SIZE)) {
+    for (i = 0; i < blocks; i++) pkc_buffer_put(pkc->out_buffers[i]);
+    pkc->out_buffer_start -= blocks * CONN_IO_BUFFER_SIZE;
+    memmove(pkc->out_buffers, pkc->out_buffers + blocks,
+            PKC_OUT_BLOCKS(pkc) * sizeof(char*));
+  }
+}
+
+void pkc_discard_output(struct pk_conn* pkc)
+{
+  int i;
+  if (NULL != pkc->out_buffers) {
+    for (i = 0; i < PKC_OUT_BLOCKS(pkc); i++)
+      pkc_buffer_put(pkc->out_buffers[i]);
+    pkc_buffer_put((char*) pkc->out_buffers);
+    pkc->out_buffers = NULL;
+  }
+  pkc->out_buffer_pos = 0;
+  pkc->out_buffer_start = 0;
+}
 
 void pkc_reset_conn(struct pk_conn* pkc, unsigned int status)
 {
@@ -38,14 +187,29 @@ void pkc_reset_conn(struct pk_conn* pkc, unsigned int status)
   pkc->status &= ~CONN_STATUS_BITS;
   pkc->status |= status;
   pkc->activity = time(0);
-  pkc->out_buffer_pos = 0;
+  pkc_discard_output(pkc);
+  if (NULL != pkc->in_buffer) pkc_buffer_put(pkc->in_buffer);
+  pkc->in_buffer = NULL;
   pkc->in_buffer_pos = 0;
-  pkc->send_window_kb = CONN_WINDOW_SIZE_KB_MAXIMUM/2;
+  pkc->send_window_kb = CONN_WINDOW_SIZE_KB_INITIAL;
+  pkc->window_rtt = pkc->window_rtt_stamp = 0;
+  pkc->window_rate = 0;
+  pkc->window_probe_kb = 0;
+  pkc->window_probe_stamp = 0;
+  pkc->window_report_kb = 0;
+  pkc->window_report_stamp = 0;
   pkc->read_bytes = 0;
   pkc->read_kb = 0;
   pkc->sent_kb = 0;
   pkc->wrote_bytes = 0;
   pkc->reported_kb = 0;
+  pkc->reported_stamp = 0;
+  pkc->write_calls = 0;
+  pkc->write_call_bytes = 0;
+  pkc->control_bytes = 0;
+  pkc->read_calls = 0;
+  pkc->read_events = 0;
+  pkc->write_chunks = 0;
   if (pkc->sockfd >= 0) PKS_close(pkc->sockfd);
   pkc->sockfd = -1;
   pkc->state = CONN_CLEAR_DATA;
@@ -53,6 +217,7 @@ void pkc_reset_conn(struct pk_conn* pkc, unsigned int status)
   if (pkc->ssl) SSL_free(pkc->ssl);
   pkc->ssl = NULL;
   pkc->want_write = 0;
+  pkc->ktls = 0;
 #endif
 }
 
@@ -72,6 +237,30 @@ int pkc_connect(struct pk_conn* pkc, struct addrinfo* ai)
   return (pkc->sockfd = fd);
 }
 
+/* Like pkc_connect(), but without blocking: if connect() is still in
+ * progress, the conn is marked CONN_STATUS_CONNECTING and the caller
+ * should wait for it to become writable, see pkc_finish_connect(). */
+int pkc_start_connect(struct pk_conn* pkc, struct addrinfo* ai)
+{
+  int fd;
+  pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
+  errno = 0;
+  if ((0 > (fd = PKS_socket(ai->ai_family, ai->ai_socktype,
+                            ai->ai_protocol))) ||
+      (0 > set_non_blocking(fd))) {
+    if (fd >= 0) PKS_close(fd);
+    return (pk_error = ERR_CONNECT_CONNECT);
+  }
+  if (PKS_fail(PKS_connect(fd, ai->ai_addr, ai->ai_addrlen))) {
+    if ((errno != EINPROGRESS) && (errno != EWOULDBLOCK)) {
+      PKS_close(fd);
+      return (pk_error = ERR_CONNECT_CONNECT);
+    }
+    pkc->status |= CONN_STATUS_CONNECTING;
+  }
+  return (pkc->sockfd = fd);
+}
+
 #ifdef HAVE_OPENSSL
 static void pkc_start_handshake(struct pk_conn* pkc, int err)
 {
@@ -93,6 +282,20 @@ static void pkc_end_handshake(struct pk_conn *pkc)
          "%d: Finished SSL handshake", pkc->sockfd);
   pkc->status &= ~(CONN_STATUS_WANT_WRITE|CONN_STATUS_WANT_READ);
   pkc->state = CONN_SSL_DATA;
+#ifdef SSL_OP_ENABLE_KTLS
+  /* With SSL_OP_ENABLE_KTLS (see pagekite_enable_ktls), OpenSSL hands the
+   * session keys to the kernel if it supports the cipher.  Then we can
+   * write plain data to the socket and let the kernel build the records.
+   * Receiving is left to OpenSSL: with kernel TLS its SSL_read gets the
+   * plaintext from the kernel, and still handles control records such as
+   * alerts and key updates, which a plain read() would trip over. */
+  if (BIO_get_ktls_send(SSL_get_wbio(pkc->ssl))) pkc->ktls |= CONN_KTLS_SEND;
+  if (pkc->ktls || BIO_get_ktls_recv(SSL_get_rbio(pkc->ssl)))
+    pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA,
+           "%d: Kernel TLS enabled (send=%d, recv=%d)", pkc->sockfd,
+           (pkc->ktls & CONN_KTLS_SEND) ? 1 : 0,
+           BIO_get_ktls_recv(SSL_get_rbio(pkc->ssl)) ? 1 : 0);
+#endif
 }
 
 static void pkc_do_handshake(struct pk_conn *pkc)
@@ -123,10 +326,18 @@ static void pkc_do_handshake(struct pk_conn *pkc)
 }
 
 int pkc_start_ssl(struct pk_conn* pkc, SSL_CTX* ctx)
+{
+  return pkc_resume_ssl(pkc, ctx, NULL);
+}
+
+/* Like pkc_start_ssl(), but offer to resume an earlier session (if any),
+ * which saves the server a lot of work and us a round trip or two. */
+int pkc_resume_ssl(struct pk_conn* pkc, SSL_CTX* ctx, SSL_SESSION* session)
 {
   long mode;
   pkc->ssl = SSL_new(ctx);
   /* FIXME: Error checking? */
+  if (session != NULL) SSL_set_session(pkc->ssl, session);
 
   mode = SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER;
   mode |= SSL_MODE_ENABLE_PARTIAL_WRITE;
@@ -145,6 +356,36 @@ int pkc_start_ssl(struct pk_conn* pkc, SSL_CTX* ctx)
 }
 #endif
 
+/* Check whether a non-blocking connect() has completed, waiting up to
+ * timeout_ms for it.  Returns 0 once connected, 1 if still in progress and
+ * -1 (with errno set) if the connection failed. */
+int pkc_finish_connect(struct pk_conn* pkc, int timeout_ms)
+{
+  int rv, error = 0;
+  socklen_t len = sizeof(error);
+
+  if (!(pkc->status & CONN_STATUS_CONNECTING)) return 0;
+
+  do {
+    PK_TRACE_LOOP("connecting");
+    rv = wait_fd_writable(pkc->sockfd, timeout_ms);
+  } while ((rv < 0) && (errno == EINTR));
+  if (rv == 0) return 1;
+
+  if ((rv < 0) ||
+      (0 > getsockopt(PKS(pkc->sockfd), SOL_SOCKET, SO_ERROR,
+                      (void*) &error, &len))) {
+    error = errno;
+  }
+  if (error) {
+    pkc->status |= CONN_STATUS_BROKEN;
+    errno = error;
+    return -1;
+  }
+  pkc->status &= ~CONN_STATUS_CONNECTING;
+  return 0;
+}
+
 int pkc_wait(struct pk_conn* pkc, int timeout_ms)
 {
   int rv;
@@ -161,39 +402,35 @@ int pkc_wait(struct pk_conn* pkc, int timeout_ms)
 
 ssize_t pkc_read(struct pk_conn* pkc)
 {
-  char *errfmt;
-  ssize_t bytes, delta;
-  int ssl_errno = SSL_ERROR_NONE;
+  ssize_t bytes;
 
-  switch (pkc->state) {
-#ifdef HAVE_OPENSSL
-    case CONN_SSL_DATA:
-      errno = 0;
-      bytes = SSL_read(pkc->ssl, PKC_IN(*pkc), PKC_IN_FREE(*pkc));
-      if (bytes < 0) ssl_errno = SSL_get_error(pkc->ssl, bytes);
-      break;
-    case CONN_SSL_HANDSHAKE:
-      pkc_do_handshake(pkc);
-      return 0;
-#endif
-    default:
-      bytes = PKS_read(pkc->sockfd, PKC_IN(*pkc), PKC_IN_FREE(*pkc));
+  if ((NULL == pkc->in_buffer) && (NULL == (pkc->in_buffer = pkc_buffer_get())))
+    return -1;
+
+  bytes = pkc_read_into(pkc, PKC_IN(*pkc), PKC_IN_FREE(*pkc));
+  if (bytes > 0) pkc->in_buffer_pos += bytes;
+
+  if (0 == pkc->in_buffer_pos) {
+    pkc_buffer_put(pkc->in_buffer);
+    pkc->in_buffer = NULL;
   }
+  return bytes;
+}
+
+/* Bookkeeping after reading from a connection, however it was done. */
+static ssize_t pkc_read_result(struct pk_conn* pkc, ssize_t bytes,
+                               int ssl_errno)
+{
+  char *errfmt;
 
   if (bytes > 0) {
-    pkc->in_buffer_pos += bytes;
     pkc->activity = time(0);
 
-    /* Update KB counter and window... this is a bit messy. */
+    /* Update KB counter, the window adapts in pkc_window_report(). */
     pkc->read_bytes += bytes;
     while (pkc->read_bytes > 1024) {
       pkc->read_kb += 1;
       pkc->read_bytes -= 1024;
-      if ((pkc->read_kb & 0x1f) == 0x00) {
-        delta = (CONN_WINDOW_SIZE_KB_MAXIMUM - pkc->send_window_kb);
-        if (delta < 0) delta = 0;
-        pkc->send_window_kb += (delta/CONN_WINDOW_SIZE_STEPFACTOR);
-      }
     }
   }
   else if (bytes == 0) {
@@ -236,15 +473,63 @@ ssize_t pkc_read(struct pk_conn* pkc)
   return bytes;
 }
 
+/* Like pkc_read(), but reads into a caller supplied buffer (such as the
+ * free space of a pk_parser) instead of the in_buffer. */
+ssize_t pkc_read_into(struct pk_conn* pkc, char* buffer, ssize_t length)
+{
+  ssize_t bytes;
+  int ssl_errno = SSL_ERROR_NONE;
+
+  pkc->read_calls++;
+  switch (pkc->state) {
+#ifdef HAVE_OPENSSL
+    case CONN_SSL_DATA:
+      errno = 0;
+      bytes = SSL_read(pkc->ssl, buffer, length);
+      if (bytes < 0) ssl_errno = SSL_get_error(pkc->ssl, bytes);
+      break;
+    case CONN_SSL_HANDSHAKE:
+      pkc_do_handshake(pkc);
+      return 0;
+#endif
+    default:
+      bytes = PKS_read(pkc->sockfd, buffer, length);
+  }
+  return pkc_read_result(pkc, bytes, ssl_errno);
+}
+
+/* Bytes which have already been read from the socket and decrypted, but
+ * not yet returned by pkc_read_into().  The socket will not report these
+ * as readable, so readers must drain them before waiting for events. */
+int pkc_pending(struct pk_conn* pkc)
+{
+#ifdef HAVE_OPENSSL
+  if ((pkc->state == CONN_SSL_DATA) && (pkc->ssl != NULL))
+    return SSL_pending(pkc->ssl);
+#endif
+  (void) pkc;
+  return 0;
+}
+
+/* Once the kernel does the encrypting, writes are just plain writes. */
+#ifdef HAVE_OPENSSL
+#define PKC_WRITE_STATE(c) ((((c)->state == CONN_SSL_DATA) && \
+                             ((c)->ktls & CONN_KTLS_SEND)) ? CONN_CLEAR_DATA \
+                                                           : (c)->state)
+#else
+#define PKC_WRITE_STATE(c) ((c)->state)
+#endif
+
 ssize_t pkc_raw_write(struct pk_conn* pkc, char* data, ssize_t length) {
   ssize_t wrote = 0;
   errno = 0;
-  switch (pkc->state) {
+  switch (PKC_WRITE_STATE(pkc)) {
 #ifdef HAVE_OPENSSL
     case CONN_SSL_DATA:
       if (pkc->want_write > 0) length = pkc->want_write;
       pkc->want_write = 0;
       if (length) {
+        pkc->write_calls++;
         wrote = SSL_write(pkc->ssl, data, length);
         if (wrote < 0) {
           int err = SSL_get_error(pkc->ssl, wrote);
@@ -272,25 +557,140 @@ ssize_t pkc_raw_write(struct pk_conn* pkc, char* data, ssize_t length) {
 #endif
 
     default:
-      if (length)
+      if (length) {
+        pkc->write_calls++;
         wrote = PKS_write(pkc->sockfd, data, length);
+      }
+  }
+  if (wrote > 0) {
+    pkc->wrote_bytes += wrote;
+    pkc->write_call_bytes += wrote;
+  }
+  return wrote;
+}
+
+ssize_t pkc_raw_writev(struct pk_conn* pkc, struct iovec* iov, int iovcnt) {
+  ssize_t wrote = 0;
+#ifdef HAVE_OPENSSL
+  char gather[CONN_SSL_GATHER_SIZE];
+  size_t length, bytes;
+  int i;
+#endif
+
+  errno = 0;
+  switch (PKC_WRITE_STATE(pkc)) {
+#ifdef HAVE_OPENSSL
+    case CONN_SSL_DATA:
+      /* SSL has no writev, but one SSL_write of the gathered data still
+       * beats one per buffer (and one TLS record for each). */
+      for (length = i = 0; (i < iovcnt) && (length < sizeof(gather)); i++) {
+        bytes = iov[i].iov_len;
+        if (bytes > sizeof(gather) - length) bytes = sizeof(gather) - length;
+        memcpy(gather + length, iov[i].iov_base, bytes);
+        length += bytes;
+      }
+      return pkc_raw_write(pkc, gather, length);
+
+    case CONN_SSL_HANDSHAKE:
+      pkc_do_handshake(pkc);
+      return 0;
+#endif
+
+    default:
+      pkc->write_calls++;
+      wrote = PKS_writev(pkc->sockfd, iov, iovcnt);
+  }
+  if (wrote > 0) {
+    pkc->wrote_bytes += wrote;
+    pkc->write_call_bytes += wrote;
   }
-  if (wrote > 0) pkc->wrote_bytes += wrote;
   return wrote;
 }
 
-void pkc_report_progress(struct pk_conn* pkc, char *sid, struct pk_conn* feconn)
+/* Is it time to tell the remote end how much we have written?  Returns 1
+ * if so, 0 if there is nothing worth reporting yet and -1 if we reported
+ * very recently and the report can wait a little. */
+int pkc_report_due(struct pk_conn* pkc, ev_tstamp now)
 {
-  char buffer[256];
-  int bytes;
-  if (pkc->wrote_bytes > CONN_REPORT_INCREMENT*1024) {
-    pkc->reported_kb += (pkc->wrote_bytes/1024);
-    pkc->wrote_bytes %= 1024;
-    bytes = pk_format_skb(buffer, sid, pkc->reported_kb);
-    pkc_write(feconn, buffer, bytes);
-    pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA,
-           "%d: sid=%s, wrote_bytes=%d, reported_kb=%d",
-           pkc->sockfd, sid, pkc->wrote_bytes, pkc->reported_kb);
+  if (pkc->wrote_bytes <= CONN_REPORT_INCREMENT*1024) return 0;
+  if ((pkc->wrote_bytes > CONN_REPORT_URGENT*1024) ||
+      (now >= pkc->reported_stamp + CONN_REPORT_INTERVAL)) return 1;
+  return -1;
+}
+
+/* Format an SKB progress report (at most PK_SKB_MAXSIZE bytes) into
+ * buffer, counting the data it covers as reported. */
+size_t pkc_format_progress(struct pk_conn* pkc, const char* sid,
+                           char* buffer, ev_tstamp now)
+{
+  pkc->reported_kb += (pkc->wrote_bytes/1024);
+  pkc->wrote_bytes %= 1024;
+  pkc->reported_stamp = now;
+  pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA,
+         "%d: sid=%s, wrote_bytes=%d, reported_kb=%d",
+         pkc->sockfd, sid, pkc->wrote_bytes, pkc->reported_kb);
+  return pk_format_skb(buffer, sid, pkc->reported_kb);
+}
+
+/* Start timing delivery of the data read so far, unless already timing
+ * something.  Call after reading from a stream. */
+void pkc_window_probe(struct pk_conn* pkc, ev_tstamp now)
+{
+  if ((0 < pkc->window_probe_stamp) || (pkc->read_kb <= pkc->sent_kb)) return;
+  pkc->window_probe_kb = pkc->read_kb;
+  pkc->window_probe_stamp = now;
+}
+
+/* The remote end has sent sent_kb of our data: update the round trip (the
+ * fastest recent probe) and delivery rate estimates, and from them the
+ * window, clamped to [min_kb, max_kb]. */
+void pkc_window_report(struct pk_conn* pkc, size_t sent_kb, ev_tstamp now,
+                       int min_kb, int max_kb)
+{
+  ev_tstamp elapsed;
+  double rate, window;
+
+  if ((0 < pkc->window_probe_stamp) && (sent_kb >= pkc->window_probe_kb)) {
+    elapsed = now - pkc->window_probe_stamp;
+    pkc->window_probe_stamp = 0;
+    if ((0 < elapsed) &&
+        ((0 >= pkc->window_rtt) || (elapsed < pkc->window_rtt) ||
+         (now > pkc->window_rtt_stamp + CONN_WINDOW_RTT_EXPIRE))) {
+      pkc->window_rtt = elapsed;
+      pkc->window_rtt_stamp = now;
+    }
+  }
+
+  if (0 >= pkc->window_report_stamp) {
+    pkc->window_report_kb = sent_kb;
+    pkc->window_report_stamp = now;
+  }
+  else if ((sent_kb > pkc->window_report_kb) &&
+           (0 < (elapsed = now - pkc->window_report_stamp))) {
+    rate = (sent_kb - pkc->window_report_kb) / elapsed;
+    if (0 < pkc->window_rate)
+      pkc->window_rate = (3 * pkc->window_rate + rate) / 4;
+    else
+      pkc->window_rate = rate;
+    pkc->window_report_kb = sent_kb;
+    pkc->window_report_stamp = now;
+  }
+  if (sent_kb > pkc->sent_kb) pkc->sent_kb = sent_kb;
+
+  window = pkc->send_window_kb;
+  if ((0 < pkc->window_rtt) && (0 < pkc->window_rate))
+    window = CONN_WINDOW_GAIN * pkc->window_rate * pkc->window_rtt;
+  if (window > max_kb) window = max_kb;
+  if (window < min_kb) window = min_kb;
+  pkc->send_window_kb = window;
+}
+
+/* The remote end asked us to slow down. */
+void pkc_window_throttle(struct pk_conn* pkc, int min_kb)
+{
+  if (pkc->send_window_kb > (size_t) min_kb) {
+    pkc->send_window_kb *= 0.8;
+    if (pkc->send_window_kb < (size_t) min_kb) pkc->send_window_kb = min_kb;
   }
 }
 
@@ -298,6 +698,8 @@ ssize_t pkc_flush(struct pk_conn* pkc, char *data, ssize_t length, int mode,
                   char* where)
 {
   ssize_t flushed, wrote, bytes;
+  struct iovec iov[CONN_FLUSH_IOV_MAX];
+  int iovcnt;
   flushed = wrote = errno = bytes = 0;
 
   if (pkc->sockfd < 0) {
@@ -306,6 +708,18 @@ ssize_t pkc_flush(struct pk_conn* pkc, char *data, ssize_t length, int mode,
     return -1;
   }
 
+  /* Nothing can be written before connect() completes.  Normally we just
+   * leave the data buffered, but a blocking flush has to wait for it. */
+  if (pkc->status & CONN_STATUS_CONNECTING) {
+    if (mode != BLOCKING_FLUSH) return 0;
+    if (0 != pkc_finish_connect(pkc, CONN_CONNECT_TIMEOUT_DEFAULT * 1000)) {
+      pkc->status |= CONN_STATUS_CLS_WRITE;
+      pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA,
+             "%d[%s]: connect failed, errno=%d", pkc->sockfd, where, errno);
+      return -1;
+    }
+  }
+
   if (mode == BLOCKING_FLUSH) {
     pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA,
            "%d[%s]: Attempting blocking flush", pkc->sockfd, where);
@@ -317,14 +731,15 @@ ssize_t pkc_flush(struct pk_conn* pkc, char *data, ssize_t length, int mode,
   /* First, flush whatever was in the conn buffers */
   do {
     PK_TRACE_LOOP("flushing");
-    wrote = pkc_raw_write(pkc, pkc->out_buffer, pkc->out_buffer_pos);
+    if (0 < pkc->out_buffer_pos) {
+      iovcnt = pkc_out_iov(pkc, iov);
+      wrote = pkc_raw_writev(pkc, iov, iovcnt);
+    }
+    else {
+      wrote = pkc_raw_write(pkc, NULL, 0);
+    }
     if (wrote > 0) {
-      if (pkc->out_buffer_pos > wrote) {
-        memmove(pkc->out_buffer,
-                pkc->out_buffer + wrote,
-                pkc->out_buffer_pos - wrote);
-      }
-      pkc->out_buffer_pos -= wrote;
+      pkc_out_consume(pkc, wrote);
       flushed += wrote;
     }
     else if ((errno != EINTR) && (errno != 0))
@@ -374,17 +789,44 @@ ssize_t pkc_flush(struct pk_conn* pkc, char *data, ssize_t length, int mode,
   return flushed;
 }
 
+static ssize_t pkc_overflow(struct pk_conn* pkc, ssize_t lost, char* where)
+{
+  pkc->status |= CONN_STATUS_CLS_WRITE;
+  pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA|PK_LOG_ERROR,
+         "%d[%s]: Output buffer overflow, %d bytes lost, closing",
+         pkc->sockfd, where, (int) lost);
+  return -1;
+}
+
+/* Corked connections just collect small writes, which their owner flushes
+ * once per event loop iteration; we only flush here once a full TLS record
+ * (or more) has piled up.  Large writes take the usual path, uncopied. */
+#define PKC_CORKED(c, length) (((c)->status & CONN_STATUS_CORKED) && \
+                               ((length) < CONN_CORK_THRESHOLD))
+static void pkc_cork_check(struct pk_conn* pkc)
+{
+  if (pkc->out_buffer_pos >= CONN_CORK_THRESHOLD)
+    pkc_flush(pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkc_cork_check");
+}
+
 ssize_t pkc_write(struct pk_conn* pkc, char* data, ssize_t length)
 {
-  ssize_t wleft;
   ssize_t wrote = 0;
 
+  if (PKC_CORKED(pkc, length)) {
+    wrote = pkc_out_append(pkc, data, length);
+    if (wrote < length) return pkc_overflow(pkc, length-wrote, "pkc_write");
+    pkc_cork_check(pkc);
+    return length;
+  }
+
   /* 1. Try to flush already buffered data. */
   if (pkc->out_buffer_pos)
     pkc_flush(pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkc_write/1");
 
   /* 2. If successful, try to write new data (0 copies!) */
-  if (0 == pkc->out_buffer_pos) {
+  if ((0 == pkc->out_buffer_pos) &&
+      !(pkc->status & CONN_STATUS_CONNECTING)) {
     errno = 0;
     do {
       PK_TRACE_LOOP("writing");
@@ -396,17 +838,411 @@ ssize_t pkc_write(struct pk_conn* pkc, char* data, ssize_t length)
     if (wrote < 0) /* Ignore errors, for now */
       wrote = 0;
 
-    wleft = length-wrote;
-    if (wleft <= PKC_OUT_FREE(*pkc)) {
-      /* 2a. Have data left, there is space in our buffer: buffer it! */
-      memcpy(PKC_OUT(*pkc), data+wrote, wleft);
-      pkc->out_buffer_pos += wleft;
+    /* 3. Buffer the rest, the event loop flushes it later.  Writers should
+     *    back off once PKC_OUT_BLOCKED, but we never block here: if the
+     *    buffer overflows regardless, this connection is a lost cause. */
+    wrote += pkc_out_append(pkc, data+wrote, length-wrote);
+    if (wrote < length) return pkc_overflow(pkc, length-wrote, "pkc_write");
+  }
+
+  return length;
+}
+
+ssize_t pkc_writev(struct pk_conn* pkc, struct iovec* iov, int iovcnt)
+{
+  ssize_t length, bytes, copied, wrote = 0;
+  size_t skip;
+  int i;
+
+  for (length = i = 0; i < iovcnt; i++) length += iov[i].iov_len;
+
+  if (PKC_CORKED(pkc, length)) {
+    for (i = 0; i < iovcnt; i++) {
+      copied = pkc_out_append(pkc, iov[i].iov_base, iov[i].iov_len);
+      wrote += copied;
+      if (copied < (ssize_t) iov[i].iov_len)
+        return pkc_overflow(pkc, length-wrote, "pkc_writev");
     }
-    else {
-      /* 2b. If new+old data > buffer size, do a blocking write. */
-      pkc_flush(pkc, data+wrote, length-wrote, BLOCKING_FLUSH, "pkc_write/2");
+    pkc_cork_check(pkc);
+    return length;
+  }
+
+  /* 1. Try to flush already buffered data. */
+  if (pkc->out_buffer_pos)
+    pkc_flush(pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkc_writev/1");
+
+  /* 2. If successful, write all the buffers in one go (0 copies!) */
+  if ((0 == pkc->out_buffer_pos) &&
+      !(pkc->status & CONN_STATUS_CONNECTING)) {
+    errno = 0;
+    do {
+      PK_TRACE_LOOP("writing");
+      wrote = pkc_raw_writev(pkc, iov, iovcnt);
+    } while ((wrote < 0) && ((errno == EINTR) || (errno == 0)));
+  }
+  if (wrote < 0) /* Ignore errors, for now */
+    wrote = 0;
+
+  /* 3. Buffer whatever is left, in order. */
+  if (wrote < length) {
+    skip = wrote;
+    for (i = 0; i < iovcnt; i++) {
+      if (skip >= iov[i].iov_len) {
+        skip -= iov[i].iov_len;
+        continue;
+      }
+      bytes = iov[i].iov_len - skip;
+      copied = pkc_out_append(pkc, (char*) iov[i].iov_base + skip, bytes);
+      wrote += copied;
+      if (copied < bytes) return pkc_overflow(pkc, length-wrote, "pkc_writev");
+      skip = 0;
+    }
+  }
+
+  return length;
+}
+
+/* Zero-copy relaying: data moves from one socket to another through a
+ * pipe, without passing through user space.  This needs plain sockets on
+ * both ends (kernel TLS will do for the destination), and a destination
+ * with nothing buffered, as otherwise the data would end up copied anyway.
+ */
+int pkc_can_splice(struct pk_conn* src, struct pk_conn* dst)
+{
+#ifdef HAVE_SPLICE
+  return ((src->state == CONN_CLEAR_DATA) &&
+          (PKC_WRITE_STATE(dst) == CONN_CLEAR_DATA) &&
+          (0 == dst->out_buffer_pos) &&
+          !(dst->status & (CONN_STATUS_CONNECTING|CONN_STATUS_CLS_WRITE)));
+#else
+  (void) src;
+  (void) dst;
+  return 0;
+#endif
+}
+
+/* Create a non-blocking pipe for pkc_splice_in() and pkc_splice_out(). */
+int pkc_splice_pipe(int* fds)
+{
+#ifdef HAVE_SPLICE
+  if (0 == pipe2(fds, O_NONBLOCK|O_CLOEXEC)) return 0;
+#endif
+  fds[0] = fds[1] = -1;
+  return -1;
+}
+
+/* Like pkc_read_into(), but the data goes into a pipe. */
+ssize_t pkc_splice_in(struct pk_conn* pkc, int pipe_w, ssize_t length)
+{
+  ssize_t bytes = -1;
+
+  pkc->read_calls++;
+  errno = 0;
+#ifdef HAVE_SPLICE
+  bytes = splice(pkc->sockfd, NULL, pipe_w, NULL, length,
+                 SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+#else
+  (void) pipe_w;
+  (void) length;
+  errno = ENOSYS;
+#endif
+  return pkc_read_result(pkc, bytes, SSL_ERROR_NONE);
+}
+
+/* Write a header and then length bytes waiting in a pipe (all of it, see
+ * pkc_splice_in).  Whatever the socket won't take right away is read back
+ * from the pipe and buffered, so the pipe is always left empty and the
+ * data stays in order. */
+ssize_t pkc_splice_out(struct pk_conn* pkc, int pipe_r,
+                       char* header, ssize_t header_length, ssize_t length)
+{
+  char buffer[CONN_IO_BUFFER_SIZE];
+  ssize_t wrote, moved, bytes;
+
+  wrote = moved = 0;
+  if (0 == pkc->out_buffer_pos) {
+    wrote = pkc_raw_write(pkc, header, header_length);
+    if (wrote < 0) wrote = 0;
+  }
+  if (wrote < header_length) {
+    if (0 > pkc_write(pkc, header + wrote, header_length - wrote)) return -1;
+  }
+#ifdef HAVE_SPLICE
+  else {
+    pkc->write_calls++;
+    moved = splice(pipe_r, NULL, pkc->sockfd, NULL, length,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (moved > 0) {
+      pkc->wrote_bytes += moved;
+      pkc->write_call_bytes += moved;
     }
+    else moved = 0; /* Ignore errors, for now */
   }
+#endif
 
+  while (moved < length) {
+    bytes = length - moved;
+    if (bytes > (ssize_t) sizeof(buffer)) bytes = sizeof(buffer);
+    if (0 >= (bytes = read(pipe_r, buffer, bytes))) return -1;
+    if (0 > pkc_write(pkc, buffer, bytes)) return -1;
+    moved += bytes;
+  }
   return length;
 }
+
+
+/**[ Tests ]******************************************************************/
+
+#if PK_TESTS
+static int pkconn_test_read_all(int fd, char* buffer, int length)
+{
+  int rv, got = 0;
+  while ((got < length) && (0 < (rv = read(fd, buffer + got, length - got))))
+    got += rv;
+  return got;
+}
+
+/* Simulate a stream over a link of rate_kbms KB/ms and rtt_ms round trips,
+ * with the remote end reporting progress every 10ms, and return how much
+ * was delivered during the last second (and the final window). */
+#define PKCONN_TEST_SIM_MS 5000
+static size_t pkconn_test_window(int rate_kbms, int rtt_ms, int max_kb,
+                                 size_t* window)
+{
+  static size_t delivered[PKCONN_TEST_SIM_MS];
+  struct pk_conn pkc;
+  size_t queued, allowed, total;
+  int t;
+
+  memset(&pkc, 0, sizeof(pkc));
+  pkc.sockfd = -1;
+  pkc_reset_conn(&pkc, 0);
+  for (queued = total = t = 0; t < PKCONN_TEST_SIM_MS; t++) {
+    if ((t >= rtt_ms) && (0 == t % 10))
+      pkc_window_report(&pkc, delivered[t - rtt_ms], t / 1000.0,
+                        CONN_WINDOW_SIZE_KB_MINIMUM, max_kb);
+    assert(pkc.send_window_kb <= (size_t) max_kb);
+
+    allowed = pkc.sent_kb + pkc.send_window_kb;
+    if (pkc.read_kb < allowed) {
+      queued += allowed - pkc.read_kb;
+      pkc.read_kb = allowed;
+      pkc_window_probe(&pkc, t / 1000.0);
+    }
+    allowed = (queued < (size_t) rate_kbms) ? queued : (size_t) rate_kbms;
+    queued -= allowed;
+    delivered[t] = (total += allowed);
+  }
+  *window = pkc.send_window_kb;
+  return total - delivered[PKCONN_TEST_SIM_MS - 1001];
+}
+#endif
+
+int pkconn_test(void)
+{
+#if PK_TESTS
+  struct pk_conn pkc;
+  struct iovec iov[2];
+  char hdr[16], data[1000], *sent, *received;
+  int sv[2], chunks, length, got, lsock, asock, i, in_use, pooled;
+  size_t window;
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+
+  /* Idle connections no longer carry inline buffers. */
+  assert(sizeof(struct pk_conn) < 1024);
+  pkc_buffer_stats(&in_use, NULL);
+
+  assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  set_non_blocking(sv[1]);
+  memset(&pkc, 0, sizeof(pkc));
+  pkc.sockfd = -1;
+  pkc_reset_conn(&pkc, 0);
+  pkc.sockfd = sv[0];
+  set_non_blocking(pkc.sockfd);
+
+  /* Header and data leave in a single syscall. */
+  iov[0].iov_base = "abc";
+  iov[0].iov_len = 3;
+  iov[1].iov_base = "defgh";
+  iov[1].iov_len = 5;
+  assert(8 == pkc_writev(&pkc, iov, 2));
+  assert(1 == pkc.write_calls);
+  assert(0 == pkc.out_buffer_pos);
+  assert(8 == pkconn_test_read_all(sv[1], data, sizeof(data)));
+  assert(0 == strncmp(data, "abcdefgh", 8));
+  pkc_buffer_stats(&i, NULL);
+  assert(i == in_use);
+
+  /* Fill the socket and then our buffer; leftovers must be buffered, in
+   * order, in as many pool blocks as it takes. */
+  assert(NULL != (sent = malloc(4 * 1024 * 1024)));
+  assert(NULL != (received = malloc(4 * 1024 * 1024)));
+  for (length = chunks = 0;
+       PKC_OUT_FREE(pkc) >= 8 + (int) sizeof(data);
+       chunks++) {
+    assert(length + 2000 < 4 * 1024 * 1024);
+    sprintf(hdr, "%8.8x", chunks);
+    memset(data, 'a' + chunks % 26, sizeof(data));
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 8;
+    iov[1].iov_base = data;
+    iov[1].iov_len = sizeof(data);
+    memcpy(sent + length, hdr, 8);
+    memcpy(sent + length + 8, data, sizeof(data));
+    length += 8 + sizeof(data);
+    assert(8 + (int) sizeof(data) == pkc_writev(&pkc, iov, 2));
+  }
+  assert(pkc.out_buffer_pos > CONN_IO_BUFFER_SIZE);
+  pkc_buffer_stats(&i, NULL);
+  assert(i - in_use >= pkc.out_buffer_pos / CONN_IO_BUFFER_SIZE);
+  for (got = 0; got < length; ) {
+    got += pkconn_test_read_all(sv[1], received + got, length - got);
+    pkc_flush(&pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkconn_test");
+  }
+  assert(0 == pkc.out_buffer_pos);
+  assert(0 == memcmp(sent, received, length));
+  pkc_buffer_stats(&i, &pooled);
+  assert(i == in_use);
+  assert(0 < pooled);
+
+  /* Corked: small writes pile up until a whole TLS record's worth. */
+  pkc.status |= CONN_STATUS_CORKED;
+  pkc.write_calls = pkc.write_call_bytes = 0;
+  for (i = 0; i < 100; i++) {
+    assert(8 == pkc_writev(&pkc, iov, 1));
+    assert(3 == pkc_write(&pkc, "SKB", 3));
+  }
+  assert(0 == pkc.write_calls);
+  assert(1100 == pkc.out_buffer_pos);
+  pkc_flush(&pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkconn_test");
+  assert(1 == pkc.write_calls);
+  assert(1100 == pkc.write_call_bytes);
+  assert(1100 == pkconn_test_read_all(sv[1], received, length));
+  for (i = 0; pkc.write_calls < 2; i++) {
+    assert(sizeof(data) == pkc_write(&pkc, data, sizeof(data)));
+  }
+  assert((i * (int) sizeof(data)) >= CONN_CORK_THRESHOLD);
+  assert(0 == pkc.out_buffer_pos);
+  assert(i * sizeof(data) == pkc.write_call_bytes - 1100);
+  assert(i * sizeof(data) ==
+         (size_t) pkconn_test_read_all(sv[1], received, length));
+
+  free(sent);
+  free(received);
+  pkc_reset_conn(&pkc, 0);
+  close(sv[1]);
+
+  /* Adaptive flow control fills a long, fat link (5 MB/s, 200ms round
+   * trips, 1 MB bandwidth-delay product) but respects the maximum, and
+   * keeps the window small when the front-end is close. */
+  assert(pkconn_test_window(5, 200, CONN_WINDOW_SIZE_KB_MAXIMUM, &window)
+         > 4500);
+  assert(window > 1000);
+  assert(pkconn_test_window(5, 200, 256, &window) <= 256 * 1000 / 200);
+  assert(window == 256);
+  assert(pkconn_test_window(5, 10, CONN_WINDOW_SIZE_KB_MAXIMUM, &window)
+         > 4500);
+  assert(window < 512);
+
+  /* Non-blocking connect: data waits in the buffer until it completes. */
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(0 <= (lsock = socket(AF_INET, SOCK_STREAM, 0)));
+  assert(0 == bind(lsock, (struct sockaddr*) &addr, sizeof(addr)));
+  assert(0 == listen(lsock, 1));
+  assert(0 == getsockname(lsock, (struct sockaddr*) &addr, &addr_len));
+
+  assert(0 <= (pkc.sockfd = socket(AF_INET, SOCK_STREAM, 0)));
+  set_non_blocking(pkc.sockfd);
+  if (0 > connect(pkc.sockfd, (struct sockaddr*) &addr, sizeof(addr))) {
+    assert(errno == EINPROGRESS);
+    pkc.status |= CONN_STATUS_CONNECTING;
+  }
+  assert(5 == pkc_write(&pkc, "hello", 5));
+  assert((pkc.status & CONN_STATUS_CONNECTING) ? (5 == pkc.out_buffer_pos)
+                                                : (0 == pkc.out_buffer_pos));
+  assert(0 == pkc_finish_connect(&pkc, 1000));
+  assert(!(pkc.status & CONN_STATUS_CONNECTING));
+  assert(0 <= (asock = accept(lsock, NULL, NULL)));
+  pkc_flush(&pkc, NULL, 0, BLOCKING_FLUSH, "pkconn_test");
+  assert(5 == pkconn_test_read_all(asock, data, 5));
+  assert(0 == strncmp(data, "hello", 5));
+  pkc_reset_conn(&pkc, 0);
+  close(asock);
+
+  /* Connecting to a closed port fails, and says so. */
+  close(lsock);
+  assert(0 <= (pkc.sockfd = socket(AF_INET, SOCK_STREAM, 0)));
+  set_non_blocking(pkc.sockfd);
+  if (0 > connect(pkc.sockfd, (struct sockaddr*) &addr, sizeof(addr))) {
+    if (errno == EINPROGRESS) {
+      pkc.status |= CONN_STATUS_CONNECTING;
+      assert(-1 == pkc_finish_connect(&pkc, 1000));
+      assert(errno == ECONNREFUSED);
+      assert(pkc.status & CONN_STATUS_BROKEN);
+    }
+    else assert(errno == ECONNREFUSED);
+  }
+  pkc_reset_conn(&pkc, 0);
+#endif
+  return 1;
+}
+
+/* Benchmarks, run by bench.c (make runbench). */
+int pkconn_bench(void)
+{
+#if PK_TESTS
+  static char data[4096], sink[64 * 1024];
+  const int sizes[] = {64, 1024, 4000};
+  struct pk_conn pkc;
+  struct iovec iov[2];
+  char hdr[32];
+  int sv[2], i, n, s, way;
+  size_t calls[2];
+  ev_tstamp t[2];
+
+  assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  set_non_blocking(sv[1]);
+  memset(&pkc, 0, sizeof(pkc));
+  pkc.sockfd = -1;
+  pkc_reset_conn(&pkc, 0);
+  pkc.sockfd = sv[0];
+  set_non_blocking(pkc.sockfd);
+
+  /* Syscalls per chunk: header and data in one pkc_writev(), versus one
+   * pkc_write() each as before */
+  n = 20000;
+  for (s = 0; s < 3; s++) {
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sprintf(hdr, "%x\r\nSID: 1a2b\r\n\r\n", 14 + sizes[s]);
+    iov[1].iov_base = data;
+    iov[1].iov_len = sizes[s];
+    for (way = 0; way < 2; way++) {
+      pkc.write_calls = 0;
+      t[way] = ev_time();
+      for (i = 0; i < n; i++) {
+        if (way == 0) {
+          pkc_writev(&pkc, iov, 2);
+        }
+        else {
+          pkc_write(&pkc, hdr, iov[0].iov_len);
+          pkc_write(&pkc, data, sizes[s]);
+        }
+        while (0 < read(sv[1], sink, sizeof(sink)));
+      }
+      t[way] = ev_time() - t[way];
+      calls[way] = pkc.write_calls;
+      assert(0 == pkc.out_buffer_pos);
+    }
+    printf("pkconn: %4d B chunks: %.2f syscalls/chunk (%.2f us) with writev, "
+           "%.2f (%.2f us) without\n", sizes[s],
+           (double) calls[0] / n, 1e6 * t[0] / n,
+           (double) calls[1] / n, 1e6 * t[1] / n);
+  }
+  pkc_reset_conn(&pkc, 0);
+  close(sv[1]);
+#endif
+  return 1;
+}
@@ -21,14 +21,22 @@ Note: For alternate license terms, see the file COPYING.md.
 #define BLOCKING_FLUSH 1
 #define NON_BLOCKING_FLUSH 0
 
-/* These are the controlling parameters for our flow control - in order
- * to minimize buffer bloat, we want to keep the window relatively small
- * and assume that selecting a nearby front-end will keep this from
- * becoming too big a bottleneck on transfer speeds. */
-#define CONN_WINDOW_SIZE_KB_MAXIMUM 256
-#define CONN_WINDOW_SIZE_KB_MINIMUM  16
-#define CONN_WINDOW_SIZE_STEPFACTOR  16 /* Lower: more aggressive/volatile */
-#define CONN_REPORT_INCREMENT        16
+/* These are the controlling parameters for our flow control.  The window
+ * tracks twice the bandwidth-delay product, as estimated from the timing
+ * of the remote end's progress reports (see pkc_window_report), so nearby
+ * front-ends get small windows (little buffer bloat) and distant ones get
+ * the window they need to fill the link.  Managers may narrow the range. */
+#define CONN_WINDOW_SIZE_KB_MAXIMUM 4096
+#define CONN_WINDOW_SIZE_KB_MINIMUM   16
+#define CONN_WINDOW_SIZE_KB_INITIAL  128
+#define CONN_WINDOW_GAIN               2
+#define CONN_WINDOW_RTT_EXPIRE        10 /* Seconds before re-measuring */
+#define CONN_REPORT_INCREMENT         16 /* KB written before reporting */
+#define CONN_REPORT_URGENT            64 /* KB, report regardless of...   */
+#define CONN_REPORT_INTERVAL        0.05 /* ...seconds since last report  */
+
+/* Default time allowed for backend connections to be established. */
+#define CONN_CONNECT_TIMEOUT_DEFAULT 10 /* Seconds */
 
 typedef enum {
   CONN_TUNNEL_BLOCKED,
@@ -45,7 +53,21 @@ typedef enum {
 #endif
 } io_state_t;
 
-#define CONN_IO_BUFFER_SIZE     PARSER_BYTES_MAX
+/* Connection buffers are CONN_IO_BUFFER_SIZE blocks from a shared pool:
+ * idle connections hold none.  Buffered output is a chain of blocks, listed
+ * in an index which is itself a pool block.  Writers are asked to back off
+ * once pk_state.conn_buffer_max bytes are waiting (see pkc_buffer_max), and
+ * output beyond CONN_BUFFER_HARD_LIMIT closes the connection for writing. */
+#define CONN_IO_BUFFER_SIZE     (PARSER_BYTES_MAX)
+#define CONN_BUFFER_MAX_DEFAULT (64 * 1024)
+#define CONN_OUT_BUFFERS_MAX    (CONN_IO_BUFFER_SIZE / (int) sizeof(char*))
+#define CONN_BUFFER_HARD_LIMIT  ((CONN_OUT_BUFFERS_MAX - 1) * CONN_IO_BUFFER_SIZE)
+#define CONN_FLUSH_IOV_MAX      64
+#define CONN_BUFFER_POOL_MAX    1024 /* Free blocks kept for reuse */
+#define CONN_SSL_GATHER_SIZE    (16 * 1024) /* One TLS record */
+#define CONN_READ_BUDGET_DEFAULT (64 * 1024) /* Tunnel bytes per wakeup */
+#define CONN_CORK_THRESHOLD     (CONN_SSL_GATHER_SIZE) /* Flush corked early */
+#define CONN_KTLS_SEND          0x1  /* Kernel encrypts what we write     */
 #define CONN_STATUS_BITS        0x0000FFFF
 #define CONN_STATUS_UNKNOWN     0x00000000
 #define CONN_STATUS_END_READ    0x00000001 /* Don't want more data     */
@@ -59,8 +81,10 @@ typedef enum {
 #define CONN_STATUS_ALLOCATED   0x00000080
 #define CONN_STATUS_WANT_READ   0x00000100 /* Want null reads when available  */
 #define CONN_STATUS_WANT_WRITE  0x00000200 /* Want null writes when available */
-#define PKC_OUT(c)      ((c).out_buffer + (c).out_buffer_pos)
-#define PKC_OUT_FREE(c) (CONN_IO_BUFFER_SIZE - (c).out_buffer_pos)
+#define CONN_STATUS_CONNECTING  0x00000400 /* Non-blocking connect() pending  */
+#define CONN_STATUS_CORKED      0x00000800 /* Buffer small writes for later   */
+#define PKC_OUT_FREE(c) (pkc_buffer_max() - (c).out_buffer_pos)
+#define PKC_OUT_BLOCKED(c) (0 >= PKC_OUT_FREE(c))
 #define PKC_IN(c)       ((c).in_buffer + (c).in_buffer_pos)
 #define PKC_IN_FREE(c)  (CONN_IO_BUFFER_SIZE - (c).in_buffer_pos)
 struct pk_conn {
@@ -73,32 +97,76 @@ struct pk_conn {
   size_t     read_kb;
   size_t     sent_kb;
   size_t     send_window_kb;
+  /* Adaptive flow control: round trip and delivery rate estimates */
+  ev_tstamp  window_rtt;          /* Fastest recent report, seconds */
+  ev_tstamp  window_rtt_stamp;
+  double     window_rate;         /* Smoothed delivery rate, KB/s   */
+  size_t     window_probe_kb;     /* Timing delivery of this KB...  */
+  ev_tstamp  window_probe_stamp;  /* ... read at this time, or 0    */
+  size_t     window_report_kb;    /* Progress at the last report    */
+  ev_tstamp  window_report_stamp;
   /* Data we have written locally, what we've reported to tunnel. */
   size_t     wrote_bytes;
   size_t     reported_kb;
-  /* Buffers, events */
+  ev_tstamp  reported_stamp;
+  /* Write statistics: syscalls (or SSL_writes), bytes they wrote, chunks
+   * written and bytes of control frames (SKB, EOF, PING...) written */
+  size_t     write_calls;
+  size_t     write_call_bytes;
+  size_t     control_bytes;
+  size_t     write_chunks;
+  /* Read statistics: syscalls (or SSL_reads) vs. readiness events */
+  size_t     read_calls;
+  size_t     read_events;
+  /* Buffers (from the pool, NULL when not in use), events */
   int        in_buffer_pos;
-  char       in_buffer[CONN_IO_BUFFER_SIZE];
-  int        out_buffer_pos;
-  char       out_buffer[CONN_IO_BUFFER_SIZE];
+  char*      in_buffer;
+  int        out_buffer_pos;    /* Bytes waiting in out_buffers      */
+  int        out_buffer_start;  /* Offset of first byte in block 0   */
+  char**     out_buffers;       /* Index of output blocks            */
   ev_io      watch_r;
   ev_io      watch_w;
   io_state_t state;
 #ifdef HAVE_OPENSSL
   SSL*       ssl;
   int        want_write;
+  int        ktls;              /* CONN_KTLS_*, see pkc_end_handshake */
 #endif
 };
 
+char*   pkc_buffer_get(void);
+void    pkc_buffer_put(char*);
+int     pkc_buffer_max(void);
+void    pkc_buffer_stats(int*, int*);
+int     pkc_read_budget(void);
+
 void    pkc_reset_conn(struct pk_conn*, unsigned int);
+void    pkc_discard_output(struct pk_conn*);
 int     pkc_connect(struct pk_conn*, struct addrinfo*);
+int     pkc_start_connect(struct pk_conn*, struct addrinfo*);
+int     pkc_finish_connect(struct pk_conn*, int);
 #ifdef HAVE_OPENSSL
 int     pkc_start_ssl(struct pk_conn*, SSL_CTX*);
+int     pkc_resume_ssl(struct pk_conn*, SSL_CTX*, SSL_SESSION*);
 #endif
 int     pkc_wait(struct pk_conn*, int);
 ssize_t pkc_read(struct pk_conn*);
+ssize_t pkc_read_into(struct pk_conn*, char*, ssize_t);
+int     pkc_pending(struct pk_conn*);
 ssize_t pkc_raw_write(struct pk_conn*, char*, ssize_t);
+ssize_t pkc_raw_writev(struct pk_conn*, struct iovec*, int);
 ssize_t pkc_flush(struct pk_conn*, char*, ssize_t, int, char*);
 ssize_t pkc_write(struct pk_conn*, char*, ssize_t);
-void    pkc_report_progress(struct pk_conn*, char*, struct pk_conn*);
+ssize_t pkc_writev(struct pk_conn*, struct iovec*, int);
+int     pkc_can_splice(struct pk_conn*, struct pk_conn*);
+int     pkc_splice_pipe(int*);
+ssize_t pkc_splice_in(struct pk_conn*, int, ssize_t);
+ssize_t pkc_splice_out(struct pk_conn*, int, char*, ssize_t, ssize_t);
+int     pkc_report_due(struct pk_conn*, ev_tstamp);
+size_t  pkc_format_progress(struct pk_conn*, const char*, char*, ev_tstamp);
+void    pkc_window_probe(struct pk_conn*, ev_tstamp);
+void    pkc_window_report(struct pk_conn*, size_t, ev_tstamp, int, int);
+void    pkc_window_throttle(struct pk_conn*, int);
 
+int pkconn_test(void);
+int pkconn_bench(void);
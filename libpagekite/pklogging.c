@@ -161,10 +161,20 @@ void pk_dump_conn(char* prefix, struct pk_conn* conn)
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/read_kb: %d", prefix, conn->read_kb);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/sent_kb: %d", prefix, conn->sent_kb);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/send_window_kb: %d", prefix, conn->send_window_kb);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/window_rtt_ms: %d", prefix, (int) (1000 * conn->window_rtt));
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/window_rate: %d", prefix, (int) conn->window_rate);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/wrote_bytes: %d", prefix, conn->wrote_bytes);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/reported_kb: %d", prefix, conn->reported_kb);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/write_calls: %d", prefix, conn->write_calls);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/write_call_bytes: %d", prefix, conn->write_call_bytes);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/control_bytes: %d (%d%%)", prefix, conn->control_bytes,
+         conn->write_call_bytes ? (int) (100 * conn->control_bytes / conn->write_call_bytes) : 0);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/write_chunks: %d", prefix, conn->write_chunks);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/read_calls: %d", prefix, conn->read_calls);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/read_events: %d", prefix, conn->read_events);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/in_buffer_pos: %d", prefix, conn->in_buffer_pos);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/out_buffer_pos: %d", prefix, conn->out_buffer_pos);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/out_buffer_start: %d", prefix, conn->out_buffer_start);
 }
 
 void pk_dump_tunnel(char* prefix, struct pk_tunnel* fe)
@@ -174,6 +184,15 @@ void pk_dump_tunnel(char* prefix, struct pk_tunnel* fe)
 
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/fe_hostname: %s", prefix, fe->fe_hostname);
   pk_log(PK_LOG_MANAGER_DEBUG, "%s/fe_port: %d", prefix, fe->fe_port);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/worker: %d", prefix,
+                               (int) (fe->worker - fe->manager->workers));
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/handshake: %d", prefix, fe->handshake);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/handshake_rounds: %d", prefix,
+                               fe->handshake_rounds);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/connect_latency: %.3f", prefix,
+                               fe->connect_latency);
+  pk_log(PK_LOG_MANAGER_DEBUG, "%s/ssl_session: %s", prefix,
+                               (NULL != fe->ssl_session) ? "cached" : "none");
 
   if (0 <= fe->conn.sockfd) {
     pk_log(PK_LOG_MANAGER_DEBUG, "%s/fe_session: %s", prefix, fe->fe_session);
@@ -192,10 +211,12 @@ void pk_dump_be_conn(char* prefix, struct pk_backend_conn* bec)
   char tmp[1024];
 
   #define LL PK_LOG_MANAGER_DEBUG
-  pk_log(LL, "%s/fe: %s", prefix, bec->tunnel->fe_hostname);
-  pk_log(LL, "%s/kite: %d <- %s://%s", prefix, bec->kite->local_port,
-                                               bec->kite->protocol,
-                                               bec->kite->public_domain);
+  if (NULL != bec->tunnel)
+    pk_log(LL, "%s/fe: %s", prefix, bec->tunnel->fe_hostname);
+  if (NULL != bec->kite)
+    pk_log(LL, "%s/kite: %d <- %s://%s", prefix, bec->kite->local_port,
+                                                 bec->kite->protocol,
+                                                 bec->kite->public_domain);
   sprintf(tmp, "%s/conn", prefix);
   pk_dump_conn(tmp, &(bec->conn));
 }
@@ -223,6 +244,8 @@ void pk_dump_state(struct pk_manager* pkm)
   pk_log(LL, "pk_manager/enable_timer: %d", 0 < pkm->enable_timer);
   pk_log(LL, "pk_manager/fancy_pagekite_net_rejection: %d", 0 < pkm->fancy_pagekite_net_rejection);
   pk_log(LL, "pk_manager/want_spare_frontends: %d", pkm->want_spare_frontends);
+  pk_log(LL, "pk_manager/tls_handshakes_full: %d", pkm->tls_handshakes_full);
+  pk_log(LL, "pk_manager/tls_handshakes_resumed: %d", pkm->tls_handshakes_resumed);
   pk_log(LL, "pk_manager/dynamic_dns_url: %s", pkm->dynamic_dns_url);
 
   for (i = 0, fe = pkm->tunnels; i < pkm->tunnel_max; i++, fe++) {
@@ -43,9 +43,34 @@ static void pkm_block(struct pk_manager *pkm);
 static void pkm_unblock(struct pk_manager *pkm);
 static void pkm_quit_cb(EV_P_ ev_async *w, int revents);
 static void pkm_quit(struct pk_manager* pkm);
+static void pkm_lock_worker(struct pk_worker*);
+static void pkm_unlock_worker(struct pk_worker*);
+static void pkm_worker_release_cb(EV_P);
+static void pkm_worker_acquire_cb(EV_P);
+static void pkm_worker_wakeup_cb(EV_P_ ev_async*, int);
+static void pkm_init_worker(struct pk_manager*, struct pk_worker*,
+                            struct ev_loop*);
+static void* pkm_worker_run(void*);
+static int pkm_start_workers(struct pk_manager*);
+static void pkm_stop_workers(struct pk_manager*);
+static struct pk_worker* pkm_pick_worker(struct pk_manager*, struct pk_tunnel*);
 static void pkm_chunk_cb(struct pk_tunnel*, struct pk_chunk*);
+static void pkm_write_control(struct pk_tunnel*, char*, size_t);
+static void pkm_reject_stream(struct pk_tunnel*, const char*,
+                              const char*, const char*);
 static struct pk_backend_conn* pkm_connect_be(struct pk_tunnel*,
                                               struct pk_chunk*);
+static int pkm_lookup_backend(struct pk_pagekite*,
+                              struct sockaddr_storage*, socklen_t*);
+static void pkm_store_backend(struct pk_manager*, struct pk_pagekite*,
+                              struct sockaddr_storage*, socklen_t*, int);
+static int pkm_backend_addr(struct pk_manager*, struct pk_pagekite*,
+                            struct sockaddr_storage*, socklen_t*);
+static void pkm_skip_backend_addr(struct pk_manager*, struct pk_pagekite*);
+static void pkm_be_conn_failed(struct pk_backend_conn*);
+static void pkm_be_conn_timeout_cb(EV_P_ ev_timer*, int);
+static ssize_t pkm_splice_chunked(struct pk_tunnel*, struct pk_backend_conn*,
+                                  ssize_t);
 static ssize_t pkm_write_chunked(struct pk_tunnel*, struct pk_backend_conn*,
                                  ssize_t, char*);
 static int pkm_update_io(struct pk_tunnel*, struct pk_backend_conn*);
@@ -54,25 +79,66 @@ static void pkm_flow_control_conn(struct pk_conn*, flow_op);
 static void pkm_parse_eof(struct pk_backend_conn* pkb, char *eof);
 static void pkm_tunnel_readable_cb(EV_P_ ev_io*, int);
 static void pkm_tunnel_writable_cb(EV_P_ ev_io*, int);
+static void pkm_flush_tunnels_cb(EV_P_ ev_prepare*, int);
+static void pkm_schedule_more_cb(EV_P_ ev_idle*, int);
+static void pkm_report_timer_cb(EV_P_ ev_timer*, int);
+static int pkm_send_reports(struct pk_tunnel*, ev_tstamp);
+static int pkm_stream_queued(struct pk_backend_conn*);
+static void pkm_queue_stream(struct pk_backend_conn*);
+static void pkm_unqueue_stream(struct pk_backend_conn*);
+static int pkm_schedule_streams(struct pk_tunnel*);
 static void pkm_be_conn_readable_cb(EV_P_ ev_io*, int);
 static void pkm_be_conn_writable_cb(EV_P_ ev_io*, int);
+static void pkm_queue_handshake(struct pk_tunnel*, ev_tstamp);
+static void pkm_start_handshakes_cb(EV_P_ ev_async*, int);
+static void pkm_start_handshake(struct pk_tunnel*);
+static void pkm_handshake_connect(struct pk_tunnel*);
+static void pkm_handshake_cb(EV_P_ ev_io*, int);
+static void pkm_handshake_timeout_cb(EV_P_ ev_timer*, int);
+static void pkm_handshake_step(struct pk_tunnel*);
+static void pkm_handshake_response(struct pk_tunnel*, int);
+static void pkm_handshake_done(struct pk_tunnel*, int);
+static int  pkm_prepare_requests(struct pk_manager*, struct pk_tunnel*);
+#ifdef HAVE_OPENSSL
+static void pkm_save_session(struct pk_tunnel*);
+#endif
 static void pkm_tick_cb(EV_P_ ev_async*, int);
 static void pkm_timer_cb(EV_P_ ev_timer*, int);
 static void pkm_reset_timer(struct pk_manager*);
 static void pkm_reset_manager(struct pk_manager*);
 static struct pk_pagekite* pkm_find_kite(struct pk_manager*,
                                          const char*, const char*, int);
+static unsigned int pkm_kite_hash(const char*, const char*, int);
+static void pkm_kite_index_add(struct pk_manager*, struct pk_pagekite*);
 static unsigned char pkm_sid_shift(char *);
+static unsigned int pkm_be_hash(struct pk_tunnel*, const char*);
+static void pkm_be_index_add(struct pk_manager*, struct pk_backend_conn*);
+static void pkm_be_index_remove(struct pk_manager*, struct pk_backend_conn*);
+static void pkm_be_index_rebuild(struct pk_manager*);
+static void pkm_be_free_rebuild(struct pk_manager*);
+static void pkm_link_be_conn(struct pk_backend_conn*);
+static void pkm_unlink_be_conn(struct pk_backend_conn*);
+static struct pk_backend_conn* pkm_claim_be_conn(struct pk_manager*,
+                                                 struct pk_backend_conn*,
+                                                 struct pk_tunnel*, char*);
 struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager*,
                                           struct pk_tunnel*, char *);
-static void pkm_free_be_conn(struct pk_backend_conn* pkb);
+static void pkm_free_be_conn(struct pk_manager*, struct pk_backend_conn*);
 static struct pk_backend_conn* pkm_find_be_conn(struct pk_manager*,
                                                 struct pk_tunnel*, char*);
 
 
+/* The manager's loop holds loop_lock all the time, except in here.  Mutexes
+ * are not fair, so simply unlocking and locking again would usually get the
+ * lock straight back; instead we wait until every thread in pkm_block() has
+ * had its turn. */
 static void pkm_yield(struct pk_manager *pkm)
 {
   pthread_mutex_unlock(&(pkm->loop_lock));
+  pthread_mutex_lock(&(pkm->block_lock));
+  while (0 < pkm->blocking)
+    pthread_cond_wait(&(pkm->block_cond), &(pkm->block_lock));
+  pthread_mutex_unlock(&(pkm->block_lock));
   pthread_mutex_lock(&(pkm->loop_lock));
 }
 static void pkm_interrupt_cb(EV_P_ ev_async *w, int revents)
@@ -90,18 +156,26 @@ static void pkm_interrupt(struct pk_manager *pkm)
 
 static void pkm_block(struct pk_manager *pkm)
 {
+  int i;
   if (!pthread_equal(pthread_self(), pkm->main_thread)) {
-/*
-    while (0 != pthread_mutex_trylock(&(pkm->loop_lock))) {
-      pkm_interrupt(pkm);
-    }
-*/
+    pthread_mutex_lock(&(pkm->block_lock));
+    pkm->blocking += 1;
+    pthread_mutex_unlock(&(pkm->block_lock));
+
     pkm_interrupt(pkm);
-    pthread_mutex_trylock(&(pkm->loop_lock));
+    pthread_mutex_lock(&(pkm->loop_lock));
+
+    pthread_mutex_lock(&(pkm->block_lock));
+    pkm->blocking -= 1;
+    pthread_cond_broadcast(&(pkm->block_cond));
+    pthread_mutex_unlock(&(pkm->block_lock));
   }
+  for (i = 1; i <= pkm->worker_count; i++) pkm_lock_worker(pkm->workers + i);
 }
 static void pkm_unblock(struct pk_manager *pkm)
 {
+  int i;
+  for (i = 1; i <= pkm->worker_count; i++) pkm_unlock_worker(pkm->workers + i);
   if (!pthread_equal(pthread_self(), pkm->main_thread)) {
     pthread_mutex_unlock(&(pkm->loop_lock));
   }
@@ -120,13 +194,241 @@ static void pkm_quit(struct pk_manager* pkm)
 }
 
 
-static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
+/*** Worker loops *************************************************************/
+
+/* A worker thread holds its loop_lock except while its loop is waiting for
+ * events, so other threads wanting to touch its tunnels or streams take the
+ * lock, make their changes and then wake the loop up so it notices. */
+static void pkm_lock_worker(struct pk_worker* w)
+{
+  if (w->running && !pthread_equal(pthread_self(), w->thread))
+    pthread_mutex_lock(&(w->loop_lock));
+}
+static void pkm_unlock_worker(struct pk_worker* w)
+{
+  if (w->running && !pthread_equal(pthread_self(), w->thread)) {
+    ev_async_send(w->loop, &(w->wakeup));
+    pthread_mutex_unlock(&(w->loop_lock));
+  }
+}
+
+static void pkm_worker_release_cb(EV_P)
+{
+  struct pk_worker* w = (struct pk_worker*) ev_userdata(EV_A);
+  pthread_mutex_unlock(&(w->loop_lock));
+}
+static void pkm_worker_acquire_cb(EV_P)
+{
+  struct pk_worker* w = (struct pk_worker*) ev_userdata(EV_A);
+  pthread_mutex_lock(&(w->loop_lock));
+}
+static void pkm_worker_wakeup_cb(EV_P_ ev_async* w, int revents)
+{
+  /* Nothing to do: the loop just had to notice changed watchers. */
+  (void) loop;
+  (void) w;
+  (void) revents;
+}
+
+static void pkm_init_worker(struct pk_manager* pkm, struct pk_worker* w,
+                            struct ev_loop* loop)
+{
+  w->manager = pkm;
+  w->loop = loop;
+
+  /* Flush coalesced tunnel output once per loop iteration */
+  ev_prepare_init(&(w->flush_tunnels), pkm_flush_tunnels_cb);
+  w->flush_tunnels.data = (void *) w;
+  ev_prepare_start(loop, &(w->flush_tunnels));
+  ev_idle_init(&(w->schedule_more), pkm_schedule_more_cb);
+  ev_timer_init(&(w->report_timer), pkm_report_timer_cb, 0, 0);
+
+  ev_async_init(&(w->wakeup), pkm_worker_wakeup_cb);
+  ev_async_init(&(w->quit), pkm_quit_cb);
+  ev_async_init(&(w->start_handshakes), pkm_start_handshakes_cb);
+  w->start_handshakes.data = (void *) w;
+  ev_async_start(loop, &(w->start_handshakes));
+}
+
+static void* pkm_worker_run(void* void_w)
+{
+  struct pk_worker* w = (struct pk_worker*) void_w;
+
+  pthread_mutex_lock(&(w->loop_lock));
+  ev_loop(w->loop, 0);
+  pthread_mutex_unlock(&(w->loop_lock));
+
+  pk_log(PK_LOG_MANAGER_DEBUG, "Worker loop exited.");
+  return void_w;
+}
+
+static int pkm_start_workers(struct pk_manager* pkm)
+{
+  int i;
+  struct pk_worker* w;
+
+  for (i = 1; i <= pkm->worker_count; i++) {
+    w = pkm->workers + i;
+    if (w->running) continue;
+    w->running = 1;
+    if (0 != pthread_create(&(w->thread), NULL, pkm_worker_run, (void *) w)) {
+      w->running = 0;
+      pk_log(PK_LOG_MANAGER_ERROR, "Failed to start worker %d", i);
+      return -1;
+    }
+  }
+  return pkm->worker_count;
+}
+
+static void pkm_stop_workers(struct pk_manager* pkm)
+{
+  int i;
+  struct pk_worker* w;
+
+  for (i = 1; i <= pkm->worker_count; i++) {
+    w = pkm->workers + i;
+    if (!w->running) continue;
+    ev_async_send(w->loop, &(w->quit));
+    pthread_join(w->thread, NULL);
+    w->running = 0;
+  }
+}
+
+/* Each worker keeps a list of its tunnels, so its per-iteration work need
+ * not scan all of them.  Moving a tunnel changes two lists: either the
+ * workers are not running yet, or the caller has them all blocked.  The
+ * manager's loop yields in the middle of walking its list, but its tunnels
+ * never move while it runs (see pkm_pick_worker). */
+static void pkm_move_tunnel(struct pk_tunnel* fe, struct pk_worker* w)
+{
+  struct pk_tunnel** p;
+
+  if (fe->worker == w) return;
+  if (NULL != fe->worker) {
+    for (p = &(fe->worker->tunnels); *p != NULL; p = &((*p)->worker_next)) {
+      if (*p == fe) {
+        *p = fe->worker_next;
+        break;
+      }
+    }
+  }
+  fe->worker = w;
+  fe->worker_next = w->tunnels;
+  w->tunnels = fe;
+}
+
+/* Choose a worker for a tunnel which is (re)connecting: the one with the
+ * fewest live tunnels, so TLS record processing (the bulk of our CPU time)
+ * is spread over as many cores as there are workers.  Each tunnel's SSL
+ * object stays on a single thread, so records keep their order.  A tunnel
+ * which still has streams stays where they are. */
+static struct pk_worker* pkm_pick_worker(struct pk_manager* pkm,
+                                         struct pk_tunnel* fe)
+{
+  int i, live[PK_WORKERS_MAX + 1];
+  struct pk_worker* best;
+  struct pk_tunnel* other;
+
+  if ((0 == pkm->worker_count) || (NULL != fe->streams)) return fe->worker;
+
+  memset(live, 0, sizeof(live));
+  for (i = 0, other = pkm->tunnels; i < pkm->tunnel_max; i++, other++) {
+    if ((other != fe) && (0 <= other->conn.sockfd))
+      live[other->worker - pkm->workers]++;
+  }
+  best = pkm->workers + 1;
+  for (i = 2; i <= pkm->worker_count; i++) {
+    if (live[i] < live[best - pkm->workers]) best = pkm->workers + i;
+  }
+  return best;
+}
+
+/* Spread the tunnels over a number of worker loops, each with a thread of
+ * its own; 1 (the default) keeps everything on the manager's loop.  This
+ * must be done before the manager is started. */
+int pkm_set_workers(struct pk_manager* pkm, int workers)
+{
+  int i;
+  struct pk_worker* w;
+
+  PK_TRACE_FUNCTION;
+
+  if (workers < 1) workers = 1;
+  if (workers > PK_WORKERS_MAX) workers = PK_WORKERS_MAX;
+  for (i = 1; i <= PK_WORKERS_MAX; i++) {
+    if (pkm->workers[i].running) return -1;
+  }
+
+  pkm->worker_count = (workers > 1) ? workers : 0;
+  for (i = 1; i <= pkm->worker_count; i++) {
+    w = pkm->workers + i;
+    if (w->loop != NULL) continue;
+
+    pkm_init_worker(pkm, w, ev_loop_new(0));
+    ev_async_start(w->loop, &(w->wakeup));
+    ev_async_start(w->loop, &(w->quit));
+    pthread_mutex_init(&(w->loop_lock), NULL);
+    ev_set_userdata(w->loop, (void *) w);
+    ev_set_loop_release_cb(w->loop, pkm_worker_release_cb,
+                                    pkm_worker_acquire_cb);
+  }
+
+  for (i = 0; i < pkm->tunnel_max; i++) {
+    pkm_move_tunnel(pkm->tunnels + i, (pkm->worker_count)
+      ? (pkm->workers + 1 + (i % pkm->worker_count))
+      : pkm->workers);
+  }
+  return workers;
+}
+
+
+/* Frames which carry no stream data, counted as protocol overhead. */
+static void pkm_write_control(struct pk_tunnel* fe, char* data, size_t bytes)
+{
+  fe->conn.control_bytes += bytes;
+  pkc_write(&(fe->conn), data, bytes);
+}
+
+static void pkm_reject_stream(struct pk_tunnel* fe, const char* sid,
+                              const char* proto, const char* host)
 {
-  struct pk_backend_conn* pkb; /* FIXME: What if we are a front-end? */
   char reply[PK_REJECT_MAXSIZE], pre[PK_REJECT_MAXSIZE], rej[PK_REJECT_MAXSIZE];
   char *post;
   int bytes;
 
+  /* FIXME: Send back a nicer error */
+  if ((NULL != proto) && (0 == strncasecmp(proto, "https", 5))) {
+    bytes = pk_format_reply(reply, sid, PK_REJECT_TLS_LEN,
+                                        PK_REJECT_TLS_DATA);
+    pkc_write(&(fe->conn), reply, bytes);
+  }
+  else {
+    if (fe->manager->fancy_pagekite_net_rejection) {
+      sprintf(pre, PK_REJECT_PRE_PAGEKITE, "BE", pk_state.app_id_short,
+                   proto, host);
+      post = PK_REJECT_POST_PAGEKITE;
+    }
+    else {
+      pre[0] = '\0';
+      post = pre;
+    }
+    sprintf(rej, PK_REJECT_FMT,
+                 pre, "be", pk_state.app_id_short, proto, host, post);
+
+    bytes = pk_format_reply(reply, sid, strlen(rej), rej);
+    pkc_write(&(fe->conn), reply, bytes);
+  }
+
+  bytes = pk_format_eof(reply, sid, PK_EOF);
+  pkm_write_control(fe, reply, bytes);
+}
+
+static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
+{
+  struct pk_backend_conn* pkb; /* FIXME: What if we are a front-end? */
+  char reply[PK_REJECT_MAXSIZE];
+  int bytes;
+
   PK_TRACE_FUNCTION;
   pk_log_chunk(chunk);
 
@@ -135,37 +437,13 @@ static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
     if ((NULL != (pkb = pkm_find_be_conn(fe->manager, fe, chunk->sid))) ||
         (NULL != chunk->noop) ||
         (NULL != chunk->eof) ||
+        (0 < chunk->offset) || /* Later fragment, stream already gone */
         (NULL != (pkb = pkm_connect_be(fe, chunk)))) {
       /* We are happy, pkb should be a valid connection. */
     }
     else {
-      /* FIXME: Send back a nicer error */
-      if ((NULL != chunk->request_proto) &&
-          (0 == strncasecmp(chunk->request_proto, "https", 5))) {
-        bytes = pk_format_reply(reply, chunk->sid, PK_REJECT_TLS_LEN,
-                                                   PK_REJECT_TLS_DATA);
-        pkc_write(&(fe->conn), reply, bytes);
-      }
-      else {
-        if (fe->manager->fancy_pagekite_net_rejection) {
-          sprintf(pre, PK_REJECT_PRE_PAGEKITE, "BE", pk_state.app_id_short,
-                       chunk->request_proto, chunk->request_host);
-          post = PK_REJECT_POST_PAGEKITE;
-        }
-        else {
-          pre[0] = '\0';
-          post = pre;
-        }
-        sprintf(rej, PK_REJECT_FMT,
-                     pre, "be", pk_state.app_id_short,
-                     chunk->request_proto, chunk->request_host, post);
-
-        bytes = pk_format_reply(reply, chunk->sid, strlen(rej), rej);
-        pkc_write(&(fe->conn), reply, bytes);
-      }
-
-      bytes = pk_format_eof(reply, chunk->sid, PK_EOF);
-      pkc_write(&(fe->conn), reply, bytes);
+      pkm_reject_stream(fe, chunk->sid,
+                        chunk->request_proto, chunk->request_host);
       pk_log(PK_LOG_TUNNEL_CONNS, "No stream found: %s, %s://%s", chunk->sid,
                                   chunk->request_proto, chunk->request_host);
     }
@@ -174,7 +452,7 @@ static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
   if (NULL != chunk->noop) {
     if (NULL != chunk->ping) {
       bytes = pk_format_pong(reply);
-      pkc_write(&(fe->conn), reply, bytes);
+      pkm_write_control(fe, reply, bytes);
       pk_log(PK_LOG_TUNNEL_DATA, "> --- > Pong!");
     }
   }
@@ -189,12 +467,13 @@ static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
 
   if (NULL != pkb) {
     if (0 < chunk->throttle_spd) {
-      if (pkb->conn.send_window_kb > CONN_WINDOW_SIZE_KB_MINIMUM) {
-        pkb->conn.send_window_kb *= 0.8;
-      }
+      pkc_window_throttle(&(pkb->conn), fe->manager->window_kb_min);
     }
     if (0 < chunk->remote_sent_kb) {
-      pkb->conn.sent_kb = chunk->remote_sent_kb;
+      pkc_window_report(&(pkb->conn), chunk->remote_sent_kb,
+                        ev_now(fe->worker->loop),
+                        fe->manager->window_kb_min,
+                        fe->manager->window_kb_max);
     }
     pkm_update_io(fe, pkb);
   }
@@ -205,9 +484,8 @@ struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
 {
   /* Connect to the backend, or free the conn object if we fail */
   int sockfd;
-  struct sockaddr_in addr_buf;
-  struct sockaddr_in* addr;
-  struct hostent *backend;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
   struct pk_backend_conn* pkb;
   struct pk_pagekite *kite;
 
@@ -240,91 +518,171 @@ struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
     return NULL;
   }
 
-  /* Look up the back-end... */
-  addr = NULL;
-  if (NULL != (backend = gethostbyname(kite->local_domain))) {
-    addr = &addr_buf;
-    memset((char *) addr, 0, sizeof(addr));
-    addr->sin_family = AF_INET;
-    memmove((char*) &(addr->sin_addr.s_addr),
-            (char*) backend->h_addr_list[0],
-            backend->h_length);
-    addr->sin_port = htons(kite->local_port);
-  }
-
-  /* Try to connect and set non-blocking. */
+  /* Create a non-blocking socket and start connecting; the event loop
+   * tells us when (or whether) the connection is established. */
   errno = sockfd = 0;
-  if ((NULL == addr) ||
-      (0 > (sockfd = PKS_socket(AF_INET, SOCK_STREAM, 0))) ||
-      PKS_fail(PKS_connect(sockfd, (struct sockaddr*) addr, sizeof(*addr))) ||
+  if ((0 > pkm_backend_addr(fe->manager, kite, &addr, &addr_len)) ||
+      (0 > (sockfd = PKS_socket(addr.ss_family, SOCK_STREAM, 0))) ||
       (0 > set_non_blocking(sockfd)))
   {
-    if (errno != EINPROGRESS) {
-      /* FIXME:
-         EINPROGRESS never happens until we swap connect/set_non_blocking
-         above.  Do that later once we've figured out error handling. */
+    if (0 < sockfd) PKS_close(sockfd);
+    pkm_free_be_conn(fe->manager, pkb);
+    pk_log(PK_LOG_TUNNEL_CONNS, "pkm_connect_be: Failed to connect %s:%d",
+                                kite->local_domain, kite->local_port);
+    return NULL;
+  }
+  if (PKS_fail(PKS_connect(sockfd, (struct sockaddr*) &addr, addr_len))) {
+    if ((errno != EINPROGRESS) && (errno != EWOULDBLOCK)) {
       PKS_close(sockfd);
-      pkm_free_be_conn(pkb);
+      pkm_free_be_conn(fe->manager, pkb);
+      pkm_skip_backend_addr(fe->manager, kite);
       pk_log(PK_LOG_TUNNEL_CONNS, "pkm_connect_be: Failed to connect %s:%d",
                                   kite->local_domain, kite->local_port);
       return NULL;
     }
+    pkb->conn.status |= CONN_STATUS_CONNECTING;
   }
 
-  /* FIXME: This should be non-blocking for use on high volume front-ends,
-   *        but that requires more buffering and fancy logic, so we're
-   *        lazy for now.
-   *        See also: http://developerweb.net/viewtopic.php?id=3196 */
-
   pkb->kite = kite;
   pkb->conn.sockfd = sockfd;
 
   int ev_sock = PKS_EV_FD(sockfd);
   ev_io_init(&(pkb->conn.watch_r), pkm_be_conn_readable_cb, ev_sock, EV_READ);
   ev_io_init(&(pkb->conn.watch_w), pkm_be_conn_writable_cb, ev_sock, EV_WRITE);
-
   pkb->conn.watch_r.data = pkb->conn.watch_w.data = (void *) pkb;
-  ev_io_start(fe->manager->loop, &(pkb->conn.watch_r));
-  ev_io_start(fe->manager->loop, &(pkb->conn.watch_w));
+
+  if (pkb->conn.status & CONN_STATUS_CONNECTING) {
+    /* Data from the tunnel is buffered until the connection completes;
+     * the writable callback finishes the job, or the timer gives up. */
+    ev_timer_init(&(pkb->connect_timer), pkm_be_conn_timeout_cb,
+                  kite->connect_timeout, 0.);
+    pkb->connect_timer.data = (void *) pkb;
+    ev_timer_start(fe->worker->loop, &(pkb->connect_timer));
+    ev_io_start(fe->worker->loop, &(pkb->conn.watch_w));
+  }
+  else {
+    ev_io_start(fe->worker->loop, &(pkb->conn.watch_r));
+    ev_io_start(fe->worker->loop, &(pkb->conn.watch_w));
+  }
 
   PKS_STATE(pk_state.live_streams += 1);
 
   return pkb;
 }
 
+static void pkm_be_conn_failed(struct pk_backend_conn* pkb)
+{
+  struct pk_tunnel* fe = pkb->tunnel;
+  struct pk_manager* pkm = fe->manager;
+
+  PK_TRACE_FUNCTION;
+
+  pk_log(PK_LOG_TUNNEL_CONNS, "%5.5s: Failed to connect %s:%d (errno=%d)",
+                              pkb->sid, pkb->kite->local_domain,
+                              pkb->kite->local_port, errno);
+
+  ev_timer_stop(fe->worker->loop, &(pkb->connect_timer));
+  ev_io_stop(fe->worker->loop, &(pkb->conn.watch_r));
+  ev_io_stop(fe->worker->loop, &(pkb->conn.watch_w));
+  pkm_skip_backend_addr(pkm, pkb->kite);
+  pkm_reject_stream(fe, pkb->sid,
+                    pkb->kite->protocol, pkb->kite->public_domain);
+
+  pkm_free_be_conn(pkm, pkb);
+  pkc_reset_conn(&(pkb->conn), 0); /* Closes the socket */
+  PKS_STATE(pk_state.live_streams -= 1);
+
+  pkm_update_io(fe, NULL);
+}
+
+static void pkm_be_conn_timeout_cb(EV_P_ ev_timer* w, int revents)
+{
+  struct pk_backend_conn* pkb = (struct pk_backend_conn*) w->data;
+
+  PK_TRACE_FUNCTION;
+
+  if (pkb->conn.status & CONN_STATUS_CONNECTING) {
+    errno = ETIMEDOUT;
+    pkm_be_conn_failed(pkb);
+  }
+  /* -Wall dislikes unused arguments */
+  (void) loop;
+  (void) revents;
+}
+
 static ssize_t pkm_write_chunked(struct pk_tunnel* fe,
                                  struct pk_backend_conn* pkb,
                                  ssize_t length, char* data)
 {
-  ssize_t overhead = 0;
+  char header[BE_SID_PREFIX_SIZE + 32];
+  struct iovec iov[2];
   struct pk_conn* pkc = &(fe->conn);
 
   PK_TRACE_FUNCTION;
   /* FIXME: Better error handling */
 
-  /* Make sure there is space in our output buffer for the header. */
-  overhead = pk_reply_overhead(pkb->sid, length);
-  if (PKC_OUT_FREE(*pkc) < overhead)
-    if (0 > pkc_flush(pkc, NULL, 0, BLOCKING_FLUSH, "pkm_write_chunked"))
-      return -1;
+  /* Format the chunk header using the cached SID, then send header and
+   * data together, without copying the data. */
+  iov[0].iov_base = header;
+  iov[0].iov_len = pk_format_reply_header(header, pkb->sid_prefix,
+                                                  pkb->sid_prefix_len,
+                                                  length);
+  iov[1].iov_base = data;
+  iov[1].iov_len = length;
+
+  pkc->write_chunks++;
+  if (0 > pkc_writev(pkc, iov, 2)) return -1;
+  return length;
+}
+
+/* Large chunks from plain backends to plain (or kernel TLS) tunnels skip
+ * user space: the data goes from socket to socket through the tunnel's
+ * pipe, we only write the chunk header.  Returns -2 if the stream can't
+ * do that right now, otherwise the same as pkc_read_into(). */
+static ssize_t pkm_splice_chunked(struct pk_tunnel* fe,
+                                  struct pk_backend_conn* pkb,
+                                  ssize_t want)
+{
+  char header[BE_SID_PREFIX_SIZE + 32];
+  ssize_t bytes;
 
-  /* Write the chunk header to the output buffer */
-  pkc->out_buffer_pos += pk_format_reply(PKC_OUT(*pkc), pkb->sid, length, NULL);
+  PK_TRACE_FUNCTION;
 
-  /* Write the data (will pick up the header automatically) */
-  return pkc_write(pkc, data, length);
+  if (!fe->manager->enable_splice || (want < PK_SPLICE_MIN) ||
+      !pkc_can_splice(&(pkb->conn), &(fe->conn)))
+    return -2;
+  if ((fe->splice_pipe[0] < 0) && (0 > pkc_splice_pipe(fe->splice_pipe)))
+    return -2;
+
+  bytes = pkc_splice_in(&(pkb->conn), fe->splice_pipe[1], want);
+  if (0 < bytes) {
+    fe->conn.write_chunks++;
+    if (0 > pkc_splice_out(&(fe->conn), fe->splice_pipe[0], header,
+                           pk_format_reply_header(header, pkb->sid_prefix,
+                                                          pkb->sid_prefix_len,
+                                                          bytes),
+                           bytes)) {
+      /* Out of sync, start over with a new pipe. */
+      close(fe->splice_pipe[0]);
+      close(fe->splice_pipe[1]);
+      fe->splice_pipe[0] = fe->splice_pipe[1] = -1;
+      fe->conn.status |= CONN_STATUS_BROKEN;
+    }
+  }
+  return bytes;
 }
 
 static int pkm_update_io(struct pk_tunnel* fe, struct pk_backend_conn* pkb)
 {
-  int i;
   int bytes;
   int loglevel;
   char buffer[1024];
   int eof = 0;
   int flows = 2;
   struct pk_conn* pkc;
+  struct pk_backend_conn* next;
   struct pk_manager* pkm = fe->manager;
+  struct ev_loop* loop = fe->worker->loop;
 
   PK_TRACE_FUNCTION;
 
@@ -340,7 +698,8 @@ static int pkm_update_io(struct pk_tunnel* fe, struct pk_backend_conn* pkb)
     return 0;
 
   if (pkb != NULL) {
-    pkc_report_progress(&(pkb->conn), pkb->sid, &(pkb->tunnel->conn));
+    if (pkc_report_due(&(pkb->conn), ev_now(loop)))
+      pkb->tunnel->reports_pending = 1;
     if (pkc->read_kb > pkc->sent_kb + pkc->send_window_kb)
       pkm_flow_control_conn(pkc, CONN_DEST_BLOCKED);
     else
@@ -357,7 +716,7 @@ static int pkm_update_io(struct pk_tunnel* fe, struct pk_backend_conn* pkb)
     }
     /* Not going to read anymore, stop listening. */
     pkc->status |= (CONN_STATUS_END_READ | CONN_STATUS_CLS_READ);
-    ev_io_stop(pkm->loop, &(pkc->watch_r));
+    ev_io_stop(loop, &(pkc->watch_r));
     PKS_shutdown(pkc->sockfd, SHUT_RD);
 
     flows -= 1;
@@ -368,14 +727,21 @@ static int pkm_update_io(struct pk_tunnel* fe, struct pk_backend_conn* pkb)
     }
   }
   else {
-    if ((pkc->status & CONN_STATUS_BLOCKED) &&
-        !(pkc->status & CONN_STATUS_WANT_READ)) {
+    if (pkc->status & CONN_STATUS_CONNECTING) {
+      /* Nothing to read until connect() completes. */
+    }
+    else if ((pkb != NULL) && pkm_stream_queued(pkb)) {
+      /* Already known to be readable, waiting for its turn. */
+      ev_io_stop(loop, &(pkc->watch_r));
+    }
+    else if ((pkc->status & CONN_STATUS_BLOCKED) &&
+             !(pkc->status & CONN_STATUS_WANT_READ)) {
       pk_log(loglevel, "%d: Throttled.", pkc->sockfd);
-      ev_io_stop(pkm->loop, &(pkc->watch_r));
+      ev_io_stop(loop, &(pkc->watch_r));
     }
     else {
       pk_log(loglevel, "%d: Watching for input.", pkc->sockfd);
-      ev_io_start(pkm->loop, &(pkc->watch_r));
+      ev_io_start(loop, &(pkc->watch_r));
     }
   }
 
@@ -389,18 +755,36 @@ static int pkm_update_io(struct pk_tunnel* fe, struct pk_backend_conn* pkb)
       eof |= PK_EOF_WRITE;
     }
     pkc->status |= (CONN_STATUS_END_WRITE | CONN_STATUS_CLS_WRITE);
-    pkc->out_buffer_pos = 0;
+    pkc_discard_output(pkc);
     PKS_shutdown(pkc->sockfd, SHUT_WR);
-    ev_io_stop(pkm->loop, &(pkc->watch_w));
+    ev_io_stop(loop, &(pkc->watch_w));
     flows -= 1;
     pk_log(loglevel, "%d: Closed for writing.", pkc->sockfd);
   }
+  else if (pkc->status & CONN_STATUS_CONNECTING) {
+    /* Writable means connected (or failed), see pkm_be_conn_writable_cb. */
+    ev_io_start(loop, &(pkc->watch_w));
+  }
   else if ((0 < pkc->out_buffer_pos) ||
            (pkc->status & CONN_STATUS_WANT_WRITE)) {
-    /* Blocked: activate write listener */
-    ev_io_start(pkm->loop, &(pkc->watch_w));
-    pk_log(loglevel, "%d: Blocked!", pkc->sockfd);
-    pkm_flow_control_tunnel(fe, CONN_TUNNEL_BLOCKED);
+    /* Data pending: activate write listener.  Corked tunnels first get a
+     * chance to flush from pkm_flush_tunnels_cb, which starts it for them
+     * if that falls short. */
+    if (!(pkc->status & CONN_STATUS_CORKED) ||
+        (pkc->status & CONN_STATUS_WANT_WRITE))
+      ev_io_start(loop, &(pkc->watch_w));
+    if (pkb == NULL) {
+      /* A backed up tunnel stops reading from all of its streams. */
+      if (PKC_OUT_BLOCKED(*pkc)) {
+        pk_log(loglevel, "%d: Blocked!", pkc->sockfd);
+        pkm_flow_control_tunnel(fe, CONN_TUNNEL_BLOCKED);
+      }
+      else {
+        pkm_flow_control_tunnel(fe, CONN_TUNNEL_UNBLOCKED);
+      }
+    }
+    /* A slow backend only delays its own stream: the frontend throttles
+     * the remote end using our progress reports (pkm_send_reports). */
   }
   else {
     if (pkc->status & CONN_STATUS_END_WRITE) {
@@ -410,30 +794,27 @@ static int pkm_update_io(struct pk_tunnel* fe, struct pk_backend_conn* pkb)
       flows -= 1;
       pk_log(loglevel, "%d: Closed for writing (remote).", pkc->sockfd);
     }
-    else {
+    else if (pkb == NULL) {
       pk_log(loglevel, "%d: Unblocked!", pkc->sockfd);
       pkm_flow_control_tunnel(fe, CONN_TUNNEL_UNBLOCKED);
     }
-    ev_io_stop(pkm->loop, &(pkc->watch_w));
+    ev_io_stop(loop, &(pkc->watch_w));
   }
 
   if (eof) {
     if (pkb != NULL) {
       /* This is a backend conn, send EOF to over tunnel. */
       bytes = pk_format_eof(buffer, pkb->sid, eof);
-      pkc_write(&(fe->conn), buffer, bytes);
+      pkm_write_control(fe, buffer, bytes);
       pk_log(loglevel, "%d: Sent EOF (0x%x)", pkc->sockfd, eof);
     }
     else {
       /* This is a tunnel, send EOF to all backends, mark for reconnection. */
-      /* FIXME: This is O(n), but rare.  Maybe OK? */
       pk_log(loglevel, "%d: Shutting down tunnel.", pkc->sockfd);
-      for (i = 0; i < pkm->be_conn_max; i++) {
-        pkb = (pkm->be_conns+i);
-        if ((pkb->tunnel == fe) && (pkb->conn.status != CONN_STATUS_UNKNOWN)) {
-          pkb->conn.status |= (CONN_STATUS_END_WRITE|CONN_STATUS_END_READ);
-          pkm_update_io(fe, pkb);
-        }
+      for (pkb = fe->streams; pkb != NULL; pkb = next) {
+        next = pkb->tunnel_next; /* pkm_update_io may free pkb */
+        pkb->conn.status |= (CONN_STATUS_END_WRITE|CONN_STATUS_END_READ);
+        pkm_update_io(fe, pkb);
       }
       pkb = NULL;
     }
@@ -443,7 +824,7 @@ static int pkm_update_io(struct pk_tunnel* fe, struct pk_backend_conn* pkb)
     /* Nothing to read or write, close and clean up. */
     if (0 <= pkc->sockfd) PKS_close(pkc->sockfd);
     if (pkb != NULL) {
-      pkm_free_be_conn(pkb);
+      pkm_free_be_conn(pkm, pkb);
       PKS_STATE(pk_state.live_streams -= 1);
     }
     else {
@@ -461,33 +842,41 @@ static int pkm_update_io(struct pk_tunnel* fe, struct pk_backend_conn* pkb)
     pkc->sockfd = -1;
   }
 
-  pkm_yield(pkm);
+  if (fe->worker == pkm->workers) pkm_yield(pkm);
   return flows;
 }
 
 static void pkm_flow_control_tunnel(struct pk_tunnel* fe, flow_op op)
 {
-  int i;
   struct pk_backend_conn* pkb;
-  struct pk_manager* pkm = fe->manager;
 
   PK_TRACE_FUNCTION;
 
-  for (i = 0; i < pkm->be_conn_max; i++) {
-    pkb = (pkm->be_conns + i);
-    if (pkb->tunnel == fe) {
-      if (pkb->conn.status & CONN_STATUS_TNL_BLOCKED) {
-        if (op == CONN_TUNNEL_UNBLOCKED) {
-          pk_log(PK_LOG_TUNNEL_DATA, "%d: Tunnel unblocked", pkb->conn.sockfd);
-          pkb->conn.status &= ~CONN_STATUS_TNL_BLOCKED;
-        }
+  /* Read watchers are updated right away, so streams neither pile more
+   * data onto a blocked tunnel nor wait for traffic to be woken up.
+   * Streams also lose their place in line: otherwise those which were
+   * queued when the tunnel blocked would take all of its capacity once
+   * it drains, before the others could even be seen to be readable. */
+  for (pkb = fe->streams; pkb != NULL; pkb = pkb->tunnel_next) {
+    if (pkb->conn.status & CONN_STATUS_TNL_BLOCKED) {
+      if (op == CONN_TUNNEL_UNBLOCKED) {
+        pk_log(PK_LOG_TUNNEL_DATA, "%d: Tunnel unblocked", pkb->conn.sockfd);
+        pkb->conn.status &= ~CONN_STATUS_TNL_BLOCKED;
+        if ((0 <= pkb->conn.sockfd) &&
+            !(pkb->conn.status & (CONN_STATUS_BLOCKED
+                                 |CONN_STATUS_CLS_READ
+                                 |CONN_STATUS_CONNECTING)))
+          ev_io_start(fe->worker->loop, &(pkb->conn.watch_r));
       }
-      else
-        if (op == CONN_TUNNEL_BLOCKED) {
-          pk_log(PK_LOG_TUNNEL_DATA, "%d: Tunnel blocked", pkb->conn.sockfd);
-          pkb->conn.status |= CONN_STATUS_TNL_BLOCKED;
-        }
     }
+    else
+      if (op == CONN_TUNNEL_BLOCKED) {
+        pk_log(PK_LOG_TUNNEL_DATA, "%d: Tunnel blocked", pkb->conn.sockfd);
+        pkb->conn.status |= CONN_STATUS_TNL_BLOCKED;
+        pkm_unqueue_stream(pkb);
+        if (!(pkb->conn.status & CONN_STATUS_WANT_READ))
+          ev_io_stop(fe->worker->loop, &(pkb->conn.watch_r));
+      }
   }
 }
 
@@ -539,25 +928,53 @@ static void pkm_parse_eof(struct pk_backend_conn* pkb, char *eof)
 
 static void pkm_tunnel_readable_cb(EV_P_ ev_io *w, int revents)
 {
-  int rv;
+  int rv, space, budget;
+  ssize_t bytes;
+  char* buffer;
   struct pk_tunnel* fe = (struct pk_tunnel*) w->data;
   PK_TRACE_FUNCTION;
   fe->conn.status &= ~CONN_STATUS_WANT_READ;
-  if (0 < pkc_read(&(fe->conn))) {
-    if (0 > (rv = pk_parser_parse(fe->parser,
-                                  fe->conn.in_buffer_pos,
-                                  (char *) fe->conn.in_buffer)))
-    {
-      /* Parse failed: remote is borked: should kill this conn. */
-      fe->conn.status |= CONN_STATUS_BROKEN;
-      pk_log(PK_LOG_TUNNEL_HEADERS,
-             "pkm_tunnel_readable_cb(): parse error = %d", rv);
-      pk_dump_state(fe->manager);
+  fe->conn.read_events++;
+
+  /* Drain the socket, up to a budget, reading straight into the parser's
+   * buffer which parses in place.  A short plaintext read means the kernel
+   * has nothing more for us; TLS returns at most one record per read, so
+   * there we keep going until the socket would block. */
+  rv = 0;
+  budget = pkc_read_budget();
+  while (budget > 0) {
+    buffer = pk_parser_buffer(fe->parser, &space);
+    if (space < 1) {
+      rv = (pk_error = ERR_PARSE_NO_MEMORY);
+      break;
+    }
+    if (0 >= (bytes = pkc_read_into(&(fe->conn), buffer, space))) break;
+    budget -= bytes;
+
+    rv = pk_parser_parse_new_data(fe->parser, bytes);
+    if (rv < 0) {
+      pk_parser_reset(fe->parser);
+      break;
     }
-    fe->conn.in_buffer_pos = 0;
+    if (fe->conn.status & (CONN_STATUS_CLS_READ|CONN_STATUS_BROKEN)) break;
+    if ((bytes < space) &&
+        (fe->conn.state == CONN_CLEAR_DATA)) break;
+  }
+  if (rv < 0) {
+    /* Parse failed: remote is borked: should kill this conn. */
+    fe->conn.status |= CONN_STATUS_BROKEN;
+    pk_log(PK_LOG_TUNNEL_HEADERS,
+           "pkm_tunnel_readable_cb(): parse error = %d", rv);
+    pk_dump_state(fe->manager);
   }
   PK_CHECK_MEMORY_CANARIES;
   pkm_update_io(fe, NULL);
+
+  /* Out of budget with decrypted data still buffered: the socket may never
+   * become readable again, so make sure we come back for it. */
+  if ((rv >= 0) && (0 < pkc_pending(&(fe->conn))) &&
+      ev_is_active(&(fe->conn.watch_r)))
+    ev_feed_event(loop, &(fe->conn.watch_r), EV_READ);
   /* -Wall dislikes unused arguments */
   (void) loop;
   (void) revents;
@@ -582,29 +999,215 @@ static void pkm_tunnel_writable_cb(EV_P_ ev_io* w, int revents)
   (void) revents;
 }
 
+static void pkm_schedule_more_cb(EV_P_ ev_idle* w, int revents)
+{
+  /* Nothing to do: being active kept the loop from blocking, so
+   * pkm_flush_tunnels_cb gets to run again right away. */
+  ev_idle_stop(loop, w);
+  (void) revents;
+}
+
+static int pkm_stream_queued(struct pk_backend_conn* pkb)
+{
+  return ((pkb->ready_next != NULL) ||
+          ((pkb->tunnel != NULL) && (pkb->tunnel->ready_tail == pkb)));
+}
+
+static void pkm_queue_stream(struct pk_backend_conn* pkb)
+{
+  struct pk_tunnel* fe = pkb->tunnel;
+  if ((fe == NULL) || pkm_stream_queued(pkb)) return;
+
+  pkb->ready_next = NULL;
+  pkb->ready_prev = fe->ready_tail;
+  if (fe->ready_tail != NULL)
+    fe->ready_tail->ready_next = pkb;
+  else
+    fe->ready_head = pkb;
+  fe->ready_tail = pkb;
+}
+
+static void pkm_unqueue_stream(struct pk_backend_conn* pkb)
+{
+  struct pk_tunnel* fe = pkb->tunnel;
+  if ((fe == NULL) || !pkm_stream_queued(pkb)) return;
+
+  if (pkb->ready_prev != NULL)
+    pkb->ready_prev->ready_next = pkb->ready_next;
+  else
+    fe->ready_head = pkb->ready_next;
+  if (pkb->ready_next != NULL)
+    pkb->ready_next->ready_prev = pkb->ready_prev;
+  else
+    fe->ready_tail = pkb->ready_prev;
+  pkb->ready_next = pkb->ready_prev = NULL;
+  pkb->deficit = 0;
+}
+
+/* Move readable backend data into the tunnel, taking turns between the
+ * streams (deficit round robin): each turn lets a stream send up to
+ * stream_quantum bytes, so small responses don't wait behind bulk ones.
+ * Returns 1 if streams are still waiting when the budget runs out. */
+static int pkm_schedule_streams(struct pk_tunnel* fe)
+{
+  char buffer[CONN_IO_BUFFER_SIZE];
+  struct pk_backend_conn* pkb;
+  int quantum, budget;
+  ssize_t want, bytes;
+
+  PK_TRACE_FUNCTION;
+
+  quantum = fe->manager->stream_quantum;
+  if (quantum < 1) quantum = PK_STREAM_QUANTUM_DEFAULT;
+  budget = (quantum > PK_SCHEDULE_BUDGET) ? quantum : PK_SCHEDULE_BUDGET;
+
+  while ((NULL != (pkb = fe->ready_head)) && (0 < budget)) {
+    /* A blocked tunnel will wake its streams up again. */
+    if (PKC_OUT_BLOCKED(fe->conn) ||
+        (fe->conn.status & CONN_STATUS_CLS_WRITE)) break;
+
+    if (pkb->conn.status & (CONN_STATUS_BLOCKED|CONN_STATUS_CLS_READ)) {
+      pkm_unqueue_stream(pkb);
+      pkm_update_io(fe, pkb);
+      continue;
+    }
+
+    if (pkb->deficit <= 0) pkb->deficit += quantum;
+    want = pkb->deficit;
+    if (-2 == (bytes = pkm_splice_chunked(fe, pkb, want))) {
+      if (want > (int) sizeof(buffer)) want = sizeof(buffer);
+      bytes = pkc_read_into(&(pkb->conn), buffer, want);
+      if (0 < bytes) pkm_write_chunked(fe, pkb, bytes, buffer);
+    }
+    if (0 < bytes) {
+      pk_log(PK_LOG_BE_DATA, ">%5.5s> DATA: %d bytes", pkb->sid, bytes);
+    }
+    else if (bytes == 0) {
+      pk_log(PK_LOG_BE_DATA, ">%5.5s> EOF: read", pkb->sid);
+    }
+    if (0 < bytes) {
+      pkc_window_probe(&(pkb->conn), ev_now(fe->worker->loop));
+      pkb->deficit -= bytes;
+      budget -= bytes;
+    }
+
+    if (bytes < want) {
+      /* Drained (or closed): wait until it is readable again. */
+      pkm_unqueue_stream(pkb);
+    }
+    else if (pkb->deficit <= 0) {
+      /* Turn is over, to the back of the line. */
+      pkm_unqueue_stream(pkb);
+      pkm_queue_stream(pkb);
+    }
+    PK_CHECK_MEMORY_CANARIES;
+    pkm_update_io(fe, pkb);
+  }
+
+  pkm_update_io(fe, NULL);
+  return ((0 >= budget) && (NULL != fe->ready_head));
+}
+
+static void pkm_report_timer_cb(EV_P_ ev_timer* w, int revents)
+{
+  /* Nothing to do: pkm_flush_tunnels_cb sends the deferred reports as
+   * the loop goes around again. */
+  (void) loop;
+  (void) w;
+  (void) revents;
+}
+
+/* Send the progress reports due for this tunnel's streams, in one write.
+ * Streams which reported very recently wait a little (unless they have a
+ * lot to report), so busy streams don't flood the tunnel with SKB frames.
+ * Returns the number of reports deferred. */
+static int pkm_send_reports(struct pk_tunnel* fe, ev_tstamp now)
+{
+  char buffer[CONN_IO_BUFFER_SIZE];
+  struct pk_backend_conn* pkb;
+  size_t bytes = 0;
+  int deferred = 0;
+
+  PK_TRACE_FUNCTION;
+
+  for (pkb = fe->streams; pkb != NULL; pkb = pkb->tunnel_next) {
+    switch (pkc_report_due(&(pkb->conn), now)) {
+      case 1:
+        if (bytes + PK_SKB_MAXSIZE > sizeof(buffer)) {
+          pkm_write_control(fe, buffer, bytes);
+          bytes = 0;
+        }
+        bytes += pkc_format_progress(&(pkb->conn), pkb->sid,
+                                     buffer + bytes, now);
+        break;
+      case -1:
+        deferred++;
+        break;
+    }
+  }
+  if (bytes) pkm_write_control(fe, buffer, bytes);
+
+  fe->reports_pending = (0 < deferred);
+  return deferred;
+}
+
+/* Runs just before the event loop blocks: streams which became readable
+ * take turns sending their data, and then tunnels which coalesce their
+ * output (CONN_STATUS_CORKED) send all they collected during this loop
+ * iteration, ideally in a single write. */
+static void pkm_flush_tunnels_cb(EV_P_ ev_prepare* w, int revents)
+{
+  struct pk_tunnel* fe;
+  struct pk_worker* worker = (struct pk_worker*) w->data;
+  struct pk_manager* pkm = worker->manager;
+
+  for (fe = worker->tunnels; fe != NULL; fe = fe->worker_next) {
+    if ((fe->conn.sockfd < 0) || (fe->handshake != FE_HANDSHAKE_NONE))
+      continue;
+
+    /* Out of budget?  Come back without waiting for more events. */
+    if ((NULL != fe->ready_head) && (0 < pkm_schedule_streams(fe)))
+      ev_idle_start(loop, &(worker->schedule_more));
+
+    /* Reports which had to wait get another chance soon. */
+    if (fe->reports_pending &&
+        (0 < pkm_send_reports(fe, ev_now(loop))) &&
+        !ev_is_active(&(worker->report_timer))) {
+      ev_timer_set(&(worker->report_timer), CONN_REPORT_INTERVAL, 0);
+      ev_timer_start(loop, &(worker->report_timer));
+    }
+
+    if (pkm->coalesce_tunnel_writes)
+      fe->conn.status |= CONN_STATUS_CORKED;
+    else
+      fe->conn.status &= ~CONN_STATUS_CORKED;
+
+    /* If already waiting for the socket, leave it to the write callback. */
+    if ((0 < fe->conn.out_buffer_pos) &&
+        !(fe->conn.status & CONN_STATUS_CLS_WRITE) &&
+        !ev_is_active(&(fe->conn.watch_w))) {
+      pkc_flush(&(fe->conn), NULL, 0, NON_BLOCKING_FLUSH, "corked tunnel");
+      if (0 < fe->conn.out_buffer_pos)
+        ev_io_start(loop, &(fe->conn.watch_w));
+      pkm_update_io(fe, NULL);
+    }
+  }
+  /* -Wall dislikes unused arguments */
+  (void) revents;
+}
+
 static void pkm_be_conn_readable_cb(EV_P_ ev_io* w, int revents)
 {
   struct pk_backend_conn* pkb = (struct pk_backend_conn*) w->data;
-  size_t bytes;
 
   PK_TRACE_FUNCTION;
 
+  /* Just get in line: pkm_schedule_streams() decides who goes first, so
+   * a bulk transfer cannot hog the tunnel. */
   pkb->conn.status &= ~CONN_STATUS_WANT_READ;
-  bytes = pkc_read(&(pkb->conn));
-  if ((0 < bytes) &&
-      (0 <= pkm_write_chunked(pkb->tunnel, pkb,
-                              pkb->conn.in_buffer_pos,
-                              pkb->conn.in_buffer))) {
-    pkb->conn.in_buffer_pos = 0;
-    pk_log(PK_LOG_BE_DATA, ">%5.5s> DATA: %d bytes", pkb->sid, bytes);
-  }
-  else if (bytes == 0) {
-    pk_log(PK_LOG_BE_DATA, ">%5.5s> EOF: read", pkb->sid);
-  }
-  PK_CHECK_MEMORY_CANARIES;
-  pkm_update_io(pkb->tunnel, pkb);
+  pkm_queue_stream(pkb);
+  ev_io_stop(loop, w);
   /* -Wall dislikes unused arguments */
-  (void) loop;
   (void) revents;
 }
 
@@ -614,6 +1217,20 @@ static void pkm_be_conn_writable_cb(EV_P_ ev_io* w, int revents)
 
   PK_TRACE_FUNCTION;
 
+  /* Writable while connecting means connect() has finished, one way or
+   * the other. */
+  if (pkb->conn.status & CONN_STATUS_CONNECTING) {
+    int rv = pkc_finish_connect(&(pkb->conn), 0);
+    if (0 < rv) return;
+    ev_timer_stop(pkb->tunnel->worker->loop, &(pkb->connect_timer));
+    if (0 > rv) {
+      pkm_be_conn_failed(pkb);
+      return;
+    }
+    pk_log(PK_LOG_BE_CONNS, "%5.5s: Connected to %s:%d", pkb->sid,
+           pkb->kite->local_domain, pkb->kite->local_port);
+  }
+
   /* This is necessary for SSL handshakes and the like. */
   if (pkb->conn.status & CONN_STATUS_WANT_WRITE) {
     pkb->conn.status &= ~CONN_STATUS_WANT_WRITE;
@@ -638,17 +1255,402 @@ static void pkm_be_conn_writable_cb(EV_P_ ev_io* w, int revents)
   (void) revents;
 }
 
-int pkm_reconnect_all(struct pk_manager* pkm) {
-  struct pk_tunnel *fe;
-  struct pk_kite_request *kite_r;
-  unsigned int status;
-  int i, j, reconnect, tried, connected;
+/* Tunnels are connected without blocking: pkm_queue_handshake() hands the
+ * tunnel to its event loop, which starts a non-blocking connect(), sends
+ * our request (after the TLS handshake, if any), reads the frontend's
+ * response and decides what happens next.  So any number of frontends can
+ * be connected in parallel and nobody holds the loop lock while waiting on
+ * the network.
+ *
+ * This may be called from any thread, with the loops blocked: the tunnel
+ * only gets its absolute deadline here, the timer and watchers are set up
+ * by pkm_start_handshake() on the loop's own thread. */
+static void pkm_queue_handshake(struct pk_tunnel* fe, ev_tstamp deadline)
+{
+  struct pk_manager* pkm = fe->manager;
 
   PK_TRACE_FUNCTION;
-  tried = connected = 0;
 
-  /* Loop through all configured kites:
-   *   - if missing a desired front-end, tear down tunnels and reconnect.
+  pthread_mutex_lock(&(pkm->handshake_lock));
+  pkm->handshakes_pending += 1;
+  pthread_mutex_unlock(&(pkm->handshake_lock));
+
+  pkm_move_tunnel(fe, pkm_pick_worker(pkm, fe));
+  fe->handshake = FE_HANDSHAKE_QUEUED;
+  fe->handshake_deadline = deadline;
+  ev_async_send(fe->worker->loop, &(fe->worker->start_handshakes));
+}
+
+static void pkm_start_handshakes_cb(EV_P_ ev_async* w, int revents)
+{
+  struct pk_worker* worker = (struct pk_worker*) w->data;
+  struct pk_tunnel* fe;
+
+  for (fe = worker->tunnels; fe != NULL; fe = fe->worker_next) {
+    if (fe->handshake == FE_HANDSHAKE_QUEUED) pkm_start_handshake(fe);
+  }
+  /* -Wall dislikes unused arguments */
+  (void) loop;
+  (void) revents;
+}
+
+static void pkm_start_handshake(struct pk_tunnel* fe)
+{
+  struct ev_loop* loop = fe->worker->loop;
+  char buffer[1024];
+
+  PK_TRACE_FUNCTION;
+
+  pk_log(PK_LOG_TUNNEL_CONNS, "Connecting to %s (session=%s)",
+                              in_addr_to_str(fe->ai->ai_addr, buffer, 1024),
+                              (fe->fe_session[0] != '\0') ? fe->fe_session
+                                                          : "new");
+
+  fe->handshake_rounds = 0;
+  fe->handshake_started = ev_now(loop);
+  ev_timer_init(&(fe->handshake_timer), pkm_handshake_timeout_cb,
+                (fe->handshake_deadline > ev_now(loop))
+                  ? (fe->handshake_deadline - ev_now(loop)) : 0., 0.);
+  fe->handshake_timer.data = (void *) fe;
+  ev_timer_start(loop, &(fe->handshake_timer));
+
+  if ((NULL == fe->handshake_buffer) &&
+      (NULL == (fe->handshake_buffer = malloc(PK_HANDSHAKE_RESPONSE_MAX)))) {
+    pkm_handshake_done(fe, ERR_CONNECT_REQUEST);
+    return;
+  }
+  pkm_handshake_connect(fe);
+}
+
+/* Start (another) connection attempt for a handshake in progress. */
+static void pkm_handshake_connect(struct pk_tunnel* fe)
+{
+  struct pk_conn* pkc = &(fe->conn);
+
+  fe->handshake = FE_HANDSHAKE_SENDING;
+  fe->handshake_bytes = 0;
+  if (0 > pkc_start_connect(pkc, fe->ai)) {
+    pkm_handshake_done(fe, ERR_CONNECT_CONNECT);
+    return;
+  }
+#ifdef HAVE_OPENSSL
+  /* Otherwise this waits until connect() completes. */
+  if (!(pkc->status & CONN_STATUS_CONNECTING) &&
+      (NULL != fe->manager->ssl_ctx))
+    pkc_resume_ssl(pkc, fe->manager->ssl_ctx, fe->ssl_session);
+#endif
+  pk_parser_reset(fe->parser);
+  pk_write_handshake(pkc, fe->request_count, fe->requests, fe->fe_session);
+
+  int ev_sock = PKS_EV_FD(pkc->sockfd);
+  ev_io_init(&(pkc->watch_r), pkm_handshake_cb, ev_sock, EV_READ);
+  ev_io_init(&(pkc->watch_w), pkm_handshake_cb, ev_sock, EV_WRITE);
+  pkc->watch_r.data = pkc->watch_w.data = (void *) fe;
+  ev_io_start(fe->worker->loop, &(pkc->watch_w));
+}
+
+static void pkm_handshake_cb(EV_P_ ev_io* w, int revents)
+{
+  pkm_handshake_step((struct pk_tunnel*) w->data);
+  /* -Wall dislikes unused arguments */
+  (void) loop;
+  (void) revents;
+}
+
+static void pkm_handshake_timeout_cb(EV_P_ ev_timer* w, int revents)
+{
+  struct pk_tunnel* fe = (struct pk_tunnel*) w->data;
+  pk_log(PK_LOG_TUNNEL_CONNS, "%d: Handshake timed out", fe->conn.sockfd);
+  pkm_handshake_done(fe, ERR_CONNECT_REQUEST);
+  /* -Wall dislikes unused arguments */
+  (void) loop;
+  (void) revents;
+}
+
+/* Move a handshake along as far as the socket allows, then wait for it. */
+static void pkm_handshake_step(struct pk_tunnel* fe)
+{
+  int rv, length, space, sending;
+  ssize_t bytes;
+  io_state_t state;
+  struct pk_conn* pkc = &(fe->conn);
+  struct ev_loop* loop = fe->worker->loop;
+
+  PK_TRACE_FUNCTION;
+
+  /* Writable while connecting means connect() has finished, one way or
+   * the other. */
+  if (pkc->status & CONN_STATUS_CONNECTING) {
+    if (0 < (rv = pkc_finish_connect(pkc, 0))) return;
+    if (0 > rv) {
+      pkm_handshake_done(fe, ERR_CONNECT_CONNECT);
+      return;
+    }
+#ifdef HAVE_OPENSSL
+    if (NULL != fe->manager->ssl_ctx)
+      pkc_resume_ssl(pkc, fe->manager->ssl_ctx, fe->ssl_session);
+#endif
+  }
+
+  if (fe->handshake == FE_HANDSHAKE_SENDING) {
+    /* Flushing also drives the TLS handshake; once that is done, the
+     * request can go out right away. */
+    pkc->status &= ~(CONN_STATUS_WANT_READ|CONN_STATUS_WANT_WRITE);
+    do {
+      state = pkc->state;
+      pkc_flush(pkc, NULL, 0, NON_BLOCKING_FLUSH, "handshake");
+    } while ((state != pkc->state) && (0 < pkc->out_buffer_pos));
+
+    if (pkc->status & (CONN_STATUS_CLS_WRITE|CONN_STATUS_BROKEN)) {
+      pkm_handshake_done(fe, ERR_CONNECT_REQUEST);
+      return;
+    }
+#ifdef HAVE_OPENSSL
+    sending = (pkc->state == CONN_SSL_HANDSHAKE);
+#else
+    sending = 0;
+#endif
+    if (sending || (0 < pkc->out_buffer_pos)) {
+      if (pkc->status & CONN_STATUS_WANT_READ) {
+        ev_io_stop(loop, &(pkc->watch_w));
+        ev_io_start(loop, &(pkc->watch_r));
+      }
+      else {
+        ev_io_stop(loop, &(pkc->watch_r));
+        ev_io_start(loop, &(pkc->watch_w));
+      }
+      return;
+    }
+
+    pk_log(PK_LOG_TUNNEL_DATA, " - Read response ...");
+    fe->handshake = FE_HANDSHAKE_READING;
+    ev_io_stop(loop, &(pkc->watch_w));
+    ev_io_start(loop, &(pkc->watch_r));
+  }
+
+  /* Gather the response, until we have all of its header. */
+  length = 0;
+  space = PK_HANDSHAKE_RESPONSE_MAX - 1 - fe->handshake_bytes;
+  while ((space > 0) &&
+         (0 < (bytes = pkc_read_into(pkc, fe->handshake_buffer
+                                          + fe->handshake_bytes, space)))) {
+    fe->handshake_bytes += bytes;
+    space -= bytes;
+    if (0 < (length = pk_handshake_length(fe->handshake_buffer,
+                                          fe->handshake_bytes))) break;
+  }
+  if (length > 0) {
+    pkm_handshake_response(fe, length);
+  }
+  else if ((space < 1) ||
+           (pkc->status & (CONN_STATUS_CLS_READ|CONN_STATUS_BROKEN))) {
+    pkm_handshake_done(fe, ERR_CONNECT_REQUEST);
+  }
+  else if (0 < pkc_pending(pkc)) {
+    ev_feed_event(loop, &(pkc->watch_r), EV_READ);
+  }
+}
+
+/* We have the frontend's response header: are we flying? */
+static void pkm_handshake_response(struct pk_tunnel* fe, int length)
+{
+  int rv, space;
+  char* data;
+  char* response = fe->handshake_buffer;
+  int extra = fe->handshake_bytes - length;
+
+  /* Anything after the header is already tunnel traffic. */
+  if (extra > 0) {
+    data = pk_parser_buffer(fe->parser, &space);
+    if (extra > space) {
+      pkm_handshake_done(fe, ERR_CONNECT_REQUEST);
+      return;
+    }
+    memcpy(data, response + length, extra);
+  }
+  response[length] = '\0';
+
+  rv = pk_parse_handshake(response, length, fe->request_count, fe->requests,
+                          fe->fe_session);
+  if ((rv > 0) && (0 == fe->handshake_rounds++)) {
+    /* The frontend sent us salts to sign our requests with: try again. */
+    ev_io_stop(fe->worker->loop, &(fe->conn.watch_r));
+    ev_io_stop(fe->worker->loop, &(fe->conn.watch_w));
+    pkm_handshake_connect(fe);
+    return;
+  }
+  if (rv > 0) rv = (pk_error = ERR_CONNECT_REJECTED);
+  pkm_handshake_done(fe, rv);
+
+  if ((rv >= 0) && (extra > 0)) {
+    if (0 > pk_parser_parse_new_data(fe->parser, extra)) {
+      pk_parser_reset(fe->parser);
+      fe->conn.status |= CONN_STATUS_BROKEN;
+    }
+    pkm_update_io(fe, NULL);
+  }
+}
+
+/* The handshake is over: either the tunnel is live, or we give up on this
+ * frontend for now.  Whoever is waiting in pkm_reconnect_all() is told. */
+static void pkm_handshake_done(struct pk_tunnel* fe, int rv)
+{
+  struct pk_manager* pkm = fe->manager;
+  struct ev_loop* loop = fe->worker->loop;
+  unsigned int status;
+  int i;
+  int lame = 0;
+  int tls = 0;
+
+  PK_TRACE_FUNCTION;
+
+  ev_timer_stop(loop, &(fe->handshake_timer));
+  ev_io_stop(loop, &(fe->conn.watch_r));
+  ev_io_stop(loop, &(fe->conn.watch_w));
+  if (NULL != fe->handshake_buffer) free(fe->handshake_buffer);
+  fe->handshake_buffer = NULL;
+  fe->handshake_bytes = 0;
+  fe->handshake = FE_HANDSHAKE_NONE;
+
+  if (rv >= 0) {
+#ifdef HAVE_OPENSSL
+    if (NULL != fe->conn.ssl) {
+      tls = SSL_session_reused(fe->conn.ssl) ? 2 : 1;
+      pkm_save_session(fe);
+    }
+#endif
+    fe->connect_latency = ev_time() - fe->handshake_started;
+    pk_log(PK_LOG_MANAGER_INFO, "Connected! (%s, %.0f ms%s)",
+                                fe->fe_hostname, 1000 * fe->connect_latency,
+                                (tls == 2) ? ", TLS resumed" : "");
+
+    int ev_sock = PKS_EV_FD(fe->conn.sockfd);
+    ev_io_init(&(fe->conn.watch_r),
+               pkm_tunnel_readable_cb, ev_sock, EV_READ);
+    ev_io_init(&(fe->conn.watch_w),
+               pkm_tunnel_writable_cb, ev_sock, EV_WRITE);
+
+    fe->conn.watch_r.data = fe->conn.watch_w.data = (void *) fe;
+    ev_io_start(loop, &(fe->conn.watch_r));
+    if (0 < pkc_pending(&(fe->conn)))
+      ev_feed_event(loop, &(fe->conn.watch_r), EV_READ);
+
+    PKS_STATE(pk_state.live_tunnels += 1);
+    fe->error_count = 0;
+  }
+  else {
+    /* FIXME: Is this the right behavior? */
+    pk_error = rv;
+    pk_log(PK_LOG_MANAGER_INFO, "Connect failed: %d", fe->conn.sockfd);
+    fe->request_count = 0;
+    if (fe->error_count < 999)
+      fe->error_count += 1;
+
+    status = fe->conn.status;
+    if (rv == ERR_CONNECT_REJECTED) {
+      /* Start over with fresh salts next time. */
+      for (i = 0; i < pkm->kite_max; i++)
+        fe->requests[i].bsalt[0] = fe->requests[i].fsalt[0] = '\0';
+      status |= FE_STATUS_REJECTED;
+      PKS_STATE(pkm->status = PK_STATUS_REJECTED);
+    }
+    else if (rv == ERR_CONNECT_DUPLICATE) {
+      status |= FE_STATUS_LAME;
+      lame = 1;
+    }
+#ifdef HAVE_OPENSSL
+    /* If TLS itself failed, the frontend may not like our old session. */
+    if ((fe->conn.state == CONN_SSL_HANDSHAKE) && (NULL != fe->ssl_session)) {
+      SSL_SESSION_free(fe->ssl_session);
+      fe->ssl_session = NULL;
+    }
+#endif
+    pkc_reset_conn(&(fe->conn), 0);
+    fe->conn.status = (CONN_STATUS_ALLOCATED | (status & FE_STATUS_BITS));
+
+    pk_perror("pkmanager.c");
+  }
+
+  pthread_mutex_lock(&(pkm->handshake_lock));
+  pkm->handshakes_pending -= 1;
+  if (rv >= 0) pkm->handshakes_connected += 1;
+  pkm->handshakes_lame += lame;
+  if (tls == 1) pkm->tls_handshakes_full += 1;
+  if (tls == 2) pkm->tls_handshakes_resumed += 1;
+  pthread_cond_broadcast(&(pkm->handshake_cond));
+  pthread_mutex_unlock(&(pkm->handshake_lock));
+}
+
+#ifdef HAVE_OPENSSL
+/* Remember the tunnel's TLS session, so the next connection to the same
+ * frontend can resume it instead of doing a full handshake.  We keep a
+ * copy, as OpenSSL stops offering a session once its connection goes
+ * away without a clean shutdown, which is how tunnels usually end. */
+static void pkm_save_session(struct pk_tunnel* fe)
+{
+  SSL_SESSION* session = SSL_get1_session(fe->conn.ssl);
+  if (NULL == session) return;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (!SSL_SESSION_is_resumable(session)) {
+    SSL_SESSION_free(session);
+    return;
+  }
+  SSL_SESSION* copy = SSL_SESSION_dup(session);
+  SSL_SESSION_free(session);
+  if (NULL == (session = copy)) return;
+#endif
+  if (NULL != fe->ssl_session) SSL_SESSION_free(fe->ssl_session);
+  fe->ssl_session = session;
+}
+#endif
+
+/* Make sure the tunnel has a request for every kite, returning how many
+ * are not flying.  The salts of earlier handshakes are kept: frontends
+ * accept an fsalt for a while, so a tunnel which went down can usually
+ * come back up on the first connection, without a SignThis round trip. */
+static int pkm_prepare_requests(struct pk_manager* pkm, struct pk_tunnel* fe)
+{
+  struct pk_kite_request *kite_r;
+  int j, reconnect;
+
+  if (fe->request_count != pkm->kite_max) {
+    fe->request_count = pkm->kite_max;
+    for (kite_r = fe->requests, j = 0; j < pkm->kite_max; j++, kite_r++) {
+      if (kite_r->kite != (pkm->kites + j))
+        memset(kite_r, 0, sizeof(struct pk_kite_request));
+      kite_r->kite = (pkm->kites + j);
+      kite_r->status = PK_KITE_UNKNOWN;
+    }
+  }
+
+  reconnect = 0;
+  for (kite_r = fe->requests, j = 0; j < pkm->kite_max; j++, kite_r++) {
+    if (kite_r->status == PK_KITE_UNKNOWN) reconnect++;
+  }
+  return reconnect;
+}
+
+int pkm_reconnect_all(struct pk_manager* pkm) {
+  struct pk_tunnel *fe;
+  struct timespec wait_until;
+  ev_tstamp started, deadline;
+  unsigned int status;
+  int i, tried, connected, lame;
+
+  PK_TRACE_FUNCTION;
+  tried = connected = 0;
+
+  /* All handshakes run at once and share a deadline, so a pass takes no
+   * longer than the slowest frontend (or reconnect_timeout). */
+  started = ev_time();
+  deadline = started + pkm->reconnect_timeout;
+
+  pthread_mutex_lock(&(pkm->handshake_lock));
+  pkm->handshakes_connected = pkm->handshakes_lame = 0;
+  pthread_mutex_unlock(&(pkm->handshake_lock));
+
+  /* Loop through all configured kites:
+   *   - if missing a desired front-end, tear down tunnels and reconnect.
    */
   pkm_block(pkm);
   for (i = 0; i < pkm->tunnel_max; i++) {
@@ -657,27 +1659,14 @@ int pkm_reconnect_all(struct pk_manager* pkm) {
 
     if (fe->fe_hostname == NULL) continue;
     if (!(fe->conn.status & (FE_STATUS_WANTED|FE_STATUS_IN_DNS))) continue;
+    if (fe->handshake != FE_HANDSHAKE_NONE) continue;
 
-    if (fe->requests == NULL || fe->request_count != pkm->kite_max) {
-      fe->request_count = pkm->kite_max;
-      memset(fe->requests, 0, pkm->kite_max * sizeof(struct pk_kite_request));
-      for (kite_r = fe->requests, j = 0; j < pkm->kite_max; j++, kite_r++) {
-        kite_r->kite = (pkm->kites + j);
-        kite_r->status = PK_KITE_UNKNOWN;
-      }
-    }
-
-    reconnect = 0;
-    for (kite_r = fe->requests, j = 0; j < pkm->kite_max; j++, kite_r++) {
-      if (kite_r->status == PK_KITE_UNKNOWN) reconnect++;
-    }
-
-    if (reconnect) {
+    if (pkm_prepare_requests(pkm, fe)) {
       tried++;
       PKS_STATE(pkm->status = PK_STATUS_CONNECT);
       if (0 <= fe->conn.sockfd) {
-        ev_io_stop(pkm->loop, &(fe->conn.watch_r));
-        ev_io_stop(pkm->loop, &(fe->conn.watch_w));
+        ev_io_stop(fe->worker->loop, &(fe->conn.watch_r));
+        ev_io_stop(fe->worker->loop, &(fe->conn.watch_w));
         PKS_close(fe->conn.sockfd);
         fe->conn.sockfd = -1;
       }
@@ -685,59 +1674,32 @@ int pkm_reconnect_all(struct pk_manager* pkm) {
       pkc_reset_conn(&(fe->conn), 0);
       fe->conn.status = (CONN_STATUS_ALLOCATED | (status & FE_STATUS_BITS));
 
-      /* Unblock the event loop while we attempt to connect. */
-      pkm_unblock(pkm);
-
-      if ((0 <= pk_connect_ai(&(fe->conn), fe->ai, 0,
-                              fe->request_count, fe->requests,
-                              (fe->fe_session), fe->manager->ssl_ctx)) &&
-          (0 < set_non_blocking(fe->conn.sockfd))) {
-        pk_log(PK_LOG_MANAGER_INFO, "Connected!");
-        pkm_block(pkm); /* Re-block */
-
-        pk_parser_reset(fe->parser);
-
-        int ev_sock = PKS_EV_FD(fe->conn.sockfd);
-        ev_io_init(&(fe->conn.watch_r),
-                   pkm_tunnel_readable_cb, ev_sock, EV_READ);
-        ev_io_init(&(fe->conn.watch_w),
-                   pkm_tunnel_writable_cb, ev_sock, EV_WRITE);
-
-        fe->conn.watch_r.data = fe->conn.watch_w.data = (void *) fe;
-        ev_io_start(pkm->loop, &(fe->conn.watch_r));
-
-        PKS_STATE(pk_state.live_tunnels += 1);
-        fe->error_count = 0;
-        connected++;
-      }
-      else {
-        pkm_block(pkm); /* Re-block */
-
-        /* FIXME: Is this the right behavior? */
-        pk_log(PK_LOG_MANAGER_INFO, "Connect failed: %d", fe->conn.sockfd);
-        fe->request_count = 0;
-        if (fe->error_count < 999)
-          fe->error_count += 1;
-
-        status = fe->conn.status;
-        if (pk_error == ERR_CONNECT_REJECTED) {
-          status |= FE_STATUS_REJECTED;
-          PKS_STATE(pkm->status = PK_STATUS_REJECTED);
-        }
-        else if (pk_error == ERR_CONNECT_DUPLICATE) {
-          status |= FE_STATUS_LAME;
-          tried -= 1;
-        }
-        pkc_reset_conn(&(fe->conn), 0);
-        fe->conn.status = (CONN_STATUS_ALLOCATED | (status & FE_STATUS_BITS));
-
-        pk_perror("pkmanager.c");
-      }
+      pkm_queue_handshake(fe, deadline);
     }
   }
   PK_CHECK_MEMORY_CANARIES;
   pkm_unblock(pkm);
-  return (tried - connected);
+
+  /* Wait for the event loops to finish the job; the handshake timers
+   * fire at the deadline, the extra second is for them to report back. */
+  deadline += 1;
+  wait_until.tv_sec = (time_t) deadline;
+  wait_until.tv_nsec = (long) (1e9 * (deadline - (time_t) deadline));
+  pthread_mutex_lock(&(pkm->handshake_lock));
+  while (0 < pkm->handshakes_pending) {
+    PK_TRACE_LOOP("waiting for handshakes");
+    if (ETIMEDOUT == pthread_cond_timedwait(&(pkm->handshake_cond),
+                                            &(pkm->handshake_lock),
+                                            &wait_until)) break;
+  }
+  connected = pkm->handshakes_connected;
+  lame = pkm->handshakes_lame;
+  pthread_mutex_unlock(&(pkm->handshake_lock));
+
+  if (tried)
+    pk_log(PK_LOG_MANAGER_INFO, "Reconnected %d of %d tunnels in %.0f ms",
+                                connected, tried, 1000 * (ev_time() - started));
+  return (tried - lame - connected);
 }
 
 int pkm_disconnect_unused(struct pk_manager* pkm) {
@@ -745,7 +1707,7 @@ int pkm_disconnect_unused(struct pk_manager* pkm) {
   struct pk_backend_conn* pkb;
   char buffer[1025];
   unsigned int status;
-  int i, j, disconnect, disconnected;
+  int i, disconnect, disconnected;
 
   PK_TRACE_FUNCTION;
   disconnected = 0;
@@ -760,12 +1722,12 @@ int pkm_disconnect_unused(struct pk_manager* pkm) {
     if (fe->fe_hostname == NULL) continue;
     if (fe->conn.sockfd <= 0) continue;
     if (fe->conn.status & (FE_STATUS_WANTED|FE_STATUS_IN_DNS)) continue;
+    if (fe->handshake != FE_HANDSHAKE_NONE) continue;
 
     /* Check if there are any live streams... */
     disconnect = 1;
-    for (j = 0; j < pkm->be_conn_max; j++) {
-      pkb = (pkm->be_conns + j);
-      if (pkb->conn.sockfd > 0 && pkb->tunnel == fe) {
+    for (pkb = fe->streams; pkb != NULL; pkb = pkb->tunnel_next) {
+      if (pkb->conn.sockfd > 0) {
         disconnect = 0;
         break;
       }
@@ -775,8 +1737,8 @@ int pkm_disconnect_unused(struct pk_manager* pkm) {
       pk_log(PK_LOG_MANAGER_INFO, "Disconnecting: %s",
                                 in_addr_to_str(fe->ai->ai_addr, buffer, 1024));
 
-      ev_io_stop(pkm->loop, &(fe->conn.watch_r));
-      ev_io_stop(pkm->loop, &(fe->conn.watch_w));
+      ev_io_stop(fe->worker->loop, &(fe->conn.watch_r));
+      ev_io_stop(fe->worker->loop, &(fe->conn.watch_w));
       PKS_close(fe->conn.sockfd);
       fe->conn.sockfd = -1;
       disconnected += 1;
@@ -839,7 +1801,8 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
   /* Loop through all configured tunnels ... */
   pingsize = 0;
   for (i = 0, fe = pkm->tunnels; i < pkm->tunnel_max; i++, fe++) {
-    if (fe->conn.sockfd >= 0) {
+    pkm_lock_worker(fe->worker);
+    if ((fe->conn.sockfd >= 0) && (fe->handshake == FE_HANDSHAKE_NONE)) {
       /* If dead, shut 'em down. */
       if (fe->conn.activity < fe->last_ping - 4*pkm->housekeeping_interval_min)
       {
@@ -851,11 +1814,12 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
       else if (fe->conn.activity < inactive) {
         if (pingsize == 0) pingsize = pk_format_ping(ping);
         fe->last_ping = now;
-        pkc_write(&(fe->conn), ping, pingsize);
+        pkm_write_control(fe, ping, pingsize);
         pk_log(PK_LOG_TUNNEL_DATA, "%d: Sent PING.", fe->conn.sockfd);
         next_tick = 1 + pkm->housekeeping_interval_min;
       }
     }
+    pkm_unlock_worker(fe->worker);
   }
 
   /* Finally, trigger the tunnel check on the blocking thread. */
@@ -903,57 +1867,125 @@ void pkm_set_timer_enabled(struct pk_manager* pkm, int enabled) {
 static void pkm_reset_manager(struct pk_manager* pkm) {
   int i;
   struct pk_conn* pkc;
+  struct pk_backend_conn* pkb;
+  struct ev_loop* loop;
 
   PK_TRACE_FUNCTION;
 
   for (i = 0; i < pkm->kite_max; i++) {
     pk_reset_pagekite(pkm->kites+i);
   }
+  memset(pkm->kite_index, 0, sizeof(struct pk_pagekite*) * pkm->kite_index_max);
+  pkm->kite_count = 0;
   for (i = 0; i < pkm->tunnel_max; i++) {
     pkc = &((pkm->tunnels+i)->conn);
+    (pkm->tunnels+i)->streams = NULL;
+    (pkm->tunnels+i)->ready_head = (pkm->tunnels+i)->ready_tail = NULL;
+    (pkm->tunnels+i)->reports_pending = 0;
+    (pkm->tunnels+i)->handshake = FE_HANDSHAKE_NONE;
+    ev_timer_stop((pkm->tunnels+i)->worker->loop,
+                  &((pkm->tunnels+i)->handshake_timer));
     if (pkc->status != CONN_STATUS_UNKNOWN) {
-      ev_io_stop(pkm->loop, &(pkc->watch_r));
-      ev_io_stop(pkm->loop, &(pkc->watch_w));
+      ev_io_stop((pkm->tunnels+i)->worker->loop, &(pkc->watch_r));
+      ev_io_stop((pkm->tunnels+i)->worker->loop, &(pkc->watch_w));
       pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
     }
   }
   for (i = 0; i < pkm->be_conn_max; i++) {
-    pkc = &((pkm->be_conns+i)->conn);
+    pkb = pkm->be_conns+i;
+    pkc = &(pkb->conn);
+    pkb->tunnel_next = pkb->tunnel_prev = NULL;
+    pkb->ready_next = pkb->ready_prev = NULL;
+    pkb->deficit = 0;
     if (pkc->status != CONN_STATUS_UNKNOWN) {
-      ev_io_stop(pkm->loop, &(pkc->watch_r));
-      ev_io_stop(pkm->loop, &(pkc->watch_w));
+      loop = (pkb->tunnel != NULL) ? pkb->tunnel->worker->loop : pkm->loop;
+      ev_timer_stop(loop, &(pkb->connect_timer));
+      ev_io_stop(loop, &(pkc->watch_r));
+      ev_io_stop(loop, &(pkc->watch_w));
       pkc_reset_conn(pkc, 0);
     }
   }
+  pkm_be_index_rebuild(pkm);
+  pkm_be_free_rebuild(pkm);
   ev_async_stop(pkm->loop, &(pkm->quit));
 }
 
+/* Kites are hashed case-insensitively on (protocol, domain, port), with
+ * any port <= 0 stored as the wildcard port 0.  The index only ever grows
+ * (kites are cleared all at once by pkm_reset_manager), so plain linear
+ * probing without tombstones is enough. */
+#define PKM_KITE_PORT(p) (((p) > 0) ? (p) : 0)
+#define PKM_ASCII_LOWER(c) ((((c) >= 'A') && ((c) <= 'Z')) ? ((c) | 0x20) : (c))
+
+static unsigned int pkm_kite_hash(const char* protocol,
+                                  const char* domain,
+                                  int port)
+{
+  unsigned int hash = 2166136261u ^ (unsigned int) PKM_KITE_PORT(port);
+  const char* p;
+
+  for (p = protocol; *p != '\0'; p++) {
+    hash ^= (unsigned char) PKM_ASCII_LOWER(*p);
+    hash *= 16777619u;
+  }
+  hash ^= ':';
+  hash *= 16777619u;
+  for (p = domain; *p != '\0'; p++) {
+    hash ^= (unsigned char) PKM_ASCII_LOWER(*p);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static struct pk_pagekite** pkm_kite_index_slot(struct pk_manager* pkm,
+                                                const char* protocol,
+                                                const char* domain,
+                                                int port)
+{
+  int i;
+  struct pk_pagekite** slot;
+
+  port = PKM_KITE_PORT(port);
+  i = pkm_kite_hash(protocol, domain, port) % pkm->kite_index_max;
+  for (;;) {
+    PK_TRACE_LOOP("probing");
+    slot = pkm->kite_index + i;
+    if ((*slot == NULL) ||
+        ((PKM_KITE_PORT((*slot)->public_port) == port) &&
+         (0 == strcasecmp(domain, (*slot)->public_domain)) &&
+         (0 == strcasecmp(protocol, (*slot)->protocol))))
+      return slot;
+    if (++i >= pkm->kite_index_max) i = 0;
+  }
+}
+
+static void pkm_kite_index_add(struct pk_manager* pkm,
+                               struct pk_pagekite* kite)
+{
+  struct pk_pagekite** slot;
+
+  slot = pkm_kite_index_slot(pkm, kite->protocol, kite->public_domain,
+                             kite->public_port);
+
+  /* Duplicates keep the precedence of the old linear search: the first
+   * kite wins for a specific port, the last one for the wildcard. */
+  if ((*slot == NULL) || (kite->public_port <= 0)) *slot = kite;
+}
+
 static struct pk_pagekite* pkm_find_kite(struct pk_manager* pkm,
                                          const char* protocol,
                                          const char* domain,
                                          int port)
 {
-  int which;
   struct pk_pagekite* kite;
-  struct pk_pagekite* found;
 
   PK_TRACE_FUNCTION;
 
-  /* FIXME: This is O(N), we'll need a nicer data structure for tunnels */
-  found = NULL;
-  for (which = 0; which < pkm->kite_max; which++) {
-    kite = pkm->kites+which;
-    if (kite->protocol[0] != '\0') {
-      if ((0 == strcasecmp(domain, kite->public_domain)) &&
-          (0 == strcasecmp(protocol, kite->protocol))) {
-        if (kite->public_port <= 0)
-          found = kite;
-        else if (kite->public_port == port)
-          return kite;
-      }
-    }
+  if (port > 0) {
+    kite = *pkm_kite_index_slot(pkm, protocol, domain, port);
+    if (kite != NULL) return kite;
   }
-  return found;
+  return *pkm_kite_index_slot(pkm, protocol, domain, 0);
 }
 
 struct pk_pagekite* pkm_add_kite(struct pk_manager* pkm,
@@ -962,22 +1994,15 @@ struct pk_pagekite* pkm_add_kite(struct pk_manager* pkm,
                                  const char* auth_secret,
                                  const char* local_domain, int local_port)
 {
-  int which;
   char *pp;
-  struct pk_pagekite* kite = NULL;
+  struct pk_pagekite* kite;
 
   PK_TRACE_FUNCTION;
 
-  /* FIXME: This is O(N), we'll need a nicer data structure for tunnels */
-  for (which = 0; which < pkm->kite_max; which++) {
-    kite = pkm->kites+which;
-    if (kite->protocol[0] == '\0') break;
-  }
-  if (which >= pkm->kite_max)
+  if (pkm->kite_count >= pkm->kite_max)
     return pk_err_null(ERR_NO_MORE_KITES);
 
-  if (kite == NULL)
-    return pk_err_null(ERR_NO_KITE);
+  kite = pkm->kites + pkm->kite_count;
 
   strncpyz(kite->protocol, protocol, PK_PROTOCOL_LENGTH);
   strncpyz(kite->auth_secret, auth_secret, PK_SECRET_LENGTH);
@@ -985,6 +2010,9 @@ struct pk_pagekite* pkm_add_kite(struct pk_manager* pkm,
   kite->public_port = public_port;
   strncpyz(kite->local_domain, local_domain, PK_DOMAIN_LENGTH);
   kite->local_port = local_port;
+  kite->connect_timeout = CONN_CONNECT_TIMEOUT_DEFAULT;
+  kite->local_addr_count = kite->local_addr_next = 0;
+  kite->local_addrs_expire = 0;
 
   /* Allow the public port to be specified as part of the protocol */
   if ((0 == public_port) && (NULL != (pp = strchr(kite->protocol, '-')))) {
@@ -992,10 +2020,162 @@ struct pk_pagekite* pkm_add_kite(struct pk_manager* pkm,
     sscanf(pp, "%d", &(kite->public_port));
   }
 
+  pkm->kite_count += 1;
+  pkm_kite_index_add(pkm, kite);
+
   PK_CHECK_MEMORY_CANARIES;
   return kite;
 }
 
+/* Backend addresses are cached per kite, so new streams only have to copy
+ * a sockaddr.  The blocker threads keep the cache fresh (see
+ * pkm_resolve_backends), the event loop never resolves names itself. */
+static int pkm_lookup_backend(struct pk_pagekite* kite,
+                              struct sockaddr_storage* addrs,
+                              socklen_t* addr_lens)
+{
+  struct addrinfo hints;
+  struct addrinfo *result, *rp;
+  char port[16];
+  int family, count;
+
+  PK_TRACE_FUNCTION;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  sprintf(port, "%d", kite->local_port);
+  if (0 != getaddrinfo(kite->local_domain, port, &hints, &result)) return 0;
+
+  /* IPv4 first, as with gethostbyname() before, then IPv6. */
+  count = 0;
+  for (family = AF_INET; family != AF_UNSPEC;
+       family = (family == AF_INET) ? AF_INET6 : AF_UNSPEC) {
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+      if ((rp->ai_family == family) &&
+          (rp->ai_addrlen <= sizeof(struct sockaddr_storage)) &&
+          (count < PK_LOCAL_ADDRS_MAX)) {
+        memcpy(addrs + count, rp->ai_addr, rp->ai_addrlen);
+        addr_lens[count++] = rp->ai_addrlen;
+      }
+    }
+  }
+  freeaddrinfo(result);
+  return count;
+}
+
+static void pkm_store_backend(struct pk_manager* pkm,
+                              struct pk_pagekite* kite,
+                              struct sockaddr_storage* addrs,
+                              socklen_t* addr_lens, int count)
+{
+  pthread_mutex_lock(&(pkm->be_addr_lock));
+  memcpy(kite->local_addrs, addrs, count * sizeof(struct sockaddr_storage));
+  memcpy(kite->local_addr_lens, addr_lens, count * sizeof(socklen_t));
+  if (kite->local_addr_next >= count) kite->local_addr_next = 0;
+  kite->local_addr_count = count;
+  kite->local_addrs_expire = time(0) + ((count > 0) ? PK_BACKEND_DNS_TTL
+                                                    : PK_BACKEND_DNS_RETRY);
+  pthread_mutex_unlock(&(pkm->be_addr_lock));
+}
+
+/* Copy out the preferred address for a kite's backend, scheduling a
+ * refresh if the cached addresses are stale or missing.  Returns -1 if we
+ * have none (yet), in which case the stream is rejected: blocking the
+ * loop on the resolver would stall every other stream instead. */
+static int pkm_backend_addr(struct pk_manager* pkm,
+                            struct pk_pagekite* kite,
+                            struct sockaddr_storage* addr,
+                            socklen_t* addr_len)
+{
+  int rv, refresh;
+
+  pthread_mutex_lock(&(pkm->be_addr_lock));
+  if (0 == kite->local_addrs_expire)
+    pk_log(PK_LOG_BE_CONNS, "%s: Not resolved yet", kite->local_domain);
+
+  rv = -1;
+  if (0 < kite->local_addr_count) {
+    memcpy(addr, kite->local_addrs + kite->local_addr_next,
+           sizeof(struct sockaddr_storage));
+    *addr_len = kite->local_addr_lens[kite->local_addr_next];
+    rv = 0;
+  }
+  refresh = ((kite->local_addrs_expire <= time(0)) &&
+             !pkm->be_resolve_pending);
+  if (refresh) pkm->be_resolve_pending = 1;
+  pthread_mutex_unlock(&(pkm->be_addr_lock));
+
+  if (refresh &&
+      (0 > pkb_add_job(&(pkm->blocking_jobs), PK_RESOLVE_BACKENDS, pkm))) {
+    pthread_mutex_lock(&(pkm->be_addr_lock));
+    pkm->be_resolve_pending = 0;
+    pthread_mutex_unlock(&(pkm->be_addr_lock));
+  }
+  return rv;
+}
+
+/* Connecting failed: prefer the next address (if any) from now on. */
+static void pkm_skip_backend_addr(struct pk_manager* pkm,
+                                  struct pk_pagekite* kite)
+{
+  pthread_mutex_lock(&(pkm->be_addr_lock));
+  if (0 < kite->local_addr_count) {
+    kite->local_addr_next += 1;
+    kite->local_addr_next %= kite->local_addr_count;
+  }
+  pthread_mutex_unlock(&(pkm->be_addr_lock));
+}
+
+/* Refresh stale backend addresses; called from the blocker threads.
+ * Returns the number of kites which failed to resolve. */
+int pkm_resolve_backends(struct pk_manager* pkm)
+{
+  struct sockaddr_storage addrs[PK_LOCAL_ADDRS_MAX];
+  socklen_t addr_lens[PK_LOCAL_ADDRS_MAX];
+  struct pk_pagekite* kite;
+  int i, count, failed;
+
+  PK_TRACE_FUNCTION;
+
+  pthread_mutex_lock(&(pkm->be_addr_lock));
+  pkm->be_resolve_pending = 0;
+  pthread_mutex_unlock(&(pkm->be_addr_lock));
+
+  failed = 0;
+  for (i = 0, kite = pkm->kites; i < pkm->kite_count; i++, kite++) {
+    if (kite->local_addrs_expire > time(0)) continue;
+
+    count = pkm_lookup_backend(kite, addrs, addr_lens);
+    pkm_store_backend(pkm, kite, addrs, addr_lens, count);
+    if (count < 1) {
+      pk_log(PK_LOG_MANAGER_ERROR, "Failed to resolve backend %s",
+                                   kite->local_domain);
+      failed++;
+    }
+  }
+  PK_CHECK_MEMORY_CANARIES;
+  return failed;
+}
+
+int pkm_set_kite_connect_timeout(struct pk_manager* pkm,
+                                 const char* protocol,
+                                 const char* public_domain, int public_port,
+                                 int seconds)
+{
+  struct pk_pagekite* kite;
+
+  PK_TRACE_FUNCTION;
+
+  if (NULL == (kite = pkm_find_kite(pkm, protocol, public_domain,
+                                    public_port)))
+    return (pk_error = ERR_NO_KITE);
+
+  if (seconds < 1) seconds = CONN_CONNECT_TIMEOUT_DEFAULT;
+  kite->connect_timeout = seconds;
+  return 0;
+}
+
 int pkm_add_frontend(struct pk_manager* pkm,
                      const char* hostname, int port, int flags)
 {
@@ -1083,40 +2263,201 @@ static unsigned char pkm_sid_shift(char *sid)
   return shift;
 }
 
-struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager* pkm,
-                                          struct pk_tunnel* fe, char *sid)
+/* The stream index maps (tunnel, SID) to a backend connection.  Deleted
+ * entries leave a tombstone behind so probe sequences stay intact; once
+ * there are too many of those, the table is rebuilt from be_conns. */
+static char pkm_be_tombstone;
+#define PKM_BE_TOMBSTONE ((struct pk_backend_conn*) &pkm_be_tombstone)
+
+static unsigned int pkm_be_hash(struct pk_tunnel* fe, const char* sid)
 {
-  int i, evicting;
-  time_t max_age;
-  unsigned char shift;
-  struct pk_backend_conn* pkb;
-  struct pk_backend_conn* pkb_oldest;
+  /* FNV-1a over the SID, seeded with the tunnel pointer.  Only the first
+   * BE_MAX_SID_SIZE characters count, since that is all we compare. */
+  unsigned int hash = 2166136261u ^ (unsigned int) (((size_t) fe) >> 4);
+  int i;
 
-  PK_TRACE_FUNCTION;
+  for (i = 0; (i < BE_MAX_SID_SIZE) && (sid[i] != '\0'); i++) {
+    hash ^= (unsigned char) sid[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
 
-  max_age = time(0);
-  pkb_oldest = NULL;
-  shift = pkm_sid_shift(sid);
-  for (i = 0; i < pkm->be_conn_max; i++) {
-    pkb = (pkm->be_conns + ((i + shift) % pkm->be_conn_max));
-    if (!(pkb->conn.status & CONN_STATUS_ALLOCATED)) {
-      pkc_reset_conn(&(pkb->conn), CONN_STATUS_ALLOCATED);
-      pkb->tunnel = fe;
-      strncpyz(pkb->sid, sid, BE_MAX_SID_SIZE-1);
-      return pkb;
+static void pkm_be_index_add(struct pk_manager* pkm,
+                             struct pk_backend_conn* pkb)
+{
+  int i;
+  struct pk_backend_conn** slot;
+
+  i = pkm_be_hash(pkb->tunnel, pkb->sid) % pkm->be_conn_index_max;
+  for (;;) {
+    PK_TRACE_LOOP("probing");
+    slot = pkm->be_conn_index + i;
+    if (*slot == NULL) {
+      pkm->be_conn_index_used += 1;
+      break;
     }
-    if (pkb->conn.activity <= max_age) {
-      max_age = pkb->conn.activity;
-      pkb_oldest = pkb;
+    if (*slot == PKM_BE_TOMBSTONE) {
+      pkm->be_conn_index_tombstones -= 1;
+      break;
     }
+    if (++i >= pkm->be_conn_index_max) i = 0;
   }
+  *slot = pkb;
+}
 
-  /* If we get this far, we found no empty slots. Let's complain to the
-   * log and, if so configured, kick out the oldest idle connection. */
-  if (NULL != (pkb = pkb_oldest)) {
-    max_age = time(0) - pkb->conn.activity;
-    evicting = (pk_state.conn_eviction_idle_s &&
-               (pk_state.conn_eviction_idle_s < max_age));
+static void pkm_be_index_remove(struct pk_manager* pkm,
+                                struct pk_backend_conn* pkb)
+{
+  int i, probes;
+  struct pk_backend_conn** slot;
+
+  i = pkm_be_hash(pkb->tunnel, pkb->sid) % pkm->be_conn_index_max;
+  for (probes = 0; probes < pkm->be_conn_index_max; probes++) {
+    PK_TRACE_LOOP("probing");
+    slot = pkm->be_conn_index + i;
+    if (*slot == NULL) return;
+    if (*slot == pkb) {
+      *slot = PKM_BE_TOMBSTONE;
+      pkm->be_conn_index_tombstones += 1;
+      if (pkm->be_conn_index_tombstones > pkm->be_conn_index_max / 4)
+        pkm_be_index_rebuild(pkm);
+      return;
+    }
+    if (++i >= pkm->be_conn_index_max) i = 0;
+  }
+}
+
+static void pkm_be_index_rebuild(struct pk_manager* pkm)
+{
+  int i;
+  struct pk_backend_conn* pkb;
+
+  PK_TRACE_FUNCTION;
+
+  memset(pkm->be_conn_index, 0,
+         sizeof(struct pk_backend_conn*) * pkm->be_conn_index_max);
+  pkm->be_conn_index_used = 0;
+  pkm->be_conn_index_tombstones = 0;
+  for (i = 0; i < pkm->be_conn_max; i++) {
+    pkb = (pkm->be_conns + i);
+    if (pkb->conn.status & CONN_STATUS_ALLOCATED)
+      pkm_be_index_add(pkm, pkb);
+  }
+}
+
+/* Unallocated be_conns are kept on a list, so new streams find a slot
+ * without scanning the whole array. */
+static void pkm_be_free_rebuild(struct pk_manager* pkm)
+{
+  int i;
+  struct pk_backend_conn* pkb;
+
+  pkm->be_conn_free = NULL;
+  for (i = pkm->be_conn_max - 1; i >= 0; i--) {
+    pkb = (pkm->be_conns + i);
+    pkb->free_next = NULL;
+    if (!(pkb->conn.status & CONN_STATUS_ALLOCATED)) {
+      pkb->free_next = pkm->be_conn_free;
+      pkm->be_conn_free = pkb;
+    }
+  }
+}
+
+/* Each tunnel keeps a doubly linked list of its streams, so tunnel-wide
+ * operations (flow control, teardown) need not scan every be_conn. */
+static void pkm_link_be_conn(struct pk_backend_conn* pkb)
+{
+  pkb->tunnel_prev = NULL;
+  pkb->tunnel_next = NULL;
+  if (pkb->tunnel == NULL) return;
+
+  pkb->tunnel_next = pkb->tunnel->streams;
+  if (pkb->tunnel_next != NULL) pkb->tunnel_next->tunnel_prev = pkb;
+  pkb->tunnel->streams = pkb;
+}
+
+static void pkm_unlink_be_conn(struct pk_backend_conn* pkb)
+{
+  pkm_unqueue_stream(pkb);
+  if (pkb->tunnel_next != NULL)
+    pkb->tunnel_next->tunnel_prev = pkb->tunnel_prev;
+  if (pkb->tunnel_prev != NULL)
+    pkb->tunnel_prev->tunnel_next = pkb->tunnel_next;
+  else if ((pkb->tunnel != NULL) && (pkb->tunnel->streams == pkb))
+    pkb->tunnel->streams = pkb->tunnel_next;
+  pkb->tunnel_prev = NULL;
+  pkb->tunnel_next = NULL;
+}
+
+static struct pk_backend_conn* pkm_claim_be_conn(struct pk_manager* pkm,
+                                                 struct pk_backend_conn* pkb,
+                                                 struct pk_tunnel* fe,
+                                                 char *sid)
+{
+  if (pkb->conn.status & CONN_STATUS_ALLOCATED) {
+    pkb->conn.status &= ~CONN_STATUS_ALLOCATED;
+    pkm_be_index_remove(pkm, pkb);
+    pkm_unlink_be_conn(pkb);
+  }
+  pkc_reset_conn(&(pkb->conn), CONN_STATUS_ALLOCATED);
+  pkb->tunnel = fe;
+  strncpyz(pkb->sid, sid, BE_MAX_SID_SIZE-1);
+  pkb->sid_prefix_len = pk_format_sid_prefix(pkb->sid_prefix, pkb->sid);
+  pkm_be_index_add(pkm, pkb);
+  pkm_link_be_conn(pkb);
+  return pkb;
+}
+
+struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager* pkm,
+                                          struct pk_tunnel* fe, char *sid)
+{
+  int i, evicting;
+  time_t max_age;
+  unsigned char shift;
+  struct pk_backend_conn* pkb;
+  struct pk_backend_conn* pkb_oldest;
+
+  PK_TRACE_FUNCTION;
+
+  max_age = time(0);
+  pkb_oldest = NULL;
+  shift = pkm_sid_shift(sid);
+  pthread_mutex_lock(&(pkm->be_conn_lock));
+  while (NULL != (pkb = pkm->be_conn_free)) {
+    pkm->be_conn_free = pkb->free_next;
+    pkb->free_next = NULL;
+    if (!(pkb->conn.status & CONN_STATUS_ALLOCATED)) {
+      pkb = pkm_claim_be_conn(pkm, pkb, fe, sid);
+      pthread_mutex_unlock(&(pkm->be_conn_lock));
+      return pkb;
+    }
+  }
+
+  /* No free slots on the list, but some may have been released without
+   * pkm_free_be_conn(); failing that, look for an idle stream to evict. */
+  for (i = 0; i < pkm->be_conn_max; i++) {
+    pkb = (pkm->be_conns + ((i + shift) % pkm->be_conn_max));
+    if (!(pkb->conn.status & CONN_STATUS_ALLOCATED)) {
+      pkb = pkm_claim_be_conn(pkm, pkb, fe, sid);
+      pthread_mutex_unlock(&(pkm->be_conn_lock));
+      return pkb;
+    }
+    /* Streams on other workers' loops are not ours to evict. */
+    if ((fe != NULL) && (pkb->tunnel != NULL) &&
+        (pkb->tunnel->worker != fe->worker)) continue;
+    if (pkb->conn.activity <= max_age) {
+      max_age = pkb->conn.activity;
+      pkb_oldest = pkb;
+    }
+  }
+
+  /* If we get this far, we found no empty slots. Let's complain to the
+   * log and, if so configured, kick out the oldest idle connection. */
+  if (NULL != (pkb = pkb_oldest)) {
+    max_age = time(0) - pkb->conn.activity;
+    evicting = (pk_state.conn_eviction_idle_s &&
+               (pk_state.conn_eviction_idle_s < max_age));
 
     /* Eviction is an error, as it means we're unable to do our job and
      * may have been configured with too few connection slots. */
@@ -1126,42 +2467,66 @@ struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager* pkm,
     pk_dump_be_conn("be", pkb);
 
     if (evicting) {
+      /* The EOF goes to the tunnel the old stream belonged to, and closing
+       * it puts pkb on the free list, which we drained above. */
       pkb->conn.status |= (CONN_STATUS_CLS_WRITE|CONN_STATUS_CLS_READ);
-      pkm_update_io(fe, pkb);
-      pkc_reset_conn(&(pkb->conn), CONN_STATUS_ALLOCATED);
-      pkb->tunnel = fe;
-      strncpyz(pkb->sid, sid, BE_MAX_SID_SIZE-1);
+      if (NULL != pkb->tunnel) pkm_update_io(pkb->tunnel, pkb);
+      if (pkm->be_conn_free == pkb) {
+        pkm->be_conn_free = pkb->free_next;
+        pkb->free_next = NULL;
+      }
+      pkb = pkm_claim_be_conn(pkm, pkb, fe, sid);
+      pthread_mutex_unlock(&(pkm->be_conn_lock));
       return pkb;
     }
   }
+  pthread_mutex_unlock(&(pkm->be_conn_lock));
 
   PK_CHECK_MEMORY_CANARIES;
   return NULL;
 }
 
-static void pkm_free_be_conn(struct pk_backend_conn* pkb)
+static void pkm_free_be_conn(struct pk_manager* pkm,
+                             struct pk_backend_conn* pkb)
 {
+  ev_timer_stop((pkb->tunnel != NULL) ? pkb->tunnel->worker->loop : pkm->loop,
+                &(pkb->connect_timer));
+
+  /* Clear the status first, so a rebuild of the index won't keep pkb. */
+  pthread_mutex_lock(&(pkm->be_conn_lock));
+  if (pkb->conn.status & CONN_STATUS_ALLOCATED) {
+    pkb->conn.status = CONN_STATUS_UNKNOWN;
+    pkm_be_index_remove(pkm, pkb);
+    pkm_unlink_be_conn(pkb);
+    pkb->free_next = pkm->be_conn_free;
+    pkm->be_conn_free = pkb;
+  }
   pkb->conn.status = CONN_STATUS_UNKNOWN;
+  pthread_mutex_unlock(&(pkm->be_conn_lock));
 }
 
 static struct pk_backend_conn* pkm_find_be_conn(struct pk_manager* pkm,
                                                 struct pk_tunnel* fe, char* sid)
 {
-  int i;
-  unsigned char shift;
+  int i, probes;
   struct pk_backend_conn* pkb;
 
   PK_TRACE_FUNCTION;
 
-  shift = pkm_sid_shift(sid);
-  for (i = 0; i < pkm->be_conn_max; i++) {
-    pkb = (pkm->be_conns + ((i + shift) % pkm->be_conn_max));
-    if ((pkb->conn.status & CONN_STATUS_ALLOCATED) &&
+  pthread_mutex_lock(&(pkm->be_conn_lock));
+  i = pkm_be_hash(fe, sid) % pkm->be_conn_index_max;
+  for (probes = 0; probes < pkm->be_conn_index_max; probes++) {
+    pkb = pkm->be_conn_index[i];
+    if (pkb == NULL) break;
+    if ((pkb != PKM_BE_TOMBSTONE) &&
         (pkb->tunnel == fe) &&
         (0 == strncmp(pkb->sid, sid, BE_MAX_SID_SIZE))) {
+      pthread_mutex_unlock(&(pkm->be_conn_lock));
       return pkb;
     }
+    if (++i >= pkm->be_conn_index_max) i = 0;
   }
+  pthread_mutex_unlock(&(pkm->be_conn_lock));
   return NULL;
 }
 
@@ -1174,6 +2539,7 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
                                     const char* dynamic_dns_url, SSL_CTX* ctx)
 {
   struct pk_manager* pkm;
+  pthread_mutexattr_t be_conn_lock_attr;
   int i, malloced;
   unsigned int parse_buffer_bytes;
 
@@ -1244,6 +2610,15 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   pkm->kite_max = kites;
   pkm->buffer += sizeof(struct pk_pagekite) * kites;
 
+  /* Allocate space for the kite index (zeroed above, so empty) */
+  pkm->buffer_bytes_free -= (sizeof(struct pk_pagekite*)
+                             * PK_KITE_INDEX_SIZE(kites));
+  if (pkm->buffer_bytes_free < 0) return pk_err_null(ERR_TOOBIG_KITES);
+  pkm->kite_index = (struct pk_pagekite **) pkm->buffer;
+  pkm->kite_index_max = PK_KITE_INDEX_SIZE(kites);
+  pkm->kite_count = 0;
+  pkm->buffer += sizeof(struct pk_pagekite*) * PK_KITE_INDEX_SIZE(kites);
+
   /* Allocate space for the tunnels */
   pkm->buffer_bytes_free -= (sizeof(struct pk_tunnel) * tunnels);
   pkm->buffer_bytes_free -= (sizeof(struct pk_kite_request) * kites * tunnels);
@@ -1274,6 +2649,17 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   }
   pkm->buffer += sizeof(struct pk_backend_conn) * conns;
 
+  /* Allocate space for the stream index (zeroed above, so empty) */
+  pkm->buffer_bytes_free -= (sizeof(struct pk_backend_conn*)
+                             * PK_BE_INDEX_SIZE(conns));
+  if (pkm->buffer_bytes_free < 0) return pk_err_null(ERR_TOOBIG_BE_CONNS);
+  pkm->be_conn_index = (struct pk_backend_conn **) pkm->buffer;
+  pkm->be_conn_index_max = PK_BE_INDEX_SIZE(conns);
+  pkm->be_conn_index_used = 0;
+  pkm->be_conn_index_tombstones = 0;
+  pkm->buffer += sizeof(struct pk_backend_conn*) * PK_BE_INDEX_SIZE(conns);
+  pkm_be_free_rebuild(pkm);
+
   /* Allocate space for the blocking job queue */
   pkm->buffer_bytes_free -= sizeof(struct pk_job) * (conns+tunnels);
   if (pkm->buffer_bytes_free < 0) return pk_err_null(ERR_TOOBIG_BE_CONNS);
@@ -1295,6 +2681,9 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   /* Initialize the tunnel structs... */
   for (i = 0; i < tunnels; i++) {
     (pkm->tunnels+i)->manager = pkm;
+    pkm_move_tunnel(pkm->tunnels+i, pkm->workers);
+    (pkm->tunnels+i)->splice_pipe[0] = -1;
+    (pkm->tunnels+i)->splice_pipe[1] = -1;
     (pkm->tunnels+i)->conn.sockfd = -1;
 #ifdef HAVE_OPENSSL
     (pkm->tunnels+i)->conn.ssl = NULL;
@@ -1309,7 +2698,13 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
 
   pkm->fancy_pagekite_net_rejection = 1;
   pkm->enable_watchdog = 0;
+  pkm->coalesce_tunnel_writes = 0;
+  pkm->enable_splice = 0;
   pkm->want_spare_frontends = 0;
+  pkm->stream_quantum = PK_STREAM_QUANTUM_DEFAULT;
+  pkm->reconnect_timeout = PK_HANDSHAKE_TIMEOUT;
+  pkm->window_kb_min = CONN_WINDOW_SIZE_KB_MINIMUM;
+  pkm->window_kb_max = CONN_WINDOW_SIZE_KB_MAXIMUM;
   pkm->housekeeping_interval_min = PK_HOUSEKEEPING_INTERVAL_MIN;
   pkm->housekeeping_interval_max = PK_HOUSEKEEPING_INTERVAL_MAX;
   pkm->check_world_interval = PK_CHECK_WORLD_INTERVAL;
@@ -1328,6 +2723,10 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   pkm_reset_timer(pkm);
   pkm->enable_timer = 1;
 
+  /* Tunnels live on our own loop, until pkm_set_workers() says otherwise */
+  pkm_init_worker(pkm, pkm->workers, loop);
+  pkm->worker_count = 0;
+
   /* Let external threads shut us down */
   ev_async_init(&(pkm->quit), pkm_quit_cb);
   ev_async_start(loop, &(pkm->quit));
@@ -1344,6 +2743,16 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
 
   /* Prepare blocking thread structures. */
   pthread_mutex_init(&(pkm->loop_lock), NULL);
+  pthread_mutex_init(&(pkm->block_lock), NULL);
+  pthread_cond_init(&(pkm->block_cond), NULL);
+  pkm->blocking = 0;
+  pthread_mutex_init(&(pkm->be_addr_lock), NULL);
+  pthread_mutex_init(&(pkm->handshake_lock), NULL);
+  pthread_cond_init(&(pkm->handshake_cond), NULL);
+  pthread_mutexattr_init(&be_conn_lock_attr);
+  pthread_mutexattr_settype(&be_conn_lock_attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&(pkm->be_conn_lock), &be_conn_lock_attr);
+  pthread_mutexattr_destroy(&be_conn_lock_attr);
   pthread_mutex_init(&(pkm->blocking_jobs.mutex), NULL);
   pthread_cond_init(&(pkm->blocking_jobs.cond), NULL);
   pkm->blocking_jobs.count = 0;
@@ -1361,6 +2770,25 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
 
 void pkm_manager_free(struct pk_manager* pkm)
 {
+  int i;
+  for (i = 0; i < pkm->tunnel_max; i++) {
+    if (0 <= pkm->tunnels[i].splice_pipe[0]) {
+      close(pkm->tunnels[i].splice_pipe[0]);
+      close(pkm->tunnels[i].splice_pipe[1]);
+    }
+    if (NULL != pkm->tunnels[i].handshake_buffer)
+      free(pkm->tunnels[i].handshake_buffer);
+#ifdef HAVE_OPENSSL
+    if (NULL != pkm->tunnels[i].ssl_session)
+      SSL_SESSION_free(pkm->tunnels[i].ssl_session);
+#endif
+  }
+  for (i = 1; i <= PK_WORKERS_MAX; i++) {
+    if (pkm->workers[i].loop != NULL) {
+      ev_loop_destroy(pkm->workers[i].loop);
+      pthread_mutex_destroy(&(pkm->workers[i].loop_lock));
+    }
+  }
   if (pkm->ev_loop_malloced) {
     ev_loop_destroy(pkm->loop);
   }
@@ -1374,12 +2802,14 @@ void* pkm_run(void *void_pkm) {
 
   if (pkm->enable_watchdog) pkw_start_watchdog(pkm);
   pkb_start_blockers(pkm, 1);
+  pkm_start_workers(pkm);
 
   pthread_mutex_lock(&(pkm->loop_lock));
   ev_loop(pkm->loop, 0);
   pthread_mutex_unlock(&(pkm->loop_lock));
 
   pkb_stop_blockers(pkm);
+  pkm_stop_workers(pkm);
   if (pkm->enable_watchdog) pkw_stop_watchdog(pkm);
   pkm_reset_manager(pkm);
   pk_log(PK_LOG_MANAGER_DEBUG, "Event loop exited.");
@@ -1401,9 +2831,242 @@ int pkm_stop_thread(struct pk_manager* pkm) {
   return pthread_join(pkm->main_thread, NULL);
 }
 
-int pkmanager_test(void)
-{
 #if PK_TESTS
+/* Run the manager's loop the way pkm_run() does, minus the other threads. */
+static void* pkm_test_loop(void* void_pkm)
+{
+  struct pk_manager* pkm = (struct pk_manager*) void_pkm;
+  pthread_mutex_lock(&(pkm->loop_lock));
+  ev_loop(pkm->loop, 0);
+  pthread_mutex_unlock(&(pkm->loop_lock));
+  return void_pkm;
+}
+
+/* A connected pair of non-blocking sockets. */
+static void pkm_test_socketpair(int sv[2])
+{
+  assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  set_non_blocking(sv[0]);
+  set_non_blocking(sv[1]);
+}
+
+/* Put tunnel i on fd, with the usual callbacks (not started). */
+static struct pk_tunnel* pkm_test_tunnel(struct pk_manager* pkm, int i, int fd)
+{
+  struct pk_tunnel* fe = pkm->tunnels + i;
+  set_non_blocking(fd);
+  fe->conn.sockfd = fd;
+  ev_io_init(&(fe->conn.watch_r), pkm_tunnel_readable_cb, fd, EV_READ);
+  ev_io_init(&(fe->conn.watch_w), pkm_tunnel_writable_cb, fd, EV_WRITE);
+  fe->conn.watch_r.data = fe->conn.watch_w.data = (void *) fe;
+  return fe;
+}
+
+/* A new stream on fe, talking to its backend on fd. */
+static struct pk_backend_conn* pkm_test_stream(struct pk_manager* pkm,
+                                               struct pk_tunnel* fe,
+                                               char* sid, int fd)
+{
+  struct pk_backend_conn* pkb = pkm_alloc_be_conn(pkm, fe, sid);
+  assert(NULL != pkb);
+  set_non_blocking(fd);
+  pkb->conn.sockfd = fd;
+  ev_io_init(&(pkb->conn.watch_r), pkm_be_conn_readable_cb, fd, EV_READ);
+  ev_io_init(&(pkb->conn.watch_w), pkm_be_conn_writable_cb, fd, EV_WRITE);
+  pkb->conn.watch_r.data = pkb->conn.watch_w.data = (void *) pkb;
+  return pkb;
+}
+
+/* The same on a new socketpair; the test plays the far end, on sv[1]. */
+static struct pk_tunnel* pkm_test_tunnel_pair(struct pk_manager* pkm, int i,
+                                              int sv[2])
+{
+  pkm_test_socketpair(sv);
+  return pkm_test_tunnel(pkm, i, sv[0]);
+}
+static struct pk_backend_conn* pkm_test_stream_pair(struct pk_manager* pkm,
+                                                    struct pk_tunnel* fe,
+                                                    char* sid, int sv[2])
+{
+  pkm_test_socketpair(sv);
+  return pkm_test_stream(pkm, fe, sid, sv[0]);
+}
+
+/* Undo the above, closing the far end as well. */
+static void pkm_test_hangup(struct ev_loop* loop, struct pk_conn* pkc, int fd)
+{
+  ev_io_stop(loop, &(pkc->watch_r));
+  ev_io_stop(loop, &(pkc->watch_w));
+  pkc_reset_conn(pkc, 0);
+  close(fd);
+}
+
+/* Play frontend: run the loop until a complete request has arrived on fd,
+ * returning its length. */
+static int pkm_test_read_request(struct pk_manager* pkm, int fd,
+                                 char* buffer, int length)
+{
+  int n, rv, got = 0;
+  buffer[0] = '\0';
+  for (n = 0; (n < 1000) && !pk_handshake_length(buffer, got); n++) {
+    ev_loop(pkm->loop, EVLOOP_NONBLOCK);
+    if ((0 < wait_fd(fd, 5)) &&
+        (0 < (rv = read(fd, buffer + got, length - 1 - got)))) got += rv;
+    buffer[got] = '\0';
+  }
+  return got;
+}
+
+static int pkm_test_listen(struct sockaddr_in* sin, struct addrinfo* ai,
+                           int which)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  socklen_t len = sizeof(struct sockaddr_in);
+
+  memset(sin, 0, sizeof(struct sockaddr_in));
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK + which);
+  assert(0 == bind(fd, (struct sockaddr*) sin, len));
+  assert(0 == listen(fd, 4));
+  assert(0 == getsockname(fd, (struct sockaddr*) sin, &len));
+
+  memset(ai, 0, sizeof(struct addrinfo));
+  ai->ai_family = AF_INET;
+  ai->ai_socktype = SOCK_STREAM;
+  ai->ai_addr = (struct sockaddr*) sin;
+  ai->ai_addrlen = len;
+  return fd;
+}
+
+/* Play a frontend which wants requests signed with its own salt, counting
+ * the connections it takes for the tunnel to come up (or give up). */
+static int pkm_test_salty_frontend(struct pk_manager* pkm, int lfd,
+                                   struct pk_tunnel* fe, const char* reply)
+{
+  char buffer[4096];
+  int n, fd, conns = 0;
+
+  while ((FE_HANDSHAKE_NONE != fe->handshake) && (conns < 3)) {
+    assert(0 <= (fd = accept(lfd, NULL, NULL)));
+    conns++;
+    assert(0 < pkm_test_read_request(pkm, fd, buffer, sizeof(buffer)));
+    if (NULL != strstr(buffer, ":f00d:"))
+      strcpy(buffer, reply);
+    else
+      strcpy(buffer, "HTTP/1.1 200 OK\r\n"
+                     "X-PageKite-SignThis: http-80:hs.example:b:f00d\r\n\r\n");
+    assert((ssize_t) strlen(buffer) == write(fd, buffer, strlen(buffer)));
+    for (n = 0; (n < 1000) && (FE_HANDSHAKE_NONE != fe->handshake) &&
+                (0 >= wait_fd(lfd, 5)); n++)
+      ev_loop(pkm->loop, EVLOOP_NONBLOCK);
+    close(fd);
+  }
+  return conns;
+}
+
+#if defined(HAVE_OPENSSL) && (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+/* A server context with a throwaway self-signed certificate. */
+static SSL_CTX* pkm_test_tls_server_ctx(void)
+{
+  EVP_PKEY* pkey = NULL;
+  EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+  X509* x509 = X509_new();
+  SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+
+  assert(0 < EVP_PKEY_keygen_init(kctx));
+  assert(0 < EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx,
+                                                    NID_X9_62_prime256v1));
+  assert(0 < EVP_PKEY_keygen(kctx, &pkey));
+  ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+  X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+  X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+  X509_set_pubkey(x509, pkey);
+  X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN", MBSTRING_ASC,
+                             (unsigned char*) "hs.example", -1, -1, 0);
+  X509_set_issuer_name(x509, X509_get_subject_name(x509));
+  assert(0 < X509_sign(x509, pkey, EVP_sha256()));
+  assert(1 == SSL_CTX_use_certificate(ctx, x509));
+  assert(1 == SSL_CTX_use_PrivateKey(ctx, pkey));
+
+  X509_free(x509);
+  EVP_PKEY_free(pkey);
+  EVP_PKEY_CTX_free(kctx);
+  return ctx;
+}
+
+/* Play TLS frontend: accept the tunnel's connection, read its request
+ * and let it fly. */
+static void pkm_test_tls_frontend(struct pk_manager* pkm, int lfd,
+                                  SSL_CTX* ctx, struct pk_tunnel* fe)
+{
+  char buffer[4096];
+  int n, rv, fd, got = 0;
+  SSL* ssl = SSL_new(ctx);
+
+  assert(0 <= (fd = accept(lfd, NULL, NULL)));
+  set_non_blocking(fd);
+  SSL_set_fd(ssl, fd);
+  for (n = 0; (n < 1000) && (1 != SSL_accept(ssl)); n++) {
+    ev_loop(pkm->loop, EVLOOP_NONBLOCK);
+    wait_fd(fd, 5);
+  }
+  buffer[0] = '\0';
+  for (n = 0; (n < 1000) && !pk_handshake_length(buffer, got); n++) {
+    ev_loop(pkm->loop, EVLOOP_NONBLOCK);
+    if (0 < (rv = SSL_read(ssl, buffer + got, sizeof(buffer) - 1 - got)))
+      got += rv;
+    else
+      wait_fd(fd, 5);
+    buffer[got] = '\0';
+  }
+  assert(0 == strncmp(buffer, PK_HANDSHAKE_CONNECT, 15));
+
+  strcpy(buffer, "HTTP/1.1 200 OK\r\n\r\n");
+  assert((int) strlen(buffer) == SSL_write(ssl, buffer, strlen(buffer)));
+  for (n = 0; (n < 1000) && (FE_HANDSHAKE_NONE != fe->handshake); n++)
+    ev_loop(pkm->loop, EVLOOP_ONESHOT);
+  assert(FE_HANDSHAKE_NONE == fe->handshake);
+
+  SSL_free(ssl);
+  close(fd);
+}
+
+/* Connect pkc to a local TLS server over loopback TCP, returning the
+ * server's end once both handshakes are done. */
+static SSL* pkm_test_tls_conn(SSL_CTX* client_ctx, SSL_CTX* server_ctx,
+                              struct pk_conn* pkc)
+{
+  struct sockaddr_in sin;
+  struct addrinfo ai;
+  char c;
+  int n, done, fd, lfd = pkm_test_listen(&sin, &ai, 0);
+  SSL* ssl = SSL_new(server_ctx);
+
+  memset(pkc, 0, sizeof(struct pk_conn));
+  pkc->sockfd = -1;
+  pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
+  assert(0 <= (pkc->sockfd = socket(AF_INET, SOCK_STREAM, 0)));
+  assert(0 == connect(pkc->sockfd, ai.ai_addr, ai.ai_addrlen));
+  assert(0 <= (fd = accept(lfd, NULL, NULL)));
+  close(lfd);
+  set_non_blocking(pkc->sockfd);
+  set_non_blocking(fd);
+  SSL_set_fd(ssl, fd);
+
+  pkc_start_ssl(pkc, client_ctx);
+  for (n = 0; n < 1000; n++) {
+    done = (1 == SSL_accept(ssl));
+    if (pkc->state != CONN_SSL_DATA) pkc_read_into(pkc, &c, 0);
+    else if (done) break;
+    wait_fd(fd, 1);
+  }
+  assert(CONN_SSL_DATA == pkc->state);
+  return ssl;
+}
+#endif
+
+static int pkmanager_test_basics(void)
+{
   void *N = NULL;
   char buffer[PK_MANAGER_MINSIZE];
   struct pk_manager* m;
@@ -1466,6 +3129,7 @@ int pkmanager_test(void)
   assert(ERR_NO_MORE_KITES == pk_error);
   assert(NULL != pkm_find_kite(m, "http", "foo", 80));
   assert(NULL == pkm_find_kite(m, "http", "bar", 80));
+  assert(m->kites == pkm_find_kite(m, "HTTP", "Foo", 80));
 
   /* Test pk_*_be_conn */
   assert(NULL == pkm_find_be_conn(m, NULL, "abc"));
@@ -1476,13 +3140,1596 @@ int pkmanager_test(void)
   assert(0 == strcmp(c->sid, "abc"));
   assert(0 == c->conn.read_kb);
   assert(0 == c->conn.read_bytes);
-  assert(CONN_IO_BUFFER_SIZE == PKC_IN_FREE(c->conn));
-  assert(CONN_IO_BUFFER_SIZE == PKC_OUT_FREE(c->conn));
-  pkm_free_be_conn(c);
+  assert(NULL == c->conn.in_buffer);
+  assert(NULL == c->conn.out_buffers);
+  assert(pkc_buffer_max() == PKC_OUT_FREE(c->conn));
+  pkm_free_be_conn(m, c);
   assert(NULL == pkm_find_be_conn(m, NULL, "abc"));
+  assert(c == pkm_alloc_be_conn(m, NULL, "abcg"));
 
   /* Cleanup */
   pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_stream_index(void)
+{
+  struct pk_manager* m;
+  struct pk_backend_conn* c;
+  char sid[BE_MAX_SID_SIZE];
+  int i;
+
+  /* Test the stream index with many streams spread over two tunnels */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, 1000, NULL, NULL);
+  assert(NULL != m);
+  for (i = 0; i < 1000; i++) {
+    sprintf(sid, "%x", i / 2);
+    assert(NULL != pkm_alloc_be_conn(m, m->tunnels + (i % 2), sid));
+  }
+  assert(NULL == pkm_alloc_be_conn(m, m->tunnels, "full"));
+  for (i = 0; i < 1000; i++) {
+    sprintf(sid, "%x", i / 2);
+    assert(NULL != (c = pkm_find_be_conn(m, m->tunnels + (i % 2), sid)));
+    assert(c->tunnel == m->tunnels + (i % 2));
+    if (i % 3) pkm_free_be_conn(m, c);
+  }
+  assert(m->be_conn_index_tombstones <= m->be_conn_index_max / 4);
+  for (i = 0; i < 1000; i++) {
+    sprintf(sid, "%x", i / 2);
+    c = pkm_find_be_conn(m, m->tunnels + (i % 2), sid);
+    assert((i % 3) ? (NULL == c) : (NULL != c));
+  }
+
+  /* Each tunnel's stream list should hold exactly its surviving streams */
+  for (i = 0; i < 2; i++) {
+    int count = 0;
+    struct pk_backend_conn* prev = NULL;
+    for (c = m->tunnels[i].streams; c != NULL; c = c->tunnel_next) {
+      assert(c->tunnel == m->tunnels + i);
+      assert(c->tunnel_prev == prev);
+      assert(0 == (((int) strtol(c->sid, NULL, 16) * 2 + i) % 3));
+      prev = c;
+      count++;
+    }
+    assert(count == 167);
+  }
+
+  /* Freed slots are handed out again straight from the free list */
+  for (i = 0; i < 666; i++) {
+    assert(NULL != (c = m->be_conn_free));
+    sprintf(sid, "n%x", i);
+    assert(c == pkm_alloc_be_conn(m, m->tunnels, sid));
+  }
+  assert(NULL == m->be_conn_free);
+  assert(NULL == pkm_alloc_be_conn(m, m->tunnels, "full"));
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_eviction(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe[2];
+  struct pk_backend_conn* b[2];
+  struct pk_backend_conn* c;
+  int tsv[2][2], bsv[2][2];
+  char data[4000];
+  char sid[BE_MAX_SID_SIZE];
+  ssize_t bytes;
+  int i;
+  time_t idle_s = pk_state.conn_eviction_idle_s;
+
+  /* With every slot taken, the idlest stream is closed (EOF to its own
+   * tunnel) and its slot handed out, without leaving it on the free list. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, MIN_CONN_ALLOC, NULL, NULL);
+  assert(NULL != m);
+  fe[0] = pkm_test_tunnel_pair(m, 0, tsv[0]);
+  fe[1] = pkm_test_tunnel_pair(m, 1, tsv[1]);
+  b[0] = pkm_test_stream_pair(m, fe[0], "idle", bsv[0]);
+  b[1] = pkm_test_stream_pair(m, fe[1], "busy", bsv[1]);
+  for (i = 2; i < MIN_CONN_ALLOC; i++) {
+    sprintf(sid, "%x", i);
+    assert(NULL != pkm_alloc_be_conn(m, fe[1], sid));
+  }
+  b[0]->conn.activity -= 100;
+  pk_state.conn_eviction_idle_s = 10;
+
+  assert(b[0] == (c = pkm_alloc_be_conn(m, fe[1], "new")));
+  assert(NULL == m->be_conn_free);
+  assert(c->tunnel == fe[1]);
+  assert(c->conn.status & CONN_STATUS_ALLOCATED);
+  assert(c == pkm_find_be_conn(m, fe[1], "new"));
+  assert(NULL == pkm_find_be_conn(m, fe[0], "idle"));
+  assert(NULL == fe[0]->streams);
+  assert(0 == read(bsv[0][1], data, sizeof(data)));
+
+  pkc_flush(&(fe[0]->conn), NULL, 0, NON_BLOCKING_FLUSH, "test");
+  assert(0 < (bytes = read(tsv[0][1], data, sizeof(data) - 1)));
+  data[bytes] = '\0';
+  assert(NULL != strstr(data, "SID: idle\r\nEOF: "));
+  assert(0 > read(tsv[1][1], data, sizeof(data)));
+
+  /* The slot goes back on the free list exactly once. */
+  pkm_free_be_conn(m, c);
+  assert((c == m->be_conn_free) && (NULL == c->free_next));
+  assert(c == pkm_alloc_be_conn(m, fe[1], "again"));
+  assert(NULL == m->be_conn_free);
+
+  pk_state.conn_eviction_idle_s = idle_s;
+  pkm_test_hangup(m->loop, &(b[1]->conn), bsv[1][1]);
+  close(bsv[0][1]);
+  pkm_test_hangup(m->loop, &(fe[0]->conn), tsv[0][1]);
+  pkm_test_hangup(m->loop, &(fe[1]->conn), tsv[1][1]);
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_stream_buffers(void)
+{
+  struct pk_manager* m;
+  struct pk_backend_conn* c;
+  int tsv[2], got, filled, n;
+  char data[4000];
+  char sid[BE_MAX_SID_SIZE];
+  int i;
+
+  /* Streams hold no buffers until they have something to send, and give
+   * the pool's blocks back once it has been sent. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, 100, NULL, NULL);
+  assert(NULL != m);
+  pkm_test_socketpair(tsv);
+  memset(data, 'm', sizeof(data));
+  while (0 < write(tsv[0], data, sizeof(data)));
+  pkc_buffer_stats(&got, NULL);
+  for (i = 0; i < 100; i++) {
+    sprintf(sid, "%x", i);
+    assert(NULL != (c = pkm_alloc_be_conn(m, m->tunnels, sid)));
+    c->conn.sockfd = tsv[0];
+  }
+  pkc_buffer_stats(&n, NULL);
+  assert(got == n);
+  for (i = 0; i < 100; i++)
+    assert(100 == pkc_write(&(m->be_conns[i].conn), data, 100));
+  pkc_buffer_stats(&n, NULL);
+  assert(got + 100 <= n);
+  for (filled = 1; filled; ) {
+    while (0 < read(tsv[1], data, sizeof(data)));
+    for (filled = i = 0; i < 100; i++) {
+      c = m->be_conns + i;
+      if (0 < c->conn.out_buffer_pos)
+        pkc_flush(&(c->conn), NULL, 0, NON_BLOCKING_FLUSH, "test");
+      filled += (0 < c->conn.out_buffer_pos);
+    }
+  }
+  pkc_buffer_stats(&n, NULL);
+  assert(got == n);
+  for (i = 0; i < 100; i++) m->be_conns[i].conn.sockfd = -1;
+  close(tsv[0]);
+  close(tsv[1]);
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_kite_index(void)
+{
+  struct pk_manager* m;
+  char domain[64];
+  int i;
+
+  /* Test the kite index with many kites, wildcards and port precedence */
+  m = pkm_manager_init(NULL, 0, NULL, 1000, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  for (i = 0; i < 995; i++) {
+    sprintf(domain, "k%d.example.com", i);
+    assert(NULL != pkm_add_kite(m, "http", domain, 80, "sec", "localhost", 80));
+  }
+  assert(NULL != pkm_add_kite(m, "http", "w.example.com", 0, "s", "lh", 1));
+  assert(NULL != pkm_add_kite(m, "http", "w.example.com", -1, "s", "lh", 2));
+  assert(NULL != pkm_add_kite(m, "http", "w.example.com", 81, "s", "lh", 3));
+  assert(NULL != pkm_add_kite(m, "http", "w.example.com", 81, "s", "lh", 4));
+  assert(NULL != pkm_add_kite(m, "raw-22", "w.example.com", 0, "s", "lh", 5));
+  assert(NULL == pkm_add_kite(m, "http", "x", 80, "sec", "localhost", 80));
+  for (i = 0; i < 995; i++) {
+    sprintf(domain, "K%d.Example.COM", i);
+    assert(m->kites + i == pkm_find_kite(m, "http", domain, 80));
+    assert(NULL == pkm_find_kite(m, "https", domain, 80));
+    assert(NULL == pkm_find_kite(m, "http", domain, 8080));
+  }
+  assert(2 == pkm_find_kite(m, "http", "w.example.com", 80)->local_port);
+  assert(2 == pkm_find_kite(m, "http", "w.example.com", 0)->local_port);
+  assert(3 == pkm_find_kite(m, "http", "w.example.com", 81)->local_port);
+  assert(5 == pkm_find_kite(m, "raw", "w.example.com", 22)->local_port);
+  assert(NULL == pkm_find_kite(m, "raw", "w.example.com", 23));
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_backend_addrs(void)
+{
+  struct pk_manager* m;
+  struct pk_pagekite* k;
+  struct pk_job j;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+
+  /* Test the backend address cache: the loop never resolves names, it
+   * queues a single refresh job and serves stale entries meanwhile. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  k = pkm_add_kite(m, "http", "foo", 80, "s", "127.0.0.1", 8080);
+  assert(NULL != k);
+  assert(0 == k->local_addrs_expire);
+  assert(-1 == pkm_backend_addr(m, k, &addr, &addr_len));
+  assert(-1 == pkm_backend_addr(m, k, &addr, &addr_len));
+  assert(1 == m->blocking_jobs.count);
+  assert(0 == k->local_addrs_expire);
+  assert(0 < pkb_get_job(&(m->blocking_jobs), &j));
+  assert(PK_RESOLVE_BACKENDS == j.job);
+  assert(0 == pkm_resolve_backends(m));
+  assert(0 == pkm_backend_addr(m, k, &addr, &addr_len));
+  assert(AF_INET == addr.ss_family);
+  assert(sizeof(struct sockaddr_in) == addr_len);
+  assert(htons(8080) == ((struct sockaddr_in*) &addr)->sin_port);
+  assert(1 == k->local_addr_count);
+  assert(time(0) < k->local_addrs_expire);
+  assert(0 == m->blocking_jobs.count);
+  k->local_addrs_expire = 1;
+  assert(0 == pkm_backend_addr(m, k, &addr, &addr_len));
+  assert(0 == pkm_backend_addr(m, k, &addr, &addr_len));
+  assert(1 == m->blocking_jobs.count);
+  assert(0 == pkm_resolve_backends(m));
+  assert(0 == m->be_resolve_pending);
+  assert(time(0) < k->local_addrs_expire);
+  pkm_skip_backend_addr(m, k);
+  assert(0 == k->local_addr_next);
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_backpressure(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  struct pk_backend_conn* b[2];
+  struct pk_chunk chunk;
+  int tsv[2], bsv[2][2], got;
+  ssize_t bytes;
+  char data[4000];
+  int i;
+
+  /* Backpressure: a slow backend must neither stall the loop nor the other
+   * streams, and a backed up tunnel throttles (only) its own streams. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  fe = pkm_test_tunnel_pair(m, 0, tsv);
+  for (i = 0; i < 2; i++)
+    b[i] = pkm_test_stream_pair(m, fe, i ? "fast" : "slow", bsv[i]);
+  memset(&chunk, 0, sizeof(chunk));
+  memset(data, 'x', sizeof(data));
+  chunk.data = data;
+  chunk.length = sizeof(data);
+  for (got = i = 0; i < 256; i++) {
+    chunk.sid = "slow";
+    pkm_chunk_cb(fe, &chunk);
+    chunk.sid = "fast";
+    pkm_chunk_cb(fe, &chunk);
+    while (0 < (bytes = read(bsv[1][1], data, sizeof(data)))) got += bytes;
+    while (0 < read(tsv[1], data, sizeof(data)));
+    pkc_flush(&(b[1]->conn), NULL, 0, NON_BLOCKING_FLUSH, "test");
+  }
+  while (0 < (bytes = read(bsv[1][1], data, sizeof(data)))) got += bytes;
+  assert(got == 256 * (int) sizeof(data));
+  assert(0 == b[1]->conn.out_buffer_pos);
+  assert(0 < b[0]->conn.out_buffer_pos);
+  assert(!(b[0]->conn.status & CONN_STATUS_CLS_WRITE));
+  assert(!(b[1]->conn.status & CONN_STATUS_BLOCKED));
+
+  pkm_queue_stream(b[0]);
+  memset(data, 'y', sizeof(data));
+  while (!PKC_OUT_BLOCKED(fe->conn)) pkc_write(&(fe->conn), data, sizeof(data));
+  pkm_update_io(fe, NULL);
+  for (i = 0; i < 2; i++) {
+    assert(b[i]->conn.status & CONN_STATUS_TNL_BLOCKED);
+    assert(!ev_is_active(&(b[i]->conn.watch_r)));
+    assert(!pkm_stream_queued(b[i]));
+  }
+  while (0 < fe->conn.out_buffer_pos) {
+    while (0 < read(tsv[1], data, sizeof(data)));
+    pkc_flush(&(fe->conn), NULL, 0, NON_BLOCKING_FLUSH, "test");
+  }
+  pkm_update_io(fe, NULL);
+  for (i = 0; i < 2; i++) {
+    assert(!(b[i]->conn.status & CONN_STATUS_TNL_BLOCKED));
+    assert(ev_is_active(&(b[i]->conn.watch_r)));
+  }
+
+  for (i = 0; i < 2; i++)
+    pkm_test_hangup(m->loop, &(b[i]->conn), bsv[i][1]);
+  pkm_test_hangup(m->loop, &(fe->conn), tsv[1]);
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_tunnel_reads(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  int tsv[2], got;
+  ssize_t bytes;
+  char data[4000];
+  int i;
+
+  /* Tunnel reads drain many frames per wakeup, but no more than the
+   * configured budget. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  fe = pkm_test_tunnel_pair(m, 0, tsv);
+  memset(data, 'z', sizeof(data));
+  bytes = pk_format_frame(data, "", "NOOP: 1%s\r\n\r\n", 2000);
+  for (got = i = 0; i < 32; i++) {
+    assert(bytes + 2000 == write(tsv[1], data, bytes + 2000));
+    got += bytes + 2000;
+  }
+  pk_state.tunnel_read_budget = 16 * 1024;
+  pkm_tunnel_readable_cb(m->loop, &(fe->conn.watch_r), EV_READ);
+  assert(1 == fe->conn.read_events);
+  assert(1 < fe->conn.read_calls);
+  bytes = fe->conn.read_kb * 1024 + fe->conn.read_bytes;
+  assert(16 * 1024 <= bytes);
+  assert(bytes < 16 * 1024 + PARSER_BYTES_MAX);
+  for (i = 0; (i < 10) && (bytes < got); i++) {
+    pkm_tunnel_readable_cb(m->loop, &(fe->conn.watch_r), EV_READ);
+    bytes = fe->conn.read_kb * 1024 + fe->conn.read_bytes;
+  }
+  assert(bytes == got);
+  assert(fe->conn.read_events < 6);
+  assert(!(fe->conn.status & CONN_STATUS_BROKEN));
+  pk_state.tunnel_read_budget = 0;
+  pkm_test_hangup(m->loop, &(fe->conn), tsv[1]);
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_coalescing(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  int tsv[2], got;
+  ssize_t bytes;
+  char data[4000];
+  int i;
+
+  /* Coalescing: tunnel output collected during a loop iteration leaves in
+   * one write, just before the loop blocks. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  fe = pkm_test_tunnel_pair(m, 0, tsv);
+  m->coalesce_tunnel_writes = 1;
+  pkm_flush_tunnels_cb(m->loop, &(m->workers[0].flush_tunnels), EV_PREPARE);
+  assert(fe->conn.status & CONN_STATUS_CORKED);
+  for (got = i = 0; i < 50; i++) {
+    bytes = pk_format_skb(data, "abc", i);
+    assert(bytes == pkc_write(&(fe->conn), data, bytes));
+    got += bytes;
+  }
+  pkm_update_io(fe, NULL);
+  assert(0 == fe->conn.write_calls);
+  assert(!ev_is_active(&(fe->conn.watch_w)));
+  pkm_flush_tunnels_cb(m->loop, &(m->workers[0].flush_tunnels), EV_PREPARE);
+  assert(1 == fe->conn.write_calls);
+  assert(got == (int) fe->conn.write_call_bytes);
+  assert(0 == fe->conn.out_buffer_pos);
+  assert(got == read(tsv[1], data, sizeof(data)));
+  m->coalesce_tunnel_writes = 0;
+  pkm_flush_tunnels_cb(m->loop, &(m->workers[0].flush_tunnels), EV_PREPARE);
+  assert(!(fe->conn.status & CONN_STATUS_CORKED));
+  pkm_test_hangup(m->loop, &(fe->conn), tsv[1]);
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_scheduling(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  struct pk_backend_conn* s[5];
+  int tsv[2], ssv[5][2], got;
+  char* out;
+  ssize_t bytes;
+  char data[4000];
+  char sid[BE_MAX_SID_SIZE];
+  char domain[64];
+  int i;
+
+  /* Fair scheduling: streams take turns, so small responses queued behind
+   * a bulk transfer go out within a turn or two. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  fe = pkm_test_tunnel_pair(m, 0, tsv);
+  for (i = 0; i < 5; i++) {
+    sprintf(sid, "s%d", i);
+    s[i] = pkm_test_stream_pair(m, fe, sid, ssv[i]);
+  }
+  memset(data, 'b', sizeof(data));
+  for (got = i = 0; i < 16; i++) {
+    assert(sizeof(data) == write(ssv[0][1], data, sizeof(data)));
+    got += sizeof(data);
+  }
+  for (i = 1; i < 5; i++) {
+    assert(100 == write(ssv[i][1], data, 100));
+    got += 100;
+  }
+  for (i = 0; i < 5; i++)
+    pkm_be_conn_readable_cb(m->loop, &(s[i]->conn.watch_r), EV_READ);
+  assert(s[0] == fe->ready_head);
+  assert(s[4] == fe->ready_tail);
+  pkm_unqueue_stream(s[2]);
+  assert((s[3] == s[1]->ready_next) && (s[1] == s[3]->ready_prev));
+  assert(!pkm_stream_queued(s[2]));
+  pkm_queue_stream(s[2]);
+  assert((s[2] == fe->ready_tail) && (s[4] == s[2]->ready_prev));
+  assert(!ev_is_active(&(s[0]->conn.watch_r)));
+  pkm_flush_tunnels_cb(m->loop, &(m->workers[0].flush_tunnels), EV_PREPARE);
+  assert(NULL == fe->ready_head);
+  assert(NULL == fe->ready_tail);
+  for (i = 0; i < 5; i++) assert(ev_is_active(&(s[i]->conn.watch_r)));
+
+  assert(NULL != (out = malloc(2 * got)));
+  for (bytes = 0; 0 < (i = read(tsv[1], out + bytes, 2 * got - bytes - 1)); )
+    bytes += i;
+  out[bytes] = '\0';
+  assert(bytes > got);
+  for (i = 1; i < 5; i++) {
+    sprintf(domain, "SID: s%d\r\n", i);
+    assert(NULL != strstr(out, domain));
+    assert(strstr(out, domain) - out < 2 * PK_STREAM_QUANTUM_DEFAULT);
+  }
+  free(out);
+
+  for (i = 0; i < 5; i++)
+    pkm_test_hangup(m->loop, &(s[i]->conn), ssv[i][1]);
+  pkm_test_hangup(m->loop, &(fe->conn), tsv[1]);
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_splice(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  struct pk_backend_conn* s[5];
+  int tsv[2], ssv[5][2], got, filled, spliced, big, chunks, phase, n;
+  char* out;
+  char* o;
+  ssize_t bytes;
+  char data[4000];
+  int i;
+
+  /* Splicing: large chunks go from backend to tunnel without copies, and
+   * arrive intact and in order, even if the tunnel socket is full. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  m->enable_splice = 1;
+  m->stream_quantum = 16 * 1024;
+  fe = pkm_test_tunnel_pair(m, 0, tsv);
+  s[0] = pkm_test_stream_pair(m, fe, "sp", ssv[0]);
+  assert(NULL != (out = malloc(4 * 1024 * 1024)));
+  for (got = spliced = big = phase = 0; phase < 2; phase++) {
+    /* The second time around, the tunnel starts out backed up. */
+    memset(data, 'f', sizeof(data));
+    for (filled = 0; (phase == 1) && (0 < (bytes = write(tsv[0], data, 100)));)
+      filled += bytes;
+    for (i = 0; i < 16; i++) {
+      for (n = 0; n < (int) sizeof(data); n++)
+        data[n] = (char) ((got + n) % 251);
+      assert(sizeof(data) == write(ssv[0][1], data, sizeof(data)));
+      got += sizeof(data);
+    }
+    for (bytes = i = 0; i < 100; i++) {
+      pkm_be_conn_readable_cb(m->loop, &(s[0]->conn.watch_r), EV_READ);
+      pkm_flush_tunnels_cb(m->loop, &(m->workers[0].flush_tunnels),
+                           EV_PREPARE);
+      pkc_flush(&(fe->conn), NULL, 0, NON_BLOCKING_FLUSH, "test");
+      while (0 < (n = read(tsv[1], out + bytes, 4 * 1024 * 1024 - bytes)))
+        bytes += n;
+    }
+    for (n = 0; n < filled; n++) assert('f' == out[n]);
+    for (o = out + filled, chunks = 0; o < out + bytes; o += chunks) {
+      chunks = strtol(o, &o, 16);
+      assert(0 == strncmp(o, "\r\nSID: sp\r\n\r\n", 13));
+      o += 13;
+      chunks -= 11;
+      if (chunks > CONN_IO_BUFFER_SIZE) big++;
+      for (n = 0; n < chunks; n++, spliced++)
+        assert(o[n] == (char) (spliced % 251));
+    }
+  }
+  assert(spliced == got);
+  assert(0 < big);
+  free(out);
+  pkm_test_hangup(m->loop, &(s[0]->conn), ssv[0][1]);
+  pkm_test_hangup(m->loop, &(fe->conn), tsv[1]);
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_reports(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  struct pk_backend_conn* s[5];
+  int tsv[2], got;
+  char* out;
+  ssize_t bytes;
+  char data[4000];
+  char sid[BE_MAX_SID_SIZE];
+  int i;
+
+  /* Progress reports for many streams leave in a single write, and
+   * streams which just reported wait a little before reporting again. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  fe = pkm_test_tunnel_pair(m, 0, tsv);
+  for (i = 0; i < 5; i++) {
+    sprintf(sid, "s%d", i);
+    assert(NULL != (s[i] = pkm_alloc_be_conn(m, fe, sid)));
+    s[i]->conn.wrote_bytes = 20 * 1024;
+  }
+  fe->reports_pending = 1;
+  pkm_flush_tunnels_cb(m->loop, &(m->workers[0].flush_tunnels), EV_PREPARE);
+  assert(0 == fe->reports_pending);
+  assert(1 == fe->conn.write_calls);
+  assert(fe->conn.control_bytes == fe->conn.write_call_bytes);
+  assert(0 < (bytes = read(tsv[1], data, sizeof(data) - 1)));
+  data[bytes] = '\0';
+  for (got = 0, out = data; NULL != (out = strstr(out, "SKB: 20\r\n")); out++)
+    got++;
+  assert(5 == got);
+
+  for (i = 0; i < 5; i++) s[i]->conn.wrote_bytes = 20 * 1024;
+  s[0]->conn.wrote_bytes = (CONN_REPORT_URGENT + 1) * 1024;
+  fe->reports_pending = 1;
+  pkm_flush_tunnels_cb(m->loop, &(m->workers[0].flush_tunnels), EV_PREPARE);
+  assert(2 == fe->conn.write_calls);
+  assert(1 == fe->reports_pending);
+  assert(ev_is_active(&(m->workers[0].report_timer)));
+  for (i = 0; i < 5; i++) s[i]->conn.reported_stamp -= 1;
+  pkm_flush_tunnels_cb(m->loop, &(m->workers[0].flush_tunnels), EV_PREPARE);
+  assert(3 == fe->conn.write_calls);
+  assert(0 == fe->reports_pending);
+  assert(40 == s[4]->conn.reported_kb);
+
+  ev_timer_stop(m->loop, &(m->workers[0].report_timer));
+  pkm_test_hangup(m->loop, &(fe->conn), tsv[1]);
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_pick_worker(void)
+{
+  struct pk_manager* m;
+  int i;
+
+  /* Connecting tunnels go to the least busy worker, unless they still
+   * have streams to take care of. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, 4, -1, NULL, NULL);
+  assert(NULL != m);
+  assert(2 == pkm_set_workers(m, 2));
+  assert(m->tunnels[2].worker == m->workers + 1);
+  assert(m->workers + 1 == pkm_pick_worker(m, m->tunnels + 2));
+  m->tunnels[0].conn.sockfd = 100;
+  assert(m->workers + 2 == pkm_pick_worker(m, m->tunnels + 2));
+  m->tunnels[1].conn.sockfd = 101;
+  m->tunnels[3].conn.sockfd = 103;
+  assert(m->workers + 1 == pkm_pick_worker(m, m->tunnels + 2));
+  assert(NULL != pkm_alloc_be_conn(m, m->tunnels + 2, "busy"));
+  pkm_move_tunnel(m->tunnels + 2, m->workers + 2);
+  assert(m->workers + 2 == pkm_pick_worker(m, m->tunnels + 2));
+  for (i = 1; i <= 2; i++) {
+    int count = 0;
+    struct pk_tunnel* fe;
+    for (fe = m->workers[i].tunnels; fe != NULL; fe = fe->worker_next) {
+      assert(fe->worker == m->workers + i);
+      count++;
+    }
+    assert(count == ((i == 1) ? 1 : 3));
+  }
+  assert(NULL == m->workers[0].tunnels);
+  for (i = 0; i < 4; i++) m->tunnels[i].conn.sockfd = -1;
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_workers(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  struct pk_backend_conn* b[2];
+  int bsv[2][2], ssv[5][2], got;
+  ssize_t bytes;
+  char data[4000];
+  char sid[BE_MAX_SID_SIZE];
+  int i;
+
+  /* Workers: tunnels are spread over loops running on threads of their
+   * own, and their streams follow them there. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  assert(2 == pkm_set_workers(m, 2));
+  assert(m->tunnels[0].worker == m->workers + 1);
+  assert(m->tunnels[1].worker == m->workers + 2);
+  assert(m->workers[1].loop != m->workers[2].loop);
+  assert(2 == pkm_start_workers(m));
+  assert(-1 == pkm_set_workers(m, 1));
+  for (i = 0; i < 2; i++) {
+    pkm_lock_worker(m->tunnels[i].worker);
+    fe = pkm_test_tunnel_pair(m, i, bsv[i]);
+    ev_io_start(fe->worker->loop, &(fe->conn.watch_r));
+    sprintf(sid, "w%d", i);
+    b[i] = pkm_test_stream_pair(m, fe, sid, ssv[i]);
+    ev_io_start(fe->worker->loop, &(b[i]->conn.watch_r));
+    pkm_unlock_worker(fe->worker);
+  }
+  memset(data, 'w', sizeof(data));
+  for (i = 0; i < 2; i++) {
+    sprintf(sid, "w%d", i);
+    bytes = pk_format_frame(data, sid, "SID: %s\r\n\r\n", 1000);
+    assert(bytes + 1000 == write(bsv[i][1], data, bytes + 1000));
+  }
+  for (i = 0; i < 2; i++) {
+    for (got = 0; (got < 1000) && (0 < wait_fd(ssv[i][1], 5000)); got += bytes)
+      if (0 >= (bytes = read(ssv[i][1], data, sizeof(data)))) break;
+    assert(1000 == got);
+    assert(1000 == write(ssv[i][1], data, 1000));
+  }
+  for (i = 0; i < 2; i++) {
+    for (got = 0; (got < 1000) && (0 < wait_fd(bsv[i][1], 5000)); got += bytes)
+      if (0 >= (bytes = read(bsv[i][1], data, sizeof(data)))) break;
+    assert(1000 <= got);
+  }
+  pkm_stop_workers(m);
+  for (i = 0; i < 2; i++) {
+    fe = m->tunnels + i;
+    pkm_test_hangup(fe->worker->loop, &(b[i]->conn), ssv[i][1]);
+    pkm_test_hangup(fe->worker->loop, &(fe->conn), bsv[i][1]);
+  }
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_handshakes(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  int got, filled, spliced, n;
+  int lsv[2], asv[2];
+  struct sockaddr_in fsin[2];
+  struct addrinfo fai[2];
+  char* out;
+  ssize_t bytes;
+  char data[4000];
+  int i;
+
+  /* Handshakes are driven by the event loop, so several frontends can be
+   * connecting at once.  A frontend which wants our requests signed with
+   * its own salt gets them on a new connection, and traffic following the
+   * response goes straight to the tunnel's parser. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  assert(NULL != pkm_add_kite(m, "http", "hs.example", 80, "sec",
+                              "localhost", 80));
+  got = pk_state.live_tunnels;
+  for (i = 0; i < 2; i++) {
+    lsv[i] = pkm_test_listen(fsin + i, fai + i, i);
+    assert(NULL != (fe = pkm_add_frontend_ai(m, fai + i, "hs", 0,
+                                             FE_STATUS_WANTED)));
+    fe->request_count = m->kite_max;
+    for (n = 0; n < m->kite_max; n++) fe->requests[n].kite = m->kites + n;
+    pkm_queue_handshake(fe, ev_time() + PK_HANDSHAKE_TIMEOUT);
+    assert(FE_HANDSHAKE_QUEUED == fe->handshake);
+  }
+  ev_loop(m->loop, EVLOOP_NONBLOCK);
+  for (i = 0; i < 2; i++)
+    assert(FE_HANDSHAKE_SENDING == m->tunnels[i].handshake);
+  for (i = 0; i < 2; i++) {
+    assert(0 <= (asv[i] = accept(lsv[i], NULL, NULL)));
+    assert(0 < pkm_test_read_request(m, asv[i], data, sizeof(data)));
+    assert(0 == strncmp(data, PK_HANDSHAKE_CONNECT, 15));
+    assert(NULL != strstr(data, "X-PageKite: http-80:hs.example:"));
+  }
+  assert(FE_HANDSHAKE_READING == m->tunnels[0].handshake);
+  assert(FE_HANDSHAKE_READING == m->tunnels[1].handshake);
+  assert(2 == m->handshakes_pending);
+
+  fe = m->tunnels;
+  strcpy(data, "HTTP/1.1 200 OK\r\n"
+               "X-PageKite-SignThis: http-80:hs.example:b:f00d\r\n\r\n");
+  assert((ssize_t) strlen(data) == write(asv[0], data, strlen(data)));
+  for (n = 0; (n < 1000) && (0 >= wait_fd(lsv[0], 5)); n++)
+    ev_loop(m->loop, EVLOOP_NONBLOCK);
+  close(asv[0]);
+  assert(0 <= (asv[0] = accept(lsv[0], NULL, NULL)));
+  assert(0 < pkm_test_read_request(m, asv[0], data, sizeof(data)));
+  assert(NULL != strstr(data, ":hs.example:"));
+  assert(NULL != strstr(data, ":f00d:"));
+  assert(1 == fe->handshake_rounds);
+
+  strcpy(data, "HTTP/1.1 200 OK\r\nX-PageKite-SessionID: hs0\r\n\r\n");
+  bytes = strlen(data);
+  bytes += pk_format_ping(data + bytes);
+  assert(bytes == write(asv[0], data, bytes));
+  for (n = 0; (n < 1000) && (FE_HANDSHAKE_NONE != fe->handshake); n++)
+    ev_loop(m->loop, EVLOOP_ONESHOT);
+  assert(0 <= fe->conn.sockfd);
+  assert(fe->conn.watch_r.cb == pkm_tunnel_readable_cb);
+  assert(PK_KITE_FLYING == fe->requests[0].status);
+  assert(0 == strcmp(fe->fe_session, "hs0"));
+  assert(NULL == fe->handshake_buffer);
+  assert(got + 1 == (int) pk_state.live_tunnels);
+  assert(0 < fe->connect_latency);
+  filled = pk_format_pong(out = data + 2000);
+  for (bytes = n = 0; (n < 1000) && (bytes < filled); n++) {
+    ev_loop(m->loop, EVLOOP_NONBLOCK);
+    if ((0 < wait_fd(asv[0], 5)) &&
+        (0 < (spliced = read(asv[0], data + bytes, filled - bytes))))
+      bytes += spliced;
+  }
+  assert(0 == memcmp(data, out, filled));
+
+  fe = m->tunnels + 1;
+  strcpy(data, "HTTP/1.1 200 OK\r\nX-PageKite-Duplicate: hs.example\r\n\r\n");
+  assert((ssize_t) strlen(data) == write(asv[1], data, strlen(data)));
+  for (n = 0; (n < 1000) && (FE_HANDSHAKE_NONE != fe->handshake); n++)
+    ev_loop(m->loop, EVLOOP_ONESHOT);
+  assert(0 > fe->conn.sockfd);
+  assert(fe->conn.status & FE_STATUS_LAME);
+  assert(0 == fe->request_count);
+  assert(0 == m->handshakes_pending);
+  assert(1 == m->handshakes_connected);
+  assert(1 == m->handshakes_lame);
+
+  /* A frontend which never answers is given up on at the deadline. */
+  fe->request_count = m->kite_max;
+  pkm_queue_handshake(fe, ev_time() + 0.1);
+  ev_loop(m->loop, EVLOOP_NONBLOCK);
+  assert(0 <= (n = accept(lsv[1], NULL, NULL)));
+  for (i = 0; (i < 1000) && (FE_HANDSHAKE_NONE != fe->handshake); i++)
+    ev_loop(m->loop, EVLOOP_ONESHOT);
+  assert(FE_HANDSHAKE_NONE == fe->handshake);
+  assert(0 > fe->conn.sockfd);
+  assert(ev_time() < fe->handshake_started + 5);
+  assert(0 == m->handshakes_pending);
+  close(n);
+
+  fe = m->tunnels;
+  ev_io_stop(m->loop, &(fe->conn.watch_r));
+  ev_io_stop(m->loop, &(fe->conn.watch_w));
+  pkc_reset_conn(&(fe->conn), 0);
+  PKS_STATE(pk_state.live_tunnels -= 1);
+  for (i = 0; i < 2; i++) {
+    close(asv[i]);
+    close(lsv[i]);
+  }
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_salts(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  int got;
+  int lsv[2];
+  struct sockaddr_in fsin[2];
+  struct addrinfo fai[2];
+  int i;
+
+  /* Salts survive a dead tunnel, so coming back up takes one connection
+   * instead of two.  If the frontend rejects us, they are forgotten. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != m);
+  assert(NULL != pkm_add_kite(m, "http", "hs.example", 80, "sec",
+                              "localhost", 80));
+  lsv[0] = pkm_test_listen(fsin, fai, 0);
+  assert(NULL != (fe = pkm_add_frontend_ai(m, fai, "hs", 0,
+                                           FE_STATUS_WANTED)));
+  got = pk_state.live_tunnels;
+  for (i = 0; i < 2; i++) {
+    assert(m->kite_max == pkm_prepare_requests(m, fe));
+    pkm_queue_handshake(fe, ev_time() + PK_HANDSHAKE_TIMEOUT);
+    ev_loop(m->loop, EVLOOP_NONBLOCK);
+    assert(2 - i == pkm_test_salty_frontend(m, lsv[0], fe,
+                                            "HTTP/1.1 200 OK\r\n\r\n"));
+    assert(1 - i == fe->handshake_rounds);
+    assert(got + 1 == (int) pk_state.live_tunnels);
+    assert(0 == strcmp(fe->requests[0].fsalt, "f00d"));
+    assert(0 == pkm_prepare_requests(m, fe));
+
+    /* As if the tunnel had died, see pkm_update_io(). */
+    ev_io_stop(m->loop, &(fe->conn.watch_r));
+    ev_io_stop(m->loop, &(fe->conn.watch_w));
+    pkc_reset_conn(&(fe->conn), CONN_STATUS_ALLOCATED);
+    PKS_STATE(pk_state.live_tunnels -= 1);
+    fe->request_count = 0;
+  }
+  assert(m->kite_max == pkm_prepare_requests(m, fe));
+  pkm_queue_handshake(fe, ev_time() + PK_HANDSHAKE_TIMEOUT);
+  ev_loop(m->loop, EVLOOP_NONBLOCK);
+  assert(1 == pkm_test_salty_frontend(m, lsv[0], fe,
+                                      "HTTP/1.1 200 OK\r\n"
+                                      "X-PageKite-Invalid: hs.example\r\n\r\n"));
+  assert(fe->conn.status & FE_STATUS_REJECTED);
+  assert('\0' == fe->requests[0].fsalt[0]);
+  assert(2 == m->handshakes_connected);
+  close(lsv[0]);
+  pkm_manager_free(m);
+  return 1;
+}
+
+static int pkmanager_test_tls_sessions(void)
+{
+#if defined(HAVE_OPENSSL) && (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  int n;
+  int lsv[2];
+  struct sockaddr_in fsin[2];
+  struct addrinfo fai[2];
+  SSL_CTX* server_ctx;
+  SSL_CTX* client_ctx;
+  int i;
+
+  /* The TLS session of one connection is offered again on the next, so
+   * reconnecting to the same frontend skips the full TLS handshake. */
+  server_ctx = pkm_test_tls_server_ctx();
+  client_ctx = SSL_CTX_new(TLS_client_method());
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, client_ctx);
+  assert(NULL != m);
+  assert(NULL != pkm_add_kite(m, "http", "hs.example", 80, "sec",
+                              "localhost", 80));
+  lsv[0] = pkm_test_listen(fsin, fai, 0);
+  assert(NULL != (fe = pkm_add_frontend_ai(m, fai, "hs", 0,
+                                           FE_STATUS_WANTED)));
+  for (i = 0; i < 2; i++) {
+    fe->request_count = m->kite_max;
+    for (n = 0; n < m->kite_max; n++) fe->requests[n].kite = m->kites + n;
+    pkm_queue_handshake(fe, ev_time() + PK_HANDSHAKE_TIMEOUT);
+    ev_loop(m->loop, EVLOOP_NONBLOCK);
+    pkm_test_tls_frontend(m, lsv[0], server_ctx, fe);
+    assert(0 <= fe->conn.sockfd);
+    assert(NULL != fe->conn.ssl);
+    assert(NULL != fe->ssl_session);
+    assert(i == SSL_session_reused(fe->conn.ssl));
+
+    ev_io_stop(m->loop, &(fe->conn.watch_r));
+    ev_io_stop(m->loop, &(fe->conn.watch_w));
+    pkc_reset_conn(&(fe->conn), 0);
+    PKS_STATE(pk_state.live_tunnels -= 1);
+  }
+  assert(1 == m->tls_handshakes_full);
+  assert(1 == m->tls_handshakes_resumed);
+  assert(2 == m->handshakes_connected);
+  close(lsv[0]);
+  pkm_manager_free(m);
+  SSL_CTX_free(client_ctx);
+#endif
+  return 1;
+}
+
+static int pkmanager_test_ktls(void)
+{
+#if defined(HAVE_OPENSSL) && (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+  int got, n;
+  SSL_CTX* server_ctx;
+  SSL_CTX* client_ctx;
+  SSL* peer;
+  struct pk_conn pkc;
+  struct iovec iov[2];
+  ssize_t bytes;
+  char data[4000];
+
+  /* Kernel TLS, if OpenSSL and the kernel can do it here: the kernel
+   * builds the records, so we write plain data and keep our writev.
+   * Either way the peer gets what we wrote, and we what it wrote. */
+  server_ctx = pkm_test_tls_server_ctx();
+  client_ctx = SSL_CTX_new(TLS_client_method());
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL_CTX_set_options(client_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+  peer = pkm_test_tls_conn(client_ctx, server_ctx, &pkc);
+  pkc.write_calls = 0;
+  iov[0].iov_base = "abc";
+  iov[0].iov_len = 3;
+  iov[1].iov_base = "defgh";
+  iov[1].iov_len = 5;
+  assert(8 == pkc_writev(&pkc, iov, 2));
+  if (pkc.ktls & CONN_KTLS_SEND) assert(1 == pkc.write_calls);
+  for (got = n = 0; (n < 1000) && (got < 8); n++) {
+    if (0 < (bytes = SSL_read(peer, data + got, sizeof(data) - got)))
+      got += bytes;
+    else
+      wait_fd(SSL_get_fd(peer), 5);
+  }
+  assert((8 == got) && (0 == strncmp(data, "abcdefgh", 8)));
+  assert(5 == SSL_write(peer, "ijklm", 5));
+  for (got = n = 0; (n < 1000) && (got < 5); n++) {
+    if (0 < (bytes = pkc_read_into(&pkc, data + got, sizeof(data) - got)))
+      got += bytes;
+    else
+      wait_fd(pkc.sockfd, 5);
+  }
+  assert((5 == got) && (0 == strncmp(data, "ijklm", 5)));
+  close(SSL_get_fd(peer));
+  SSL_free(peer);
+  pkc_reset_conn(&pkc, 0);
+  SSL_CTX_free(client_ctx);
+  SSL_CTX_free(server_ctx);
+#endif
+  return 1;
+}
+
+static int pkmanager_test_block(void)
+{
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  int n;
+  int lsv[2];
+  struct sockaddr_in fsin[2];
+  struct addrinfo fai[2];
+  int i;
+
+  /* Other threads really get the loop to themselves in pkm_block(), even
+   * if it keeps being woken up meanwhile. */
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  assert(NULL != pkm_add_kite(m, "http", "hs.example", 80, "sec",
+                              "localhost", 80));
+  lsv[0] = pkm_test_listen(fsin, fai, 0);
+  assert(NULL != (fe = pkm_add_frontend_ai(m, fai, "hs", 0,
+                                           FE_STATUS_WANTED)));
+  assert(0 == pthread_create(&(m->main_thread), NULL, pkm_test_loop, m));
+  for (i = 0; i < 100; i++) {
+    pkm_block(m);
+    n = ev_iteration(m->loop);
+    pkm_interrupt(m);
+    ev_sleep(0.001);
+    assert(n == (int) ev_iteration(m->loop));
+    pkm_unblock(m);
+  }
+
+  /* So a reconnect pass can run on another thread: the loop starts the
+   * handshake and gives up on it at the deadline, as nobody answers. */
+  m->reconnect_timeout = 1;
+  assert(1 == pkm_reconnect_all(m));
+  assert(0 == m->handshakes_pending);
+  assert(FE_HANDSHAKE_NONE == fe->handshake);
+  assert(0 > fe->conn.sockfd);
+  pkm_quit(m);
+  pthread_join(m->main_thread, NULL);
+  close(lsv[0]);
+  pkm_manager_free(m);
+  return 1;
+}
+#endif
+
+int pkmanager_test(void)
+{
+#if PK_TESTS
+  return (pkmanager_test_basics() &&
+          pkmanager_test_stream_index() &&
+          pkmanager_test_eviction() &&
+          pkmanager_test_stream_buffers() &&
+          pkmanager_test_kite_index() &&
+          pkmanager_test_backend_addrs() &&
+          pkmanager_test_backpressure() &&
+          pkmanager_test_tunnel_reads() &&
+          pkmanager_test_coalescing() &&
+          pkmanager_test_scheduling() &&
+          pkmanager_test_splice() &&
+          pkmanager_test_reports() &&
+          pkmanager_test_pick_worker() &&
+          pkmanager_test_workers() &&
+          pkmanager_test_handshakes() &&
+          pkmanager_test_salts() &&
+          pkmanager_test_tls_sessions() &&
+          pkmanager_test_ktls() &&
+          pkmanager_test_block());
+#else
+  return 1;
+#endif
+}
+
+#if PK_TESTS
+/* Note when the awaited stream's data comes out of the tunnel. */
+static void pkm_bench_chunk_cb(char** wanted, struct pk_chunk* chunk)
+{
+  if ((NULL != *wanted) && (NULL != chunk->sid) && (0 < chunk->length) &&
+      (0 == strcmp(*wanted, chunk->sid)))
+    *wanted = NULL;
+}
+
+static int pkm_bench_cmp(const void* a, const void* b)
+{
+  ev_tstamp d = *((const ev_tstamp*) a) - *((const ev_tstamp*) b);
+  return (d < 0) ? -1 : (d > 0);
+}
+
+/* Latency of small responses sharing a tunnel with a bulk download: the
+ * time from the backend writing a response until its chunk comes out of
+ * the tunnel, which a reader on the far end drains as fast as it can. */
+static void pkm_bench_latency(int quantum, const char* label)
+{
+  char pbuf[sizeof(struct pk_parser) + sizeof(struct pk_chunk)
+            + PARSER_BYTES_MAX];
+  char data[16 * 1024];
+  ev_tstamp lat[400];
+  ev_tstamp t0;
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  struct pk_backend_conn* s[9];
+  struct pk_parser* parser;
+  char* wanted;
+  char* buf;
+  char sid[BE_MAX_SID_SIZE];
+  int tsv[2], ssv[9][2];
+  int i, r, len;
+  int sndbuf = 4096;
+
+  assert(NULL != (m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1,
+                                       NULL, NULL)));
+  m->stream_quantum = quantum;
+  fe = pkm_test_tunnel_pair(m, 0, tsv);
+  /* A slow link: little can hide in the socket buffer */
+  setsockopt(tsv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  for (i = 0; i < 9; i++) {
+    sprintf(sid, "s%d", i);
+    s[i] = pkm_test_stream_pair(m, fe, sid, ssv[i]);
+    s[i]->conn.send_window_kb = 1024 * 1024 * 1024;  /* No flow control */
+    ev_io_start(m->loop, &(s[i]->conn.watch_r));
+  }
+  parser = pk_parser_init(sizeof(pbuf), pbuf,
+                          (pkChunkCallback*) &pkm_bench_chunk_cb, &wanted);
+  memset(data, 'b', sizeof(data));
+
+  /* Stream s0 always has more to send, s1-s8 take turns responding. */
+  for (r = 0; r < 400; r++) {
+    while (0 < write(ssv[0][1], data, sizeof(data)));
+    wanted = s[1 + r % 8]->sid;
+    t0 = ev_time();
+    assert(200 == write(ssv[1 + r % 8][1], data, 200));
+    while (NULL != wanted) {
+      ev_loop(m->loop, EVLOOP_NONBLOCK);
+      buf = pk_parser_buffer(parser, &len);
+      if (0 < (len = read(tsv[1], buf, len)))
+        pk_parser_parse_new_data(parser, len);
+    }
+    lat[r] = ev_time() - t0;
+  }
+  qsort(lat, 400, sizeof(ev_tstamp), pkm_bench_cmp);
+  printf("pkmanager: small responses behind bulk, %s: "
+         "p50 %.0f us, p99 %.0f us\n",
+         label, 1e6 * lat[200], 1e6 * lat[396]);
+
+  for (i = 0; i < 9; i++)
+    pkm_test_hangup(m->loop, &(s[i]->conn), ssv[i][1]);
+  pkm_test_hangup(m->loop, &(fe->conn), tsv[1]);
+  pkm_manager_free(m);
+}
+
+/* Tunnel throughput: a backend stream receives data frames as fast as the
+ * tunnel can read and parse them, with a given read budget per wakeup. */
+static void pkm_bench_tunnel_read(int budget, const char* label)
+{
+  static char stream[32 * 2048];
+  char data[64 * 1024];
+  ev_tstamp t0;
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  struct pk_backend_conn* pkb;
+  unsigned int iterations;
+  int tsv[2], ssv[2];
+  int i, len, pos, size, total;
+  int got = 0;
+
+  for (size = i = 0; i < 32; i++) {
+    size += pk_format_frame(stream + size, "tp", "SID: %s\r\n\r\n", 2000);
+    memset(stream + size, 'd', 2000);
+    size += 2000;
+  }
+  total = 64 * 1024 * 1024;
+
+  assert(NULL != (m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1,
+                                       NULL, NULL)));
+  fe = pkm_test_tunnel_pair(m, 0, tsv);
+  ev_io_start(m->loop, &(fe->conn.watch_r));
+  assert(NULL != pkm_add_kite(m, "http", "bench.example", 80, "sec",
+                              "localhost", 80));
+  pkb = pkm_test_stream_pair(m, fe, "tp", ssv);
+  pkb->kite = m->kites;
+  pk_state.tunnel_read_budget = budget;
+
+  pos = 0;
+  iterations = ev_iteration(m->loop);
+  t0 = ev_time();
+  while (got < total) {
+    while (0 < (len = write(tsv[1], stream + pos, size - pos)))
+      pos = (pos + len) % size;
+    ev_loop(m->loop, EVLOOP_NONBLOCK);
+    while (0 < (len = read(ssv[1], data, sizeof(data)))) got += len;
+    while (0 < read(tsv[1], data, sizeof(data)));
+  }
+  t0 = ev_time() - t0;
+  iterations = ev_iteration(m->loop) - iterations;
+  printf("pkmanager: tunnel reads, %s: %6.0f MB/s, "
+         "%5.1f loop iterations/MB\n", label,
+         got / t0 / (1024 * 1024), iterations / (got / (1024.0 * 1024)));
+
+  pk_state.tunnel_read_budget = 0;
+  pkm_test_hangup(m->loop, &(pkb->conn), ssv[1]);
+  pkm_test_hangup(m->loop, &(fe->conn), tsv[1]);
+  pkm_manager_free(m);
+}
+
+/* Play the far ends of a tunnel and its stream, on threads of their own. */
+struct pkm_bench_end {
+  pthread_t thread;
+  int fd;
+  int bytes;
+  int got;
+  int size;
+  char* stream;
+};
+static void* pkm_bench_feed(void* void_end)
+{
+  struct pkm_bench_end* end = (struct pkm_bench_end*) void_end;
+  int len, pos, sent;
+  for (pos = sent = 0; sent < end->bytes; sent += len) {
+    if (0 >= (len = write(end->fd, end->stream + pos, end->size - pos)))
+      break;
+    pos = (pos + len) % end->size;
+  }
+  return void_end;
+}
+static void* pkm_bench_drain(void* void_end)
+{
+  struct pkm_bench_end* end = (struct pkm_bench_end*) void_end;
+  char data[64 * 1024];
+  int len, got;
+  for (got = 0; got < end->bytes; got += len)
+    if (0 >= (len = read(end->fd, data, sizeof(data)))) break;
+  end->got = got;
+  return void_end;
+}
+static void* pkm_bench_loop(void* void_pkm)
+{
+  ev_loop(((struct pk_manager*) void_pkm)->loop, 0);
+  return void_pkm;
+}
+
+/* Aggregate throughput of 8 tunnels, each with one busy stream, spread
+ * over a number of workers (1: all on the manager's own loop).  Workers
+ * can only help if there are CPUs to run them, so those are counted too. */
+static void pkm_bench_workers(int workers)
+{
+  static char streams[8][32 * 2048];
+  struct pkm_bench_end feed[8], drain[8];
+  char sid[BE_MAX_SID_SIZE];
+  ev_tstamp t0;
+  pthread_t main_loop;
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  struct pk_backend_conn* pkb;
+  int tsv[8][2], ssv[8][2];
+  int i, j, size, frames;
+
+  assert(NULL != (m = pkm_manager_init(NULL, 0, NULL, -1, 8, -1,
+                                       NULL, NULL)));
+  assert(workers == pkm_set_workers(m, workers));
+  assert(NULL != pkm_add_kite(m, "http", "bench.example", 80, "sec",
+                              "localhost", 80));
+  for (i = 0; i < 8; i++) {
+    sprintf(sid, "wk%d", i);
+    for (size = j = 0; j < 32; j++) {
+      size += pk_format_frame(streams[i] + size, sid, "SID: %s\r\n\r\n", 2000);
+      memset(streams[i] + size, 'd', 2000);
+      size += 2000;
+    }
+    fe = pkm_test_tunnel_pair(m, i, tsv[i]);
+    ev_io_start(fe->worker->loop, &(fe->conn.watch_r));
+    pkb = pkm_test_stream_pair(m, fe, sid, ssv[i]);
+    pkb->kite = m->kites;
+    set_blocking(tsv[i][1]);  /* For the feeder and drainer threads */
+    set_blocking(ssv[i][1]);
+
+    frames = 16 * 1024 * 1024 / size;
+    feed[i].fd = tsv[i][1];
+    feed[i].stream = streams[i];
+    feed[i].size = size;
+    feed[i].bytes = frames * size;
+    drain[i].fd = ssv[i][1];
+    drain[i].bytes = frames * 32 * 2000;
+  }
+
+  t0 = ev_time();
+  if (1 < workers) pkm_start_workers(m);
+  else pthread_create(&main_loop, NULL, pkm_bench_loop, (void *) m);
+  for (i = 0; i < 8; i++) {
+    pthread_create(&(drain[i].thread), NULL, pkm_bench_drain, drain + i);
+    pthread_create(&(feed[i].thread), NULL, pkm_bench_feed, feed + i);
+  }
+  for (size = i = 0; i < 8; i++) {
+    pthread_join(feed[i].thread, NULL);
+    pthread_join(drain[i].thread, NULL);
+    assert(drain[i].got == drain[i].bytes);
+    size += drain[i].bytes / (1024 * 1024);
+  }
+  t0 = ev_time() - t0;
+  if (1 < workers) pkm_stop_workers(m);
+  else {
+    pkm_quit(m);
+    pthread_join(main_loop, NULL);
+  }
+  printf("pkmanager: %d worker%s, 8 tunnels, %ld CPU(s): %6.0f MB/s\n",
+         workers, (1 < workers) ? "s" : "",
+         sysconf(_SC_NPROCESSORS_ONLN), size / t0);
+
+  for (i = 0; i < 8; i++) {
+    fe = m->tunnels + i;
+    pkm_test_hangup(fe->worker->loop, &(fe->streams->conn), ssv[i][1]);
+    pkm_test_hangup(fe->worker->loop, &(fe->conn), tsv[i][1]);
+  }
+  pkm_manager_free(m);
+}
+
+/* A connected pair of loopback TCP sockets. */
+static void pkm_bench_tcp_pair(int sv[2])
+{
+  struct sockaddr_in sin;
+  struct addrinfo ai;
+  int lfd = pkm_test_listen(&sin, &ai, 0);
+  assert(0 <= (sv[1] = socket(AF_INET, SOCK_STREAM, 0)));
+  assert(0 == connect(sv[1], ai.ai_addr, ai.ai_addrlen));
+  assert(0 <= (sv[0] = accept(lfd, NULL, NULL)));
+  close(lfd);
+}
+
+/* Relay throughput from a backend to a tunnel over loopback TCP, with
+ * chunk bodies spliced from socket to socket, or copied through user
+ * space as before. */
+static void pkm_bench_relay(int splice, const char* label)
+{
+  static char stream[64 * 1024];
+  struct pkm_bench_end feed, drain;
+  ev_tstamp t0;
+  pthread_t main_loop;
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  struct pk_backend_conn* pkb;
+  int tsv[2], ssv[2];
+
+  assert(NULL != (m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1,
+                                       NULL, NULL)));
+  m->enable_splice = splice;
+  m->stream_quantum = 64 * 1024;
+  assert(NULL != pkm_add_kite(m, "http", "bench.example", 80, "sec",
+                              "localhost", 80));
+  pkm_bench_tcp_pair(tsv);
+  pkm_bench_tcp_pair(ssv);
+  fe = pkm_test_tunnel(m, 0, tsv[0]);
+  pkb = pkm_test_stream(m, fe, "rl", ssv[0]);
+  pkb->kite = m->kites;
+  pkb->conn.send_window_kb = 1024 * 1024 * 1024;  /* No flow control */
+  ev_io_start(m->loop, &(pkb->conn.watch_r));
+
+  memset(stream, 'd', sizeof(stream));
+  feed.fd = ssv[1];
+  feed.stream = stream;
+  feed.size = sizeof(stream);
+  feed.bytes = 512 * 1024 * 1024;
+  drain.fd = tsv[1];
+  drain.bytes = feed.bytes;
+
+  t0 = ev_time();
+  pthread_create(&main_loop, NULL, pkm_bench_loop, (void *) m);
+  pthread_create(&(drain.thread), NULL, pkm_bench_drain, &drain);
+  pthread_create(&(feed.thread), NULL, pkm_bench_feed, &feed);
+  pthread_join(feed.thread, NULL);
+  pthread_join(drain.thread, NULL);
+  t0 = ev_time() - t0;
+  pkm_quit(m);
+  pthread_join(main_loop, NULL);
+  printf("pkmanager: loopback relay, %s: %5.2f GB/s\n",
+         label, feed.bytes / t0 / (1024 * 1024 * 1024));
+  assert(splice == (0 <= fe->splice_pipe[0]));
+
+  pkm_test_hangup(m->loop, &(pkb->conn), ssv[1]);
+  pkm_test_hangup(m->loop, &(fe->conn), tsv[1]);
+  pkm_manager_free(m);
+}
+
+#if defined(HAVE_OPENSSL) && (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+static void* pkm_bench_tls_drain(void* void_ssl)
+{
+  char data[64 * 1024];
+  while (0 < SSL_read((SSL*) void_ssl, data, sizeof(data)));
+  return void_ssl;
+}
+
+/* CPU time spent sending over TLS to a local OpenSSL peer, with OpenSSL
+ * doing the encryption, or the kernel if kernel TLS is available. */
+static void pkm_bench_tls(int ktls, const char* label)
+{
+  static char data[16 * 1024];
+  struct timespec t0, t1;
+  struct pk_conn pkc;
+  pthread_t drain;
+  SSL_CTX* server_ctx = pkm_test_tls_server_ctx();
+  SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+  SSL* peer;
+  int i, rounds = 256 * 1024 * 1024 / sizeof(data);
+
+#ifdef SSL_OP_ENABLE_KTLS
+  if (ktls) SSL_CTX_set_options(client_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+  peer = pkm_test_tls_conn(client_ctx, server_ctx, &pkc);
+  if (ktls && !(pkc.ktls & CONN_KTLS_SEND)) {
+    printf("pkmanager: TLS sending, %s: not available here\n", label);
+  }
+  else {
+    set_blocking(pkc.sockfd);
+    set_blocking(SSL_get_fd(peer));
+    pthread_create(&drain, NULL, pkm_bench_tls_drain, (void *) peer);
+    memset(data, 't', sizeof(data));
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    for (i = 0; i < rounds; i++)
+      assert(sizeof(data) == pkc_write(&pkc, data, sizeof(data)));
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    shutdown(pkc.sockfd, SHUT_WR);
+    pthread_join(drain, NULL);
+    printf("pkmanager: TLS sending, %s: %5.2f CPU s/GB\n", label,
+           ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9)
+           * 1024 * 1024 * 1024 / ((double) rounds * sizeof(data)));
+  }
+  close(SSL_get_fd(peer));
+  SSL_free(peer);
+  pkc_reset_conn(&pkc, 0);
+  SSL_CTX_free(client_ctx);
+  SSL_CTX_free(server_ctx);
+}
+
+/* The same over TLS, in the other direction: 8 busy streams, each sending
+ * through its own encrypted tunnel.  Encryption is the CPU time workers
+ * are there to spread, so this is the number which should scale. */
+struct pkm_bench_tls_end {
+  pthread_t thread;
+  SSL* ssl;
+  int bytes;
+  int got;
+};
+static void* pkm_bench_tls_count(void* void_end)
+{
+  struct pkm_bench_tls_end* end = (struct pkm_bench_tls_end*) void_end;
+  char data[64 * 1024];
+  int len;
+  for (end->got = 0; end->got < end->bytes; end->got += len)
+    if (0 >= (len = SSL_read(end->ssl, data, sizeof(data)))) break;
+  return void_end;
+}
+static void pkm_bench_workers_tls(int workers)
+{
+  static char stream[64 * 1024];
+  struct pkm_bench_end feed[8];
+  struct pkm_bench_tls_end drain[8];
+  char sid[BE_MAX_SID_SIZE];
+  ev_tstamp t0;
+  pthread_t main_loop;
+  struct pk_manager* m;
+  struct pk_tunnel* fe;
+  struct pk_backend_conn* pkb;
+  SSL_CTX* server_ctx = pkm_test_tls_server_ctx();
+  SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+  int ssv[8][2];
+  int i, size;
+
+  assert(NULL != (m = pkm_manager_init(NULL, 0, NULL, -1, 8, -1,
+                                       NULL, NULL)));
+  assert(workers == pkm_set_workers(m, workers));
+  assert(NULL != pkm_add_kite(m, "http", "bench.example", 80, "sec",
+                              "localhost", 80));
+  memset(stream, 'e', sizeof(stream));
+  for (i = 0; i < 8; i++) {
+    sprintf(sid, "wt%d", i);
+    fe = m->tunnels + i;
+    drain[i].ssl = pkm_test_tls_conn(client_ctx, server_ctx, &(fe->conn));
+    pkm_test_tunnel(m, i, fe->conn.sockfd);
+    pkb = pkm_test_stream_pair(m, fe, sid, ssv[i]);
+    pkb->kite = m->kites;
+    pkb->conn.send_window_kb = 1024 * 1024 * 1024;  /* No flow control */
+    ev_io_start(fe->worker->loop, &(pkb->conn.watch_r));
+    set_blocking(SSL_get_fd(drain[i].ssl));
+    set_blocking(ssv[i][1]);
+
+    feed[i].fd = ssv[i][1];
+    feed[i].stream = stream;
+    feed[i].size = sizeof(stream);
+    feed[i].bytes = 8 * 1024 * 1024;
+    drain[i].bytes = feed[i].bytes;  /* Not counting chunk headers */
+  }
+
+  t0 = ev_time();
+  if (1 < workers) pkm_start_workers(m);
+  else pthread_create(&main_loop, NULL, pkm_bench_loop, (void *) m);
+  for (i = 0; i < 8; i++) {
+    pthread_create(&(drain[i].thread), NULL, pkm_bench_tls_count, drain + i);
+    pthread_create(&(feed[i].thread), NULL, pkm_bench_feed, feed + i);
+  }
+  for (size = i = 0; i < 8; i++) {
+    pthread_join(feed[i].thread, NULL);
+    pthread_join(drain[i].thread, NULL);
+    assert(drain[i].got >= drain[i].bytes);
+    size += feed[i].bytes / (1024 * 1024);
+  }
+  t0 = ev_time() - t0;
+  if (1 < workers) pkm_stop_workers(m);
+  else {
+    pkm_quit(m);
+    pthread_join(main_loop, NULL);
+  }
+  printf("pkmanager: %d worker%s, 8 TLS tunnels, %ld CPU(s): %6.0f MB/s\n",
+         workers, (1 < workers) ? "s" : "",
+         sysconf(_SC_NPROCESSORS_ONLN), size / t0);
+
+  for (i = 0; i < 8; i++) {
+    fe = m->tunnels + i;
+    pkm_test_hangup(fe->worker->loop, &(fe->streams->conn), ssv[i][1]);
+    ev_io_stop(fe->worker->loop, &(fe->conn.watch_r));
+    ev_io_stop(fe->worker->loop, &(fe->conn.watch_w));
+    pkc_reset_conn(&(fe->conn), 0);
+    close(SSL_get_fd(drain[i].ssl));
+    SSL_free(drain[i].ssl);
+  }
+  pkm_manager_free(m);
+  SSL_CTX_free(client_ctx);
+  SSL_CTX_free(server_ctx);
+}
+#endif
+#endif
+
+/* Microbenchmarks, run by bench.c (make runbench). */
+int pkmanager_bench(void)
+{
+#if PK_TESTS
+  static char sids[10000][BE_MAX_SID_SIZE];
+  static char domains[10000][24];
+  static const int sizes[] = {16, 1000, 10000};
+  struct pk_manager* m;
+  struct pk_backend_conn* c;
+  ev_tstamp t0, lookup, churn;
+  int i, n, s, r, rounds, found;
+  int sv[2], idle, busy;
+
+  /* Stream lookup (once per chunk) and alloc/free (once per stream) */
+  for (s = 0; s < 3; s++) {
+    n = sizes[s];
+    rounds = 1 + 1000000 / n;
+    assert(NULL != (m = pkm_manager_init(NULL, 0, NULL, -1, 4, n, NULL, NULL)));
+    for (i = 0; i < n; i++) {
+      sprintf(sids[i], "%x", i * 7919);
+      assert(NULL != pkm_alloc_be_conn(m, m->tunnels + (i % 4), sids[i]));
+    }
+
+    found = 0;
+    t0 = ev_time();
+    for (r = 0; r < rounds; r++)
+      for (i = 0; i < n; i++)
+        found += (NULL != pkm_find_be_conn(m, m->tunnels + (i % 4), sids[i]));
+    lookup = ev_time() - t0;
+    assert(found == rounds * n);
+
+    t0 = ev_time();
+    for (r = 0; r < rounds; r++)
+      for (i = 0; i < n; i++) {
+        c = pkm_find_be_conn(m, m->tunnels + (i % 4), sids[i]);
+        pkm_free_be_conn(m, c);
+        assert(NULL != pkm_alloc_be_conn(m, m->tunnels + (i % 4), sids[i]));
+      }
+    churn = ev_time() - t0 - lookup;
+
+    printf("pkmanager: %5d streams: %6.1f ns/lookup, %6.1f ns/free+alloc\n",
+           n, 1e9 * lookup / (rounds * n), 1e9 * churn / (rounds * n));
+    pkm_manager_free(m);
+  }
+
+  /* Kite lookup, once per new stream: exact port, then wildcard port */
+  for (s = 0; s < 3; s++) {
+    n = sizes[s];
+    rounds = 1 + 1000000 / n;
+    assert(NULL != (m = pkm_manager_init(NULL, 0, NULL, n, -1, -1, NULL, NULL)));
+    for (i = 0; i < n; i++) {
+      sprintf(domains[i], "K%d.Example", i);
+      assert(NULL != pkm_add_kite(m, "http", domains[i], (i % 2) ? 80 : 0,
+                                  "sec", "localhost", 80));
+      sprintf(domains[i], "k%d.example", i);
+    }
+    found = 0;
+    t0 = ev_time();
+    for (r = 0; r < rounds; r++)
+      for (i = 0; i < n; i++)
+        found += (NULL != pkm_find_kite(m, "http", domains[i], 80));
+    lookup = ev_time() - t0;
+    assert(found == rounds * n);
+    printf("pkmanager: %5d kites: %6.1f ns/lookup, %5.1f M lookups/s\n",
+           n, 1e9 * lookup / (rounds * n), (rounds * n) / lookup / 1e6);
+    pkm_manager_free(m);
+  }
+
+  /* Memory for 10k streams: idle ones hold no buffers, busy ones borrow
+   * blocks from the pool and give them back as they drain.  Before the
+   * pool, every pk_conn carried two inline CONN_IO_BUFFER_SIZE arrays. */
+  n = 10000;
+  assert(NULL != (m = pkm_manager_init(NULL, 0, NULL, -1, -1, n, NULL, NULL)));
+  pkm_test_socketpair(sv);
+  memset(sids, 'm', sizeof(sids));
+  while (0 < write(sv[0], sids, sizeof(sids)));
+  pkc_buffer_stats(&idle, NULL);
+  for (i = 0; i < n; i++) {
+    sprintf(sids[i], "%x", i);
+    assert(NULL != (c = pkm_alloc_be_conn(m, m->tunnels, sids[i])));
+    c->conn.sockfd = sv[0];
+  }
+  pkc_buffer_stats(&r, NULL);
+  r -= idle;
+  for (i = 0; i < n; i++)
+    assert(0 < pkc_write(&(m->be_conns[i].conn), sids[0], 1000));
+  pkc_buffer_stats(&busy, NULL);
+  for (found = 1; found; ) {
+    while (0 < read(sv[1], sids, sizeof(sids)));
+    for (found = i = 0; i < n; i++) {
+      if (0 < m->be_conns[i].conn.out_buffer_pos)
+        pkc_flush(&(m->be_conns[i].conn), NULL, 0, NON_BLOCKING_FLUSH, "bench");
+      found += (0 < m->be_conns[i].conn.out_buffer_pos);
+    }
+  }
+  pkc_buffer_stats(&found, NULL);
+  printf("pkmanager: %5d streams: %4d B/stream (%d B with inline buffers), "
+         "pool blocks in use: %d idle, %d busy, %d drained\n",
+         n, (int) sizeof(struct pk_backend_conn),
+         (int) sizeof(struct pk_backend_conn) + 2 * CONN_IO_BUFFER_SIZE,
+         r, busy - idle, found - idle);
+  for (i = 0; i < n; i++) m->be_conns[i].conn.sockfd = -1;
+  close(sv[0]);
+  close(sv[1]);
+  pkm_manager_free(m);
+
+  /* One read per wakeup, as before the read loop, vs. the default */
+  pkm_bench_tunnel_read(1, "one read per wakeup");
+  pkm_bench_tunnel_read(0, "default budget");
+
+  /* Scaling with workers; each runs its loop on a thread of its own */
+  pkm_bench_workers(1);
+  pkm_bench_workers(2);
+  pkm_bench_workers(4);
+  pkm_bench_workers(8);
+
+  /* Large chunk bodies through the tunnel's pipe, vs. through us */
+  pkm_bench_relay(1, "splice");
+  pkm_bench_relay(0, "copying");
+
+#if defined(HAVE_OPENSSL) && (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+  /* Encrypting in user space, vs. letting the kernel do it */
+  pkm_bench_tls(0, "OpenSSL");
+  pkm_bench_tls(1, "kernel TLS");
+
+  /* Encrypted tunnels are where spreading over workers pays off */
+  pkm_bench_workers_tls(1);
+  pkm_bench_workers_tls(2);
+  pkm_bench_workers_tls(4);
+  pkm_bench_workers_tls(8);
+#endif
+
+  /* Taking turns, vs. a quantum so large the bulk stream keeps the
+   * tunnel until it blocks, as before deficit round robin. */
+  pkm_bench_latency(PK_STREAM_QUANTUM_DEFAULT, "taking turns");
+  pkm_bench_latency(64 * 1024 * 1024, "bulk first");
 #endif
   return 1;
 }
@@ -23,6 +23,13 @@ Note: For alternate license terms, see the file COPYING.md.
 #define PK_CHECK_WORLD_INTERVAL       3600  /* 1 hour */
 #define PK_DDNS_UPDATE_INTERVAL_MIN    360  /* Less than 300 makes no sense,
                                                due to DNS caching TTLs. */
+#define PK_BACKEND_DNS_TTL             300  /* Seconds, for cached backend */
+#define PK_BACKEND_DNS_RETRY            10  /* addresses (or failures). */
+#define PK_STREAM_QUANTUM_DEFAULT     4096  /* Bytes per stream per turn */
+#define PK_SCHEDULE_BUDGET      (64 * 1024) /* Bytes per tunnel per pass */
+#define PK_WORKERS_MAX                   8  /* Event loop threads */
+#define PK_SPLICE_MIN                 4096  /* Smaller chunks are copied */
+#define PK_HANDSHAKE_TIMEOUT            10  /* Seconds to connect tunnels */
 
 struct pk_tunnel;
 struct pk_backend_conn;
@@ -30,6 +37,29 @@ struct pk_manager;
 struct pk_job;
 struct pk_job_pile;
 
+/* An event loop and the per-loop watchers for the tunnels pinned to it.
+ * Worker 0 is the manager's own loop.  With pkm_set_workers(), tunnels
+ * (and their streams) are instead spread over workers 1..N, each running
+ * its loop on a thread of its own, see pkm_lock_worker().  That is also
+ * how TLS is offloaded: a tunnel's SSL_read and SSL_write only ever run
+ * on its worker, which is thus the tunnel's crypto thread, and records
+ * stay in order without any queues.  Without workers (the default), all
+ * encryption happens on the manager's thread. */
+struct pk_worker {
+  struct pk_manager*      manager;
+  struct ev_loop*         loop;
+  pthread_t               thread;
+  pthread_mutex_t         loop_lock;   /* Released while the loop waits */
+  ev_async                wakeup;
+  ev_async                start_handshakes;  /* See pkm_queue_handshake() */
+  ev_async                quit;
+  ev_prepare              flush_tunnels;
+  ev_idle                 schedule_more;
+  ev_timer                report_timer;
+  struct pk_tunnel*       tunnels;     /* Ours, see pkm_move_tunnel() */
+  unsigned int            running:1;
+};
+
 /* These are also written to the conn.status field, using the fourth byte. */
 #define FE_STATUS_BITS      0xFF000000
 #define FE_STATUS_AUTO      0x00000000  /* For use in pkm_add_tunnel       */
@@ -39,6 +69,11 @@ struct pk_job_pile;
 #define FE_STATUS_REJECTED  0x08000000  /* Front-end rejected connection   */
 #define FE_STATUS_LAME      0x10000000  /* Front-end is going offline      */
 #define FE_STATUS_IS_FAST   0x20000000  /* This is a fast front-end        */
+/* Tunnel handshake progress, see pkm_handshake_step(). */
+#define FE_HANDSHAKE_NONE    0  /* Not connecting                         */
+#define FE_HANDSHAKE_SENDING 1  /* Connecting, TLS and sending requests   */
+#define FE_HANDSHAKE_READING 2  /* Waiting for the frontend's response    */
+#define FE_HANDSHAKE_QUEUED  3  /* Waiting for its loop to start it       */
 struct pk_tunnel {
   PK_MEMORY_CANARY
   /* These apply to frontend connections only (on the backend) */
@@ -53,9 +88,28 @@ struct pk_tunnel {
   char                    fe_session[PK_HANDSHAKE_SESSIONID_MAX];
   time_t                  last_ping;
   struct pk_manager*      manager;
+  struct pk_worker*       worker;      /* Whose loop watches this tunnel */
+  struct pk_tunnel*       worker_next; /* The next of worker->tunnels */
   struct pk_parser*       parser;
   int                     request_count;
   struct pk_kite_request* requests;
+  /* Streams using this tunnel, linked through pk_backend_conn */
+  struct pk_backend_conn* streams;
+  /* Streams with data waiting to be read, see pkm_schedule_streams() */
+  struct pk_backend_conn* ready_head;
+  struct pk_backend_conn* ready_tail;
+  int                     reports_pending;  /* See pkm_send_reports() */
+  int                     splice_pipe[2];   /* See pkm_splice_chunked() */
+  /* Connection setup, driven by the event loop, see pkm_queue_handshake() */
+  int                     handshake;        /* FE_HANDSHAKE_*              */
+  int                     handshake_rounds; /* Requests signed again?      */
+  int                     handshake_bytes;
+  char*                   handshake_buffer; /* The response, so far        */
+  ev_timer                handshake_timer;
+  ev_tstamp               handshake_deadline;
+  ev_tstamp               handshake_started;
+  ev_tstamp               connect_latency;  /* Seconds, last handshake     */
+  SSL_SESSION*            ssl_session;      /* See pkm_save_session()      */
 };
 
 /* These are also written to the conn.status field, using the third byte. */
@@ -64,11 +118,21 @@ struct pk_tunnel {
 #define BE_STATUS_EOF_WRITE      0x00020000
 #define BE_STATUS_EOF_THROTTLED  0x00040000
 #define BE_MAX_SID_SIZE          8
+#define BE_SID_PREFIX_SIZE      (BE_MAX_SID_SIZE + 8) /* SID: %s\r\n */
 struct pk_backend_conn {
   PK_MEMORY_CANARY
   char                sid[BE_MAX_SID_SIZE];
+  char                sid_prefix[BE_SID_PREFIX_SIZE];
+  int                 sid_prefix_len;
   struct pk_tunnel*   tunnel;
+  struct pk_backend_conn* tunnel_next;
+  struct pk_backend_conn* tunnel_prev;
+  struct pk_backend_conn* ready_next;
+  struct pk_backend_conn* ready_prev;
+  struct pk_backend_conn* free_next;      /* See pkm_alloc_be_conn() */
+  int                 deficit;        /* Bytes left of this turn */
   struct pk_pagekite* kite;
+  ev_timer            connect_timer;
   struct pk_conn      conn;
 };
 
@@ -76,13 +140,22 @@ struct pk_backend_conn {
 #define MIN_FE_ALLOC          2
 #define MIN_CONN_ALLOC       16
 #define MAX_BLOCKING_THREADS 16
+/* The stream index is an open-addressed hash table of pointers into the
+ * be_conns array, kept at most half full so probe sequences stay short. */
+#define PK_BE_INDEX_SIZE(c)  (2 * (c))
+/* Likewise, kites are indexed by (protocol, domain, port). */
+#define PK_KITE_INDEX_SIZE(k) (2 * (k))
 #define PK_MANAGER_BUFSIZE(k, f, c, ps) \
                            (1 + sizeof(struct pk_manager) \
                             + sizeof(struct pk_pagekite) * k \
+                            + sizeof(struct pk_pagekite*) \
+                                                  * PK_KITE_INDEX_SIZE(k) \
                             + sizeof(struct pk_tunnel) * f \
                             + sizeof(struct pk_kite_request) * f * k \
                             + ps * f \
                             + sizeof(struct pk_backend_conn) * c \
+                            + sizeof(struct pk_backend_conn*) \
+                                                  * PK_BE_INDEX_SIZE(c) \
                             + sizeof(struct pk_job) * (c+f))
 #define PK_MANAGER_MINSIZE PK_MANAGER_BUFSIZE(MIN_KITE_ALLOC, MIN_FE_ALLOC, \
                                               MIN_CONN_ALLOC, PARSER_BYTES_MIN)
@@ -94,18 +167,41 @@ struct pk_manager {
   char*                    buffer;
   char*                    buffer_base;
   struct pk_pagekite*      kites;
+  struct pk_pagekite**     kite_index;
+  int                      kite_index_max;
+  int                      kite_count;
   struct pk_tunnel*        tunnels;
   struct pk_backend_conn*  be_conns;
+  struct pk_backend_conn** be_conn_index;
+  int                      be_conn_index_max;
+  int                      be_conn_index_used;
+  int                      be_conn_index_tombstones;
+  struct pk_backend_conn*  be_conn_free;  /* Unallocated be_conns */
 
   PK_MEMORY_CANARY
 
   pthread_t                main_thread;
   pthread_mutex_t          loop_lock;
+  pthread_mutex_t          block_lock;    /* See pkm_block() */
+  pthread_cond_t           block_cond;
+  int                      blocking;
+  pthread_mutex_t          be_addr_lock;
+  pthread_mutex_t          be_conn_lock;  /* be_conns and their index */
+  int                      be_resolve_pending;
+  pthread_mutex_t          handshake_lock;  /* See pkm_reconnect_all() */
+  pthread_cond_t           handshake_cond;
+  int                      handshakes_pending;
+  int                      handshakes_connected;
+  int                      handshakes_lame;
+  int                      tls_handshakes_full;
+  int                      tls_handshakes_resumed;
   struct ev_loop*          loop;
   ev_async                 interrupt;
   ev_async                 quit;
   ev_async                 tick;
   ev_timer                 timer;
+  struct pk_worker         workers[PK_WORKERS_MAX + 1];
+  int                      worker_count;
 
   time_t                   last_world_update;
   time_t                   next_tick;
@@ -125,7 +221,13 @@ struct pk_manager {
   unsigned int             ev_loop_malloced:1;
   unsigned int             fancy_pagekite_net_rejection:1;
   unsigned int             enable_watchdog:1;
+  unsigned int             coalesce_tunnel_writes:1;
+  unsigned int             enable_splice:1;
   int                      want_spare_frontends;
+  int                      stream_quantum;
+  int                      reconnect_timeout;  /* Seconds per reconnect pass */
+  int                      window_kb_min;
+  int                      window_kb_max;
   char*                    dynamic_dns_url;
   time_t                   interval_fudge_factor;
   time_t                   housekeeping_interval_min;
@@ -147,6 +249,10 @@ struct pk_tunnel*    pkm_add_frontend_ai(struct pk_manager*, struct addrinfo*,
 struct pk_pagekite*  pkm_add_kite(struct pk_manager*,
                                   const char*, const char*, int, const char*,
                                   const char*, int);
+int                  pkm_resolve_backends(struct pk_manager*);
+int                  pkm_set_kite_connect_timeout(struct pk_manager*,
+                                                  const char*, const char*,
+                                                  int, int);
 
 void* pkm_run                       (void *);
 int pkm_run_in_thread               (struct pk_manager*);
@@ -156,7 +262,9 @@ int pkm_stop_thread                 (struct pk_manager*);
 int pkm_reconnect_all               (struct pk_manager*);
 int pkm_disconnect_unused           (struct pk_manager*);
 
+int pkm_set_workers                 (struct pk_manager*, int);
 void pkm_set_timer_enabled          (struct pk_manager*, int);
 void pkm_tick                       (struct pk_manager*);
 
 int pkmanager_test(void);
+int pkmanager_bench(void);
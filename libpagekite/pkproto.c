@@ -46,6 +46,10 @@ void pk_reset_pagekite(struct pk_pagekite* kite)
   kite->local_domain[0] = '\0';
   kite->local_port = 0;
   kite->auth_secret[0] = '\0';
+  kite->connect_timeout = CONN_CONNECT_TIMEOUT_DEFAULT;
+  kite->local_addr_count = 0;
+  kite->local_addr_next = 0;
+  kite->local_addrs_expire = 0;
 }
 
 void frame_reset_values(struct pk_frame* frame)
@@ -108,11 +112,13 @@ struct pk_parser* pk_parser_init(int buf_length, char* buf,
   parser_size += sizeof(struct pk_chunk);
   chunk_reset(parser->chunk);
 
-  parser->chunk->frame.raw_frame = (char *) (buf + parser_size);
+  parser->buffer = (char *) (buf + parser_size);
+  parser->buffer_size = buf_length - parser_size;
+  parser->chunk->frame.raw_frame = parser->buffer;
 
   parser->chunk_callback = chunk_cb;
   parser->chunk_callback_data = chunk_cb_data;
-  parser->buffer_bytes_left = buf_length - parser_size;
+  parser->buffer_bytes_left = parser->buffer_size;
 
   PK_CHECK_MEMORY_CANARIES;
   return(parser);
@@ -121,11 +127,137 @@ struct pk_parser* pk_parser_init(int buf_length, char* buf,
 void pk_parser_reset(struct pk_parser *parser)
 {
   PK_ADD_MEMORY_CANARY(parser);
-  parser->buffer_bytes_left += parser->chunk->frame.raw_length;
   frame_reset_values(&(parser->chunk->frame));
   chunk_reset_values(parser->chunk);
+  parser->chunk->frame.raw_frame = parser->buffer;
+  parser->buffer_bytes_left = parser->buffer_size;
 }
 
+/* Move on to the next frame, which starts at the given offset from the
+ * current one.  The buffer is left as-is, so no data gets copied. */
+static void pk_parser_advance(struct pk_parser *parser, int offset)
+{
+  struct pk_frame *frame = &(parser->chunk->frame);
+  char *raw_frame = frame->raw_frame + offset;
+
+  frame_reset_values(frame);
+  chunk_reset_values(parser->chunk);
+  frame->raw_frame = raw_frame;
+}
+
+#define PK_PARSER_RELOCATE(ptr, delta) if (ptr != NULL) ptr -= delta
+static void pk_parser_relocate(struct pk_parser *parser)
+{
+  struct pk_chunk *chunk = parser->chunk;
+  struct pk_frame *frame = &(parser->chunk->frame);
+  ssize_t delta = frame->raw_frame - parser->buffer;
+  int i;
+
+  memmove(parser->buffer, frame->raw_frame, frame->raw_length);
+  frame->raw_frame = parser->buffer;
+  parser->buffer_bytes_left += delta;
+
+  PK_PARSER_RELOCATE(frame->data, delta);
+  PK_PARSER_RELOCATE(chunk->sid, delta);
+  PK_PARSER_RELOCATE(chunk->eof, delta);
+  PK_PARSER_RELOCATE(chunk->noop, delta);
+  PK_PARSER_RELOCATE(chunk->ping, delta);
+  PK_PARSER_RELOCATE(chunk->request_host, delta);
+  PK_PARSER_RELOCATE(chunk->request_proto, delta);
+  PK_PARSER_RELOCATE(chunk->remote_ip, delta);
+  PK_PARSER_RELOCATE(chunk->remote_tls, delta);
+  PK_PARSER_RELOCATE(chunk->data, delta);
+  for (i = 0; i < chunk->header_count; i++)
+    PK_PARSER_RELOCATE(chunk->headers[i], delta);
+}
+
+/* Compact the buffer if the current frame straddles its end, i.e. there
+ * is no more room after it but there is some before it.  Returns 1 if
+ * data was moved, in which case the caller should wait for more data. */
+static int pk_parser_straddle(struct pk_parser *parser)
+{
+  if ((parser->buffer_bytes_left < 1) &&
+      (parser->chunk->frame.raw_frame > parser->buffer)) {
+    pk_parser_relocate(parser);
+    return 1;
+  }
+  return 0;
+}
+
+/* Return a pointer to where new data should be placed, along with the
+ * available space.  Data written there should be passed on to
+ * pk_parser_parse_new_data(). */
+char* pk_parser_buffer(struct pk_parser *parser, int *space)
+{
+  struct pk_frame *frame = &(parser->chunk->frame);
+  if (frame->raw_length == 0) {
+    frame->raw_frame = parser->buffer;
+    parser->buffer_bytes_left = parser->buffer_size;
+  }
+  *space = parser->buffer_bytes_left;
+  return frame->raw_frame + frame->raw_length;
+}
+
+/* Inline number parsing, for the header scanner below.  These accept the
+ * same input as sscanf's %x and %d (minus exotica like a 0x prefix) and
+ * return the number of digits parsed, leaving *out untouched on failure.
+ */
+static int pk_parse_hex(const char* p, ssize_t* out)
+{
+  ssize_t value = 0;
+  int digits = 0;
+  char c;
+
+  while ((*p == ' ') || (*p == '\t')) p++;
+  for (;; digits++) {
+    c = p[digits];
+    if ((c >= '0') && (c <= '9')) value = (value << 4) | (c - '0');
+    else if ((c >= 'a') && (c <= 'f')) value = (value << 4) | (c - 'a' + 10);
+    else if ((c >= 'A') && (c <= 'F')) value = (value << 4) | (c - 'A' + 10);
+    else break;
+  }
+  if (digits) *out = value;
+  return digits;
+}
+
+static int pk_parse_dec(const char* p, ssize_t* out)
+{
+  ssize_t value = 0;
+  int digits = 0;
+  int negative = 0;
+
+  while ((*p == ' ') || (*p == '\t')) p++;
+  if ((*p == '-') || (*p == '+')) negative = (*p++ == '-');
+  for (; (p[digits] >= '0') && (p[digits] <= '9'); digits++)
+    value = (value * 10) + (p[digits] - '0');
+  if (digits) *out = (negative ? -value : value);
+  return digits;
+}
+
+static int pk_parse_int(const char* p, int* out)
+{
+  ssize_t value;
+  if (0 == pk_parse_dec(p, &value)) return 0;
+  *out = (int) value;
+  return 1;
+}
+
+/* Case-insensitive match of a header name (given in lower case, including
+ * the trailing ": ") against the start of a line. */
+static int pk_header_is(const char* line, const char* name, int len)
+{
+  int i;
+  char c;
+  for (i = 0; i < len; i++) {
+    c = line[i];
+    if ((c != name[i]) &&
+        (((c | 0x20) != name[i]) || (name[i] < 'a') || (name[i] > 'z')))
+      return 0;
+  }
+  return 1;
+}
+#define PK_HEADER_IS(line, name) pk_header_is(line, name, sizeof(name) - 1)
+
 int parse_frame_header(struct pk_frame* frame)
 {
   int hdr_len;
@@ -135,19 +267,8 @@ int parse_frame_header(struct pk_frame* frame)
   {
     frame->hdr_length = hdr_len;
     frame->data = frame->raw_frame + hdr_len;
-    if (sizeof(frame->length) == sizeof(long unsigned int)) {
-      if (1 != sscanf(frame->raw_frame,
-                      "%lx", (long unsigned int *) &(frame->length))) {
-        return (pk_error = ERR_PARSE_BAD_FRAME);
-      }
-    }
-    else {
-      assert(sizeof(frame->length) == sizeof(unsigned int));
-      if (1 != sscanf(frame->raw_frame,
-                      "%x", (unsigned int *) &(frame->length))) {
-        return (pk_error = ERR_PARSE_BAD_FRAME);
-      }
-    }
+    if (0 == pk_parse_hex(frame->raw_frame, &(frame->length)))
+      return (pk_error = ERR_PARSE_BAD_FRAME);
   }
   return 0;
 }
@@ -156,70 +277,73 @@ int parse_chunk_header(struct pk_frame* frame, struct pk_chunk* chunk,
                        size_t bytes)
 {
   int len, pos = 0;
-  char first;
+  char *line;
   chunk->header_count = 0;
   while (2 < (len = zero_first_crlf(bytes - pos, frame->data + pos)))
   {
     PK_TRACE_LOOP("lines");
-
-    /* This gives us an upper-case (US-ASCII) of the first character. */
-    first = *(frame->data + pos) & (0xff - 32);
-
-    /* Cases ordered roughly by frequency, without too much obfuscation. */
-    if (first == 'S') {
-      if (0 == strncasecmp(frame->data + pos, "SID: ", 5))
-        chunk->sid = frame->data + pos + 5;
-      else if (0 == strncasecmp(frame->data + pos, "SKB: ", 5)) {
-        if (sizeof(chunk->remote_sent_kb) == sizeof(long int)) {
-          sscanf(frame->data + pos + 5,
-                 "%ld", (long int *) &(chunk->remote_sent_kb));
+    line = frame->data + pos;
+
+    /* Dispatch on the lower-cased (US-ASCII) first character, then match
+     * the rest of the name.  Cases ordered roughly by frequency. */
+    switch (*line | 0x20) {
+      case 's':
+        if (PK_HEADER_IS(line, "sid: "))
+          chunk->sid = line + 5;
+        else if (PK_HEADER_IS(line, "skb: "))
+          pk_parse_dec(line + 5, &(chunk->remote_sent_kb));
+        else if (PK_HEADER_IS(line, "spd: "))
+          pk_parse_int(line + 5, &(chunk->throttle_spd));
+        break;
+      case 'n':
+        if (PK_HEADER_IS(line, "noop: "))
+          chunk->noop = line + 6;
+        else goto other;
+        break;
+      case 'p':
+        if (PK_HEADER_IS(line, "ping: "))
+          chunk->ping = line + 6;
+        else if (PK_HEADER_IS(line, "proto: "))
+          chunk->request_proto = line + 7;
+        else if (PK_HEADER_IS(line, "port: "))
+          pk_parse_int(line + 6, &(chunk->request_port));
+        break;
+      case 'e':
+        if (PK_HEADER_IS(line, "eof: "))
+          chunk->eof = line + 5;
+        else goto other;
+        break;
+      case 'r':
+        if (PK_HEADER_IS(line, "rip: "))
+          chunk->remote_ip = line + 5;
+        else if (PK_HEADER_IS(line, "rport: "))
+          pk_parse_int(line + 7, &(chunk->remote_port));
+        else if (PK_HEADER_IS(line, "rtls: "))
+          chunk->remote_tls = line + 6;
+        break;
+      case 'h':
+        if (PK_HEADER_IS(line, "host: "))
+          chunk->request_host = line + 6;
+        else goto other;
+        break;
+      case 'q':
+        if (PK_HEADER_IS(line, "qdays: ")) {
+          if (pk_parse_int(line + 7, &(chunk->quota_days)))
+            pk_state.quota_days = chunk->quota_days;
+        } else if (PK_HEADER_IS(line, "qconns: ")) {
+          if (pk_parse_int(line + 8, &(chunk->quota_conns)))
+            pk_state.quota_conns = chunk->quota_conns;
+        } else if (PK_HEADER_IS(line, "quota: ")) {
+          if (pk_parse_int(line + 7, &(chunk->quota_mb)))
+            pk_state.quota_mb = chunk->quota_mb;
         }
-        else {
-          assert(sizeof(chunk->remote_sent_kb) == sizeof(unsigned int));
-          sscanf(frame->data + pos + 5,
-                 "%d", (int *) &(chunk->remote_sent_kb));
+        break;
+      default:
+      other:
+        if (chunk->header_count < PK_MAX_CHUNK_HEADERS) {
+          /* Just store pointers to any other headers, for later processing. */
+          chunk->headers[chunk->header_count++] = line;
         }
-      }
-      else if (0 == strncasecmp(frame->data + pos, "SPD: ", 5))
-        sscanf(frame->data + pos + 5, "%d", &(chunk->throttle_spd));
-    }
-    else if (0 == strncasecmp(frame->data + pos, "NOOP: ", 6))
-      chunk->noop = frame->data + pos + 6;
-    else if (first == 'P') {
-      if (0 == strncasecmp(frame->data + pos, "PING: ", 6))
-        chunk->ping = frame->data + pos + 6;
-      else if (0 == strncasecmp(frame->data + pos, "Proto: ", 7))
-        chunk->request_proto = frame->data + pos + 7;
-      else if (0 == strncasecmp(frame->data + pos, "Port: ", 6))
-        sscanf(frame->data + pos + 6, "%d", &(chunk->request_port));
-    }
-    else if (0 == strncasecmp(frame->data + pos, "EOF: ", 5))
-      chunk->eof = frame->data + pos + 5;
-    else if (first == 'R') {
-      if (0 == strncasecmp(frame->data + pos, "RIP: ", 5))
-        chunk->remote_ip = frame->data + pos + 5;
-      else if (0 == strncasecmp(frame->data + pos, "RPort: ", 7))
-        sscanf(frame->data + pos + 7, "%d", &(chunk->remote_port));
-      else if (0 == strncasecmp(frame->data + pos, "RTLS: ", 6))
-        chunk->remote_tls = frame->data + pos + 6;
-    }
-    else if (0 == strncasecmp(frame->data + pos, "Host: ", 6))
-      chunk->request_host = frame->data + pos + 6;
-    else if (first == 'Q') {
-      if (0 == strncasecmp(frame->data + pos, "QDays: ", 7)) {
-        if (1 == sscanf(frame->data + pos + 7, "%d", &(chunk->quota_days)))
-          pk_state.quota_days = chunk->quota_days;
-      } else if (0 == strncasecmp(frame->data + pos, "QConns: ", 8)) {
-        if (1 == sscanf(frame->data + pos + 8, "%d", &(chunk->quota_conns)))
-          pk_state.quota_conns = chunk->quota_conns;
-      } else if (0 == strncasecmp(frame->data + pos, "Quota: ", 7)) {
-        if (1 == sscanf(frame->data + pos + 7, "%d", &(chunk->quota_mb)))
-          pk_state.quota_mb = chunk->quota_mb;
-      }
-    }
-    else if (chunk->header_count < PK_MAX_CHUNK_HEADERS) {
-      /* Just store pointers to any other headers, for later processing. */
-      chunk->headers[chunk->header_count++] = frame->data + pos;
     }
 
     pos += len;
@@ -239,6 +363,34 @@ int parse_chunk_header(struct pk_frame* frame, struct pk_chunk* chunk,
   }
 }
 
+/* Invoke the callback for the current chunk.  If this is not the final
+ * fragment of the chunk, signals which apply to the chunk as a whole
+ * (EOF, PING, SPD) are held back until the rest has been delivered. */
+static void pk_parser_deliver(struct pk_parser *parser, struct pk_chunk *chunk)
+{
+  char *eof, *ping;
+  int throttle_spd;
+
+  if (parser->chunk_callback == (pkChunkCallback *) NULL) return;
+
+  if (chunk->offset + chunk->length >= chunk->total) {
+    parser->chunk_callback(parser->chunk_callback_data, chunk);
+  }
+  else {
+    eof = chunk->eof;
+    ping = chunk->ping;
+    throttle_spd = chunk->throttle_spd;
+    chunk->eof = chunk->ping = NULL;
+    chunk->throttle_spd = -1;
+
+    parser->chunk_callback(parser->chunk_callback_data, chunk);
+
+    chunk->eof = eof;
+    chunk->ping = ping;
+    chunk->throttle_spd = throttle_spd;
+  }
+}
+
 int pk_parser_parse_new_data(struct pk_parser *parser, int length)
 {
   int leftovers = 0;
@@ -256,21 +408,29 @@ int pk_parser_parse_new_data(struct pk_parser *parser, int length)
   parser->buffer_bytes_left -= length;
 
   /* If we don't have enough data for useful work, finish here. */
-  if (frame->raw_length < 3) return length;
+  if (frame->raw_length < 3) {
+    pk_parser_straddle(parser);
+    return length;
+  }
 
   /* Do we have still need to parse the frame header? */
   if (frame->length < 0) {
     if (0 != parse_frame_header(frame))
       return pk_error;
   }
-  if (frame->length < 0) return length;
+  if (frame->length < 0) {
+    pk_parser_straddle(parser);
+    return length;
+  }
 
   wanted_length = frame->length + frame->hdr_length;
   parse_length = frame->length;
 
-  /* If the buffer is full, start fragmenting... */
+  /* If the buffer is full, make room or start fragmenting: chunks which
+   * do not fit are delivered piecemeal, as the data arrives. */
   if ((parser->buffer_bytes_left < 1) &&
        (wanted_length > frame->raw_length)) {
+    if (pk_parser_straddle(parser)) return length;
     fragmenting = 1;
     parse_length = frame->raw_length - frame->hdr_length;
   }
@@ -290,13 +450,12 @@ int pk_parser_parse_new_data(struct pk_parser *parser, int length)
         chunk->length = chunk->total - chunk->offset;
       else
         chunk->length = length;
+      chunk->data = frame->raw_frame + frame->raw_length - length;
     }
-    chunk->offset += chunk->length;
 
-    if (parser->chunk_callback != (pkChunkCallback *) NULL) {
-      /* FIXME: if fragmenting, we should suppress EOFs */
-      parser->chunk_callback(parser->chunk_callback_data, chunk);
-    }
+    /* The callback sees the offset of the fragment being delivered. */
+    pk_parser_deliver(parser, chunk);
+    chunk->offset += chunk->length;
 
     if (fragmenting || (chunk->offset < chunk->total)) {
       frame->length -= chunk->length;
@@ -306,11 +465,11 @@ int pk_parser_parse_new_data(struct pk_parser *parser, int length)
     else {
       leftovers = frame->raw_length - wanted_length;
       if (leftovers > 0) {
-        memmove(frame->raw_frame,
-                frame->raw_frame + wanted_length,
-                leftovers);
-        pk_parser_reset(parser);
-        pk_parser_parse_new_data(parser, leftovers);
+        /* The next frame is already in the buffer, parse it in place. */
+        pk_parser_advance(parser, wanted_length);
+        parser->buffer_bytes_left += leftovers;
+        if (0 > pk_parser_parse_new_data(parser, leftovers))
+          return pk_error;
       }
       else {
         pk_parser_reset(parser);
@@ -324,24 +483,26 @@ int pk_parser_parse_new_data(struct pk_parser *parser, int length)
 
 int pk_parser_parse(struct pk_parser *parser, int length, char *data)
 {
-  struct pk_frame *frame = &(parser->chunk->frame);
+  char *buffer;
   int parsed = 0;
   int status = 0;
+  int space = 0;
   int copy = 0;
   do {
     PK_TRACE_LOOP("parsing");
 
-    if ((length > 0) && (0 >= parser->buffer_bytes_left)) {
+    buffer = pk_parser_buffer(parser, &space);
+    if ((length > 0) && (0 >= space)) {
       /* We will make no progress.  This is bad! */
       return (pk_error = ERR_PARSE_NO_MEMORY);
     }
 
-    if (length > parser->buffer_bytes_left)
-      copy = parser->buffer_bytes_left;
+    if (length > space)
+      copy = space;
     else
       copy = length;
 
-    memcpy(frame->raw_frame + frame->raw_length, data, copy);
+    memcpy(buffer, data, copy);
     status = pk_parser_parse_new_data(parser, copy);
     if (status < 0) {
       pk_parser_reset(parser);
@@ -360,6 +521,49 @@ int pk_parser_parse(struct pk_parser *parser, int length, char *data)
 
 /**[ Serialization ]**********************************************************/
 
+/* Fast serializers for the per-chunk headers; these produce exactly the
+ * same bytes as the sprintf-based pk_format_frame() would. */
+static const char pk_hex_chars[] = "0123456789abcdef";
+
+size_t pk_hex_digits(size_t value)
+{
+#ifdef __GNUC__
+  if (value == 0) return 1;
+  return ((sizeof(unsigned long) * 8) - __builtin_clzl(value) + 3) / 4;
+#else
+  size_t digits = 1;
+  while (value >>= 4) digits++;
+  return digits;
+#endif
+}
+
+size_t pk_format_hex(char* buf, size_t value)
+{
+  size_t i, digits = pk_hex_digits(value);
+  for (i = digits; i > 0; i--) {
+    buf[i-1] = pk_hex_chars[value & 0xf];
+    value >>= 4;
+  }
+  return digits;
+}
+
+static size_t pk_format_dec(char* buf, int value)
+{
+  char tmp[16];
+  size_t i = 0, len = 0;
+  unsigned int v = (value < 0) ? -((unsigned int) value) : (unsigned int) value;
+  do {
+    tmp[i++] = '0' + (v % 10);
+    v /= 10;
+  } while (v);
+  if (value < 0) buf[len++] = '-';
+  while (i) buf[len++] = tmp[--i];
+  return len;
+}
+
+#define PK_APPEND(p, str, len) { memcpy(p, str, len); p += len; }
+#define PK_APPEND_CONST(p, str) PK_APPEND(p, str, sizeof(str) - 1)
+
 size_t pk_format_frame(char* buf, const char* sid,
                        const char *headers, size_t bytes)
 {
@@ -370,46 +574,98 @@ size_t pk_format_frame(char* buf, const char* sid,
   return hlen + sprintf(buf + hlen, headers, sid);
 }
 
+/* Format the "SID: ...\r\n" line, which streams can cache and pass to
+ * pk_format_reply_header() for each block of data. */
+size_t pk_format_sid_prefix(char* buf, const char* sid)
+{
+  char* p = buf;
+  size_t sidlen = strlen(sid);
+  PK_APPEND_CONST(p, "SID: ");
+  PK_APPEND(p, sid, sidlen);
+  PK_APPEND_CONST(p, "\r\n");
+  *p = '\0';
+  return p - buf;
+}
+
+size_t pk_reply_header_overhead(size_t prefix_len, size_t bytes)
+{
+  /* %x\r\n + prefix + \r\n */
+  return pk_hex_digits(prefix_len + 2 + bytes) + 2 + prefix_len + 2;
+}
+
+size_t pk_format_reply_header(char* buf, const char* prefix,
+                              size_t prefix_len, size_t bytes)
+{
+  char* p = buf + pk_format_hex(buf, prefix_len + 2 + bytes);
+  PK_APPEND_CONST(p, "\r\n");
+  PK_APPEND(p, prefix, prefix_len);
+  PK_APPEND_CONST(p, "\r\n");
+  return p - buf;
+}
+
 size_t pk_reply_overhead(const char *sid, size_t bytes)
 {
-  size_t hexlen, chunkhdr;
-  chunkhdr = (5 + strlen(sid) + 4); /* SID: %s\r\n\r\n */
-  hexlen = 0;
-  bytes += chunkhdr;
-  do {
-    hexlen++;
-    bytes = bytes >> 4;
-  } while (bytes);
-  return hexlen + 2 + chunkhdr; /* %x\r\n... */
+  return pk_reply_header_overhead(5 + strlen(sid) + 2, bytes);
 }
 
 size_t pk_format_reply(char* buf, const char* sid,
                        size_t bytes, const char* input)
 {
-  size_t hlen;
-  hlen = pk_format_frame(buf, sid, "SID: %s\r\n\r\n", bytes);
+  char* p = buf;
+  size_t sidlen;
+  if (!sid) sid = "";
+  sidlen = strlen(sid);
+
+  p += pk_format_hex(p, 5 + sidlen + 4 + bytes);
+  PK_APPEND_CONST(p, "\r\nSID: ");
+  PK_APPEND(p, sid, sidlen);
+  PK_APPEND_CONST(p, "\r\n\r\n");
   if (NULL != input) {
-    memcpy(buf + hlen, input, bytes);
-    return hlen + bytes;
+    PK_APPEND(p, input, bytes);
   }
-  else
-    return hlen;
+  else *p = '\0';
+  return p - buf;
 }
 
 size_t pk_format_eof(char* buf, const char* sid, int how)
 {
-  char format[64];
-  sprintf(format, "SID: %%s\r\nEOF: 1%s%s\r\n\r\n",
-                  (how & PK_EOF_READ) ? "R" : "",
-                  (how & PK_EOF_WRITE) ? "W" : "");
-  return pk_format_frame(buf, sid, format, 0);
+  char* p = buf;
+  size_t sidlen;
+  if (!sid) sid = "";
+  sidlen = strlen(sid);
+
+  /* SID: %s\r\nEOF: 1[R][W]\r\n\r\n */
+  p += pk_format_hex(p, 5 + sidlen + 2 + 6 + 4
+                        + ((how & PK_EOF_READ) ? 1 : 0)
+                        + ((how & PK_EOF_WRITE) ? 1 : 0));
+  PK_APPEND_CONST(p, "\r\nSID: ");
+  PK_APPEND(p, sid, sidlen);
+  PK_APPEND_CONST(p, "\r\nEOF: 1");
+  if (how & PK_EOF_READ) *p++ = 'R';
+  if (how & PK_EOF_WRITE) *p++ = 'W';
+  PK_APPEND_CONST(p, "\r\n\r\n");
+  *p = '\0';
+  return p - buf;
 }
 
 size_t pk_format_skb(char* buf, const char* sid, int kilobytes)
 {
-  char format[64];
-  sprintf(format, "NOOP: 1\r\nSID: %%s\r\nSKB: %d\r\n\r\n", kilobytes);
-  return pk_format_frame(buf, sid, format, 0);
+  char* p = buf;
+  char kb[16];
+  size_t sidlen, kblen;
+  if (!sid) sid = "";
+  sidlen = strlen(sid);
+  kblen = pk_format_dec(kb, kilobytes);
+
+  /* NOOP: 1\r\nSID: %s\r\nSKB: %d\r\n\r\n */
+  p += pk_format_hex(p, 9 + 5 + sidlen + 2 + 5 + kblen + 4);
+  PK_APPEND_CONST(p, "\r\nNOOP: 1\r\nSID: ");
+  PK_APPEND(p, sid, sidlen);
+  PK_APPEND_CONST(p, "\r\nSKB: ");
+  PK_APPEND(p, kb, kblen);
+  PK_APPEND_CONST(p, "\r\n\r\n");
+  *p = '\0';
+  return p - buf;
 }
 
 size_t pk_format_pong(char* buf)
@@ -579,28 +835,17 @@ char *pk_parse_kite_request(struct pk_kite_request* kite_r, const char *line)
   return kite->public_domain;
 }
 
-int pk_connect_ai(struct pk_conn* pkc, struct addrinfo* ai, int reconnecting,
-                  unsigned int n, struct pk_kite_request* requests,
-                  char *session_id, SSL_CTX *ctx)
-{
-  unsigned int i, j, bytes;
-  char buffer[16*1024], *p;
-  struct pk_pagekite tkite;
-  struct pk_kite_request tkite_r;
+/* The tunnel handshake comes in three parts: writing our request, spotting
+ * the end of the frontend's response and parsing it.  The manager drives
+ * these from its event loop (see pkm_start_handshake), pk_connect_ai()
+ * below just blocks until each is done. */
 
-  pk_log(PK_LOG_TUNNEL_CONNS, "Connecting to %s (session=%s)",
-                              in_addr_to_str(ai->ai_addr, buffer, 1024),
-                              (session_id && session_id[0] != '\0')
-                               ? session_id : "new");
-
-  if (0 > pkc_connect(pkc, ai))
-    return (pk_error = ERR_CONNECT_CONNECT);
-
-  memset(&buffer, 0, 16*1024);
-  set_blocking(pkc->sockfd);
-#ifdef HAVE_OPENSSL
-  if (ctx != NULL) pkc_start_ssl(pkc, ctx);
-#endif
+/* Queue the CONNECT request and our signed kite requests for sending. */
+int pk_write_handshake(struct pk_conn* pkc, unsigned int n,
+                       struct pk_kite_request* requests, char *session_id)
+{
+  unsigned int i, bytes;
+  char buffer[16*1024];
 
   pkc_write(pkc, PK_HANDSHAKE_CONNECT, strlen(PK_HANDSHAKE_CONNECT));
   pkc_write(pkc, PK_HANDSHAKE_FEATURES, strlen(PK_HANDSHAKE_FEATURES));
@@ -620,38 +865,36 @@ int pk_connect_ai(struct pk_conn* pkc, struct addrinfo* ai, int reconnecting,
   }
 
   pk_log(PK_LOG_TUNNEL_DATA, " - End handshake, flushing.");
-  pkc_write(pkc, PK_HANDSHAKE_END, strlen(PK_HANDSHAKE_END));
-  if (0 > pkc_flush(pkc, NULL, 0, BLOCKING_FLUSH, "pk_connect_ai")) {
-    pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
-    return (pk_error = ERR_CONNECT_REQUEST);
-  }
+  return pkc_write(pkc, PK_HANDSHAKE_END, strlen(PK_HANDSHAKE_END));
+}
 
-  /* Gather response from server */
-  pk_log(PK_LOG_TUNNEL_DATA, " - Read response ...");
-  for (i = 0; i < sizeof(buffer)-1 &&
-#ifdef HAVE_OPENSSL
-              (pkc->state != CONN_SSL_HANDSHAKE) &&
-#endif
-              !(pkc->status & (CONN_STATUS_BROKEN|CONN_STATUS_CLS_READ)); )
-  {
-    PK_TRACE_LOOP("read response");
-    if (1 > pkc_wait(pkc, 2000)) return (pk_error = ERR_CONNECT_REQUEST);
-    pk_log(PK_LOG_TUNNEL_DATA, " - Have data ...");
-    pkc_read(pkc);
-    if (pkc->in_buffer_pos > 0) {
-      memcpy(buffer+i, pkc->in_buffer, pkc->in_buffer_pos);
+/* Returns the length of the response header, up to and including the
+ * blank line which ends it, or 0 if we have not seen all of it yet. */
+int pk_handshake_length(const char* buffer, int length)
+{
+  const char* p = buffer;
+  const char* end = buffer + length;
+
+  while (NULL != (p = memchr(p, '\n', end - p))) {
+    if ((p > buffer) && (p[-1] == '\n')) return (p - buffer) + 1;
+    if ((p > buffer+1) && (p[-1] == '\r') && (p[-2] == '\n'))
+      return (p - buffer) + 1;
+    p++;
+  }
+  return 0;
+}
 
-      i += pkc->in_buffer_pos;
-      pkc->in_buffer_pos = 0;
-      buffer[i] = '\0';
+/* Parse a (nul terminated) response header, updating the requests and the
+ * session ID.  Returns the number of requests the frontend wants us to sign
+ * again using the fsalt it sent, or an error if we were turned away. */
+int pk_parse_handshake(char* buffer, int length, unsigned int n,
+                       struct pk_kite_request* requests, char *session_id)
+{
+  unsigned int i, j, bytes;
+  char *p;
+  struct pk_pagekite tkite;
+  struct pk_kite_request tkite_r;
 
-      if (i > 4) {
-        if (0 == strcmp(buffer+i-3, "\n\r\n")) break;
-        if (0 == strcmp(buffer+i-2, "\n\n")) break;
-      }
-      pk_log(PK_LOG_TUNNEL_DATA, " - Partial buffer: %s", buffer);
-    }
-  }
   pk_log(PK_LOG_TUNNEL_DATA, " - Parsing!");
 
   /* OK, let's walk through the response header line-by-line and parse. */
@@ -660,13 +903,12 @@ int pk_connect_ai(struct pk_conn* pkc, struct addrinfo* ai, int reconnecting,
   do {
     PK_TRACE_LOOP("response line");
 
-    bytes = zero_first_crlf(sizeof(buffer) - (p-buffer), p);
+    bytes = zero_first_crlf(length - (p-buffer), p);
 
                       /* 123456789012345678901 = 21 bytes */
     if ((strncasecmp(p, "X-PageKite-Duplicate:", 21) == 0) ||
         (strncasecmp(p, "X-PageKite-Invalid:", 19) == 0)) {
       pk_log(PK_LOG_TUNNEL_CONNS, "%s", p);
-      pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
       /* FIXME: Should update the status of each individual request. */
       return (pk_error = (p[12] == 'u') ? ERR_CONNECT_DUPLICATE
                                         : ERR_CONNECT_REJECTED);
@@ -702,20 +944,71 @@ int pk_connect_ai(struct pk_conn* pkc, struct addrinfo* ai, int reconnecting,
     p += bytes;
   } while (bytes);
 
-  if (i) {
-    if (reconnecting) {
-      pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
-      return (pk_error = ERR_CONNECT_REJECTED);
-    }
-    else {
-      pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
-      return pk_connect_ai(pkc, ai, 1, n, requests, session_id, ctx);
+  if (i == 0) {
+    for (j = 0; j < n; j++) requests[j].status = PK_KITE_FLYING;
+  }
+  return i;
+}
+
+int pk_connect_ai(struct pk_conn* pkc, struct addrinfo* ai, int reconnecting,
+                  unsigned int n, struct pk_kite_request* requests,
+                  char *session_id, SSL_CTX *ctx)
+{
+  int i, rv;
+  ssize_t bytes;
+  char buffer[PK_HANDSHAKE_RESPONSE_MAX];
+
+  pk_log(PK_LOG_TUNNEL_CONNS, "Connecting to %s (session=%s)",
+                              in_addr_to_str(ai->ai_addr, buffer, 1024),
+                              (session_id && session_id[0] != '\0')
+                               ? session_id : "new");
+
+  if (0 > pkc_connect(pkc, ai))
+    return (pk_error = ERR_CONNECT_CONNECT);
+
+  memset(&buffer, 0, sizeof(buffer));
+  set_blocking(pkc->sockfd);
+#ifdef HAVE_OPENSSL
+  if (ctx != NULL) pkc_start_ssl(pkc, ctx);
+#endif
+
+  pk_write_handshake(pkc, n, requests, session_id);
+  if (0 > pkc_flush(pkc, NULL, 0, BLOCKING_FLUSH, "pk_connect_ai")) {
+    pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
+    return (pk_error = ERR_CONNECT_REQUEST);
+  }
+
+  /* Gather response from server */
+  pk_log(PK_LOG_TUNNEL_DATA, " - Read response ...");
+  for (i = 0; i < (int) sizeof(buffer)-1 &&
+#ifdef HAVE_OPENSSL
+              (pkc->state != CONN_SSL_HANDSHAKE) &&
+#endif
+              !(pkc->status & (CONN_STATUS_BROKEN|CONN_STATUS_CLS_READ)); )
+  {
+    PK_TRACE_LOOP("read response");
+    if (1 > pkc_wait(pkc, 2000)) return (pk_error = ERR_CONNECT_REQUEST);
+    pk_log(PK_LOG_TUNNEL_DATA, " - Have data ...");
+    bytes = pkc_read_into(pkc, buffer+i, sizeof(buffer)-1-i);
+    if (bytes > 0) {
+      i += bytes;
+      buffer[i] = '\0';
+      if (pk_handshake_length(buffer, i)) break;
+      pk_log(PK_LOG_TUNNEL_DATA, " - Partial buffer: %s", buffer);
     }
   }
 
-  for (i = 0; i < n; i++) {
-    requests[i].status = PK_KITE_FLYING;
+  rv = pk_parse_handshake(buffer, i, n, requests, session_id);
+  if (rv < 0) {
+    pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
+    return rv;
+  }
+  if (rv) {
+    pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
+    if (reconnecting) return (pk_error = ERR_CONNECT_REJECTED);
+    return pk_connect_ai(pkc, ai, 1, n, requests, session_id, ctx);
   }
+
   pk_log(PK_LOG_TUNNEL_DATA, "pk_connect_ai(%s, %d, %p) => %d",
                              in_addr_to_str(ai->ai_addr, buffer, 1024),
                              n, requests, pkc->sockfd);
@@ -789,6 +1082,47 @@ static int pkproto_test_format_eof(void)
   return 1;
 }
 
+/* The fast serializers must match what sprintf would produce. */
+static int pkproto_test_format_fast(void)
+{
+  char dest[1024], expect[1024], prefix[64];
+  char* sids[] = {"", "1", "12345", "abcdefg"};
+  size_t sizes[] = {0, 1, 15, 16, 64, 255, 256, 4096, 65535, 1 << 20};
+  int kbs[] = {0, 7, 16, 12345, -1, 2147483647};
+  size_t i, j, plen, hlen;
+
+  assert(1 == pk_format_hex(dest, 0) && dest[0] == '0');
+  for (i = 0; i < sizeof(sids) / sizeof(char*); i++) {
+    plen = pk_format_sid_prefix(prefix, sids[i]);
+    sprintf(expect, "SID: %s\r\n", sids[i]);
+    assert(0 == strcmp(prefix, expect));
+    for (j = 0; j < sizeof(sizes) / sizeof(size_t); j++) {
+      hlen = pk_format_frame(expect, sids[i], "SID: %s\r\n\r\n", sizes[j]);
+      assert(hlen == pk_reply_header_overhead(plen, sizes[j]));
+      assert(hlen == pk_reply_overhead(sids[i], sizes[j]));
+      assert(hlen == pk_format_reply_header(dest, prefix, plen, sizes[j]));
+      assert(0 == memcmp(expect, dest, hlen));
+      assert(hlen == pk_format_reply(dest, sids[i], sizes[j], NULL));
+      assert(0 == strcmp(expect, dest));
+    }
+    for (j = 0; j < 4; j++) {
+      sprintf(prefix, "SID: %%s\r\nEOF: 1%s%s\r\n\r\n",
+                      (j & PK_EOF_READ) ? "R" : "",
+                      (j & PK_EOF_WRITE) ? "W" : "");
+      hlen = pk_format_frame(expect, sids[i], prefix, 0);
+      assert(hlen == pk_format_eof(dest, sids[i], j));
+      assert(0 == strcmp(expect, dest));
+    }
+    for (j = 0; j < sizeof(kbs) / sizeof(int); j++) {
+      sprintf(prefix, "NOOP: 1\r\nSID: %%s\r\nSKB: %d\r\n\r\n", kbs[j]);
+      hlen = pk_format_frame(expect, sids[i], prefix, 0);
+      assert(hlen == pk_format_skb(dest, sids[i], kbs[j]));
+      assert(0 == strcmp(expect, dest));
+    }
+  }
+  return 1;
+}
+
 static int pkproto_test_format_pong(void)
 {
   char dest[1024];
@@ -859,6 +1193,180 @@ static int pkproto_test_parser(struct pk_parser* p, int *callback_called)
   return 1;
 }
 
+static int pkproto_test_chunk_headers(void)
+{
+  struct pk_chunk chunk;
+  char buffer[1024];
+  char* headers = ("SID: abc\r\n"
+                   "skb: 12345678901\r\n"
+                   "SpD: -5\r\n"
+                   "Proto: http\r\n"
+                   "PORT: 8080\r\n"
+                   "Host: foo.example.com\r\n"
+                   "RIP: ::1\r\n"
+                   "RPort: x\r\n"
+                   "rtls: TLSv1\r\n"
+                   "QConns: 7\r\n"
+                   "Sidney: dropped\r\n"
+                   "Nope: kept\r\n"
+                   "X-Other: kept\r\n"
+                   "\r\n"
+                   "data");
+  int len = strlen(headers);
+
+  chunk_reset(&chunk);
+  chunk.frame.raw_length = sprintf(buffer, "%x\r\n%s", len, headers);
+  chunk.frame.raw_frame = buffer;
+  assert(0 == parse_frame_header(&(chunk.frame)));
+  assert(len == chunk.frame.length);
+  assert(len - 4 == parse_chunk_header(&(chunk.frame), &chunk, len));
+
+  assert(0 == strcmp(chunk.sid, "abc"));
+  assert(12345678901LL == (long long) chunk.remote_sent_kb);
+  assert(-5 == chunk.throttle_spd);
+  assert(0 == strcmp(chunk.request_proto, "http"));
+  assert(8080 == chunk.request_port);
+  assert(0 == strcmp(chunk.request_host, "foo.example.com"));
+  assert(0 == strcmp(chunk.remote_ip, "::1"));
+  assert(-1 == chunk.remote_port);
+  assert(0 == strcmp(chunk.remote_tls, "TLSv1"));
+  assert(7 == chunk.quota_conns);
+  assert(7 == pk_state.quota_conns);
+  assert(NULL == chunk.eof);
+  assert(NULL == chunk.noop);
+  assert(NULL == chunk.ping);
+  assert(2 == chunk.header_count);
+  assert(0 == strcmp(chunk.headers[0], "Nope: kept"));
+  assert(0 == strcmp(chunk.headers[1], "X-Other: kept"));
+  assert(4 == chunk.length);
+  assert(0 == strncmp(chunk.data, "data", 4));
+  return 1;
+}
+
+struct pkproto_test_zc {
+  struct pk_parser* parser;
+  int frames;
+};
+
+static void pkproto_test_zc_callback(struct pkproto_test_zc *zc,
+                                     struct pk_chunk *chunk) {
+  int i, n = atoi(chunk->sid);
+  struct pk_parser* p = zc->parser;
+
+  /* Chunk data must alias the parser buffer, no copies made. */
+  assert(chunk->data >= p->buffer);
+  assert(chunk->data + chunk->length <= p->buffer + p->buffer_size);
+  assert(n == zc->frames);
+  assert(chunk->length == n % 150);
+  for (i = 0; i < chunk->length; i++) assert(chunk->data[i] == 'a' + n % 26);
+  zc->frames += 1;
+}
+
+static int pkproto_test_zero_copy(void)
+{
+  char pbuf[sizeof(struct pk_parser) + sizeof(struct pk_chunk) + 256];
+  char stream[64000], body[150], hdr[32];
+  struct pkproto_test_zc zc;
+  char* buffer;
+  int i, len, space, pos, total = 0;
+
+  zc.frames = 0;
+  zc.parser = pk_parser_init(sizeof(pbuf), pbuf,
+                             (pkChunkCallback*) &pkproto_test_zc_callback,
+                             &zc);
+  for (i = 0; i < 300; i++) {
+    len = sprintf(hdr, "SID: %d\r\n\r\n", i);
+    memset(body, 'a' + i % 26, i % 150);
+    total += sprintf(stream + total, "%x\r\n%s", len + i % 150, hdr);
+    memcpy(stream + total, body, i % 150);
+    total += i % 150;
+  }
+  assert(total < (int) sizeof(stream));
+
+  /* Feed the stream in odd-sized reads, straight into the parser. */
+  for (pos = 0; pos < total; pos += len) {
+    buffer = pk_parser_buffer(zc.parser, &space);
+    assert(space > 0);
+    len = (total - pos < 37) ? (total - pos) : 37;
+    if (len > space) len = space;
+    memcpy(buffer, stream + pos, len);
+    assert(len == pk_parser_parse_new_data(zc.parser, len));
+  }
+  assert(300 == zc.frames);
+  assert(zc.parser->buffer_bytes_left == zc.parser->buffer_size);
+  return 1;
+}
+
+struct pkproto_test_frag {
+  int chunks;
+  int fragments;
+  ssize_t received;
+};
+
+#define PKPROTO_TEST_BYTE(sid, i) ((char) ('A' + (((i) * 7 + (sid)) % 26)))
+static void pkproto_test_frag_callback(struct pkproto_test_frag *f,
+                                       struct pk_chunk *chunk) {
+  int i, sid = atoi(chunk->sid);
+
+  assert(sid == f->chunks);
+  assert(chunk->offset == f->received);
+  assert(chunk->offset + chunk->length <= chunk->total);
+  for (i = 0; i < chunk->length; i++)
+    assert(chunk->data[i] == PKPROTO_TEST_BYTE(sid, chunk->offset + i));
+
+  /* EOF and PING may only be seen along with the final fragment. */
+  f->fragments += 1;
+  f->received += chunk->length;
+  if (f->received == chunk->total) {
+    assert(chunk->eof != NULL);
+    assert(chunk->ping != NULL);
+    f->chunks += 1;
+    f->received = 0;
+  }
+  else {
+    assert(chunk->eof == NULL);
+    assert(chunk->ping == NULL);
+  }
+}
+
+static int pkproto_test_fragmentation(void)
+{
+  char pbuf[PARSER_BYTES_MAX];
+  ssize_t sizes[] = {3*1024*1024 + 17, 0, 1, 5000, 2*1024*1024, 3000, 100};
+  int chunk_count = sizeof(sizes) / sizeof(ssize_t);
+  struct pkproto_test_frag f;
+  struct pk_parser* p;
+  char *stream, hdr[64];
+  ssize_t j, total, pos, len;
+  int i, hlen;
+
+  assert(NULL != (stream = malloc(6*1024*1024)));
+  for (total = i = 0; i < chunk_count; i++) {
+    hlen = sprintf(hdr, "SID: %d\r\nEOF: rw\r\nPING: 1\r\n\r\n", i);
+    total += sprintf(stream + total, "%zx\r\n%s", hlen + sizes[i], hdr);
+    for (j = 0; j < sizes[i]; j++)
+      stream[total++] = PKPROTO_TEST_BYTE(i, j);
+  }
+
+  memset(&f, 0, sizeof(f));
+  p = pk_parser_init(sizeof(pbuf), pbuf,
+                     (pkChunkCallback*) &pkproto_test_frag_callback, &f);
+
+  /* Feed the stream in random sized slices, some larger than the buffer. */
+  srand(1234);
+  for (pos = 0; pos < total; pos += len) {
+    len = 1 + rand() % (2 * PARSER_BYTES_MAX);
+    if (len > total - pos) len = total - pos;
+    assert(len == pk_parser_parse(p, len, stream + pos));
+  }
+  assert(chunk_count == f.chunks);
+  assert(f.fragments > 1000);
+  assert(p->buffer_bytes_left == p->buffer_size);
+
+  free(stream);
+  return 1;
+}
+
 static int pkproto_test_alloc(unsigned int buf_len, char *buffer,
                               struct pk_parser* p)
 {
@@ -926,6 +1434,41 @@ static int pkproto_test_parse_kite_request(void) {
 
   return 1;
 }
+
+static int pkproto_test_parse_handshake(void) {
+  struct pk_pagekite kite;
+  struct pk_kite_request kite_r;
+  char session[PK_HANDSHAKE_SESSIONID_MAX];
+  char buffer[1024];
+
+  memset(&kite, 0, sizeof(kite));
+  memset(&kite_r, 0, sizeof(kite_r));
+  strcpy(kite.protocol, "http");
+  strcpy(kite.public_domain, "b.com");
+  kite.public_port = 99;
+  kite_r.kite = &kite;
+
+  strcpy(buffer, "HTTP/1.1 200 OK\r\nX-PageKite-SessionID: s1\r\n");
+  assert(0 == pk_handshake_length(buffer, strlen(buffer)));
+  strcat(buffer, "X-PageKite-SignThis: http-99:b.com:abacab:f00d\r\n\r\nXX");
+  assert((int) strlen(buffer) - 2 == pk_handshake_length(buffer, strlen(buffer)));
+  assert(2 == pk_handshake_length("\n\nX", 3));
+
+  buffer[strlen(buffer) - 2] = '\0';
+  assert(1 == pk_parse_handshake(buffer, strlen(buffer), 1, &kite_r, session));
+  assert(0 == strcmp(kite_r.fsalt, "f00d"));
+  assert(0 == strcmp(session, "s1"));
+  assert(PK_KITE_UNKNOWN == kite_r.status);
+
+  strcpy(buffer, "HTTP/1.1 200 OK\r\n\r\n");
+  assert(0 == pk_parse_handshake(buffer, strlen(buffer), 1, &kite_r, session));
+  assert(PK_KITE_FLYING == kite_r.status);
+
+  strcpy(buffer, "HTTP/1.1 200 OK\r\nX-PageKite-Duplicate: b.com\r\n\r\n");
+  assert(ERR_CONNECT_DUPLICATE ==
+         pk_parse_handshake(buffer, strlen(buffer), 1, &kite_r, session));
+  return 1;
+}
 #endif
 
 int pkproto_test(void)
@@ -942,13 +1485,144 @@ int pkproto_test(void)
   return (pkproto_test_format_frame() &&
           pkproto_test_format_reply() &&
           pkproto_test_format_eof() &&
+          pkproto_test_format_fast() &&
           pkproto_test_format_pong() &&
           pkproto_test_alloc(64000, buffer, p) &&
           pkproto_test_parser(p, &callback_called) &&
+          pkproto_test_chunk_headers() &&
+          pkproto_test_zero_copy() &&
+          pkproto_test_fragmentation() &&
           pkproto_test_make_bsalt() &&
           pkproto_test_sign_kite_request() &&
-          pkproto_test_parse_kite_request());
+          pkproto_test_parse_kite_request() &&
+          pkproto_test_parse_handshake());
 #else
   return 1;
 #endif
 }
+
+#if PK_TESTS
+static void pkproto_bench_callback(int *chunks, struct pk_chunk *chunk) {
+  *chunks += 1;
+  (void) chunk;
+}
+
+/* Feed a stream of frames to a tunnel-sized parser, either reading it
+ * straight into the parser's buffer as pkm_tunnel_readable_cb() does, or
+ * into a separate read buffer for pk_parser_parse() to copy. */
+static ev_tstamp pkproto_bench_parse(const char* stream, int length,
+                                     int rounds, int copy, int* chunks)
+{
+  char pbuf[sizeof(struct pk_parser) + sizeof(struct pk_chunk)
+            + PARSER_BYTES_MAX];
+  char rbuf[CONN_IO_BUFFER_SIZE];
+  struct pk_parser* p;
+  char* buffer;
+  int r, pos, len, space;
+  ev_tstamp t0;
+
+  p = pk_parser_init(sizeof(pbuf), pbuf,
+                     (pkChunkCallback*) &pkproto_bench_callback, chunks);
+  t0 = ev_time();
+  for (r = 0; r < rounds; r++) {
+    for (pos = 0; pos < length; pos += len) {
+      if (copy) {
+        buffer = rbuf;
+        space = sizeof(rbuf);
+      }
+      else {
+        buffer = pk_parser_buffer(p, &space);
+      }
+      len = (length - pos < space) ? (length - pos) : space;
+      memcpy(buffer, stream + pos, len);
+      if (copy)
+        assert(len == pk_parser_parse(p, len, rbuf));
+      else
+        assert(len == pk_parser_parse_new_data(p, len));
+    }
+  }
+  return ev_time() - t0;
+}
+
+/* Fill the stream with copies of one frame, returning the total length. */
+static int pkproto_bench_stream(char* stream, int size, const char* frame,
+                                int frame_len)
+{
+  int length;
+  for (length = 0; length + frame_len <= size; length += frame_len)
+    memcpy(stream + length, frame, frame_len);
+  return length;
+}
+#endif
+
+/* Benchmarks, run by bench.c (make runbench). */
+int pkproto_bench(void)
+{
+#if PK_TESTS
+  static char stream[256 * 1024];
+  static char frame[96 * 1024];
+  const char* names[] = {"SID+64B", "SKB", "NOOP", "PING"};
+  const size_t payloads[] = {64, 512, 4096};
+  char prefix[64], buf[128];
+  int i, n, len, length, chunks, rounds, plen;
+  unsigned long sum, fast_sum;
+  ev_tstamp t, fast;
+
+  /* Chunks per second for typical small control and data frames */
+  for (i = 0; i < 4; i++) {
+    switch (i) {
+      case 0: len = pk_format_reply(frame, "1a2b", 64, NULL);
+              memset(frame + len, 'x', 64);
+              len += 64;
+              break;
+      case 1: len = pk_format_skb(frame, "1a2b", 1234); break;
+      case 2: len = pk_format_pong(frame); break;
+      default: len = pk_format_ping(frame);
+    }
+    length = pkproto_bench_stream(stream, 64 * 1024, frame, len);
+    chunks = 0;
+    rounds = 200;
+    t = pkproto_bench_parse(stream, length, rounds, 0, &chunks);
+    assert(chunks == rounds * (length / len));
+    printf("pkproto: parse %-8s frames: %6.2f M chunks/s\n",
+           names[i], chunks / t / 1e6);
+  }
+
+  /* Throughput, parsing in place versus copying into the parser */
+  for (i = 0; i < 2; i++) {
+    n = i ? (64 * 1024) : 1024;
+    len = pk_format_reply(frame, "1a2b", n, NULL);
+    memset(frame + len, 'x', n);
+    len += n;
+    length = pkproto_bench_stream(stream, sizeof(stream), frame, len);
+    rounds = (256 * 1024 * 1024) / length;
+    chunks = 0;
+    fast = pkproto_bench_parse(stream, length, rounds, 0, &chunks);
+    t = pkproto_bench_parse(stream, length, rounds, 1, &chunks);
+    printf("pkproto: parse %5d B chunks: %6.0f MB/s in place, "
+           "%6.0f MB/s copying\n", n, (rounds * (double) length) / fast / 1e6,
+                                       (rounds * (double) length) / t / 1e6);
+  }
+
+  /* Chunk headers, from a cached SID prefix versus pk_format_frame() */
+  plen = pk_format_sid_prefix(prefix, "1a2b");
+  for (i = 0; i < 3; i++) {
+    n = 1000000;
+    sum = fast_sum = 0;
+    t = ev_time();
+    for (len = 0; len < n; len++)
+      sum += pk_format_frame(buf, "1a2b", "SID: %s\r\n\r\n", payloads[i])
+           + buf[0];
+    t = ev_time() - t;
+    fast = ev_time();
+    for (len = 0; len < n; len++)
+      fast_sum += pk_format_reply_header(buf, prefix, plen, payloads[i])
+                + buf[0];
+    fast = ev_time() - fast;
+    assert(sum == fast_sum);
+    printf("pkproto: format %4d B chunk header: %5.1f ns cached, "
+           "%5.1f ns sprintf\n", (int) payloads[i], 1e9 * fast / n, 1e9 * t / n);
+  }
+#endif
+  return 1;
+}
@@ -41,6 +41,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #define PK_HANDSHAKE_KITE "X-PageKite: %s\r\n"
 #define PK_HANDSHAKE_END "\r\n"
 #define PK_HANDSHAKE_SESSIONID_MAX 256
+#define PK_HANDSHAKE_RESPONSE_MAX (16 * 1024)
 
 /* Must be careful here, outsiders can manipulate the contents of the
  * reply message.  Beware the buffer overflows! */
@@ -60,6 +61,9 @@ Note: For alternate license terms, see the file COPYING.md.
 #define PK_REJECT_PRE_PAGEKITE ("<frameset cols='*'><frame target='_top' src='https://pagekite.net/offline/?&where=%.3s&v=%s&proto=%.8s&domain=%.64s'><noframes>")
 #define PK_REJECT_POST_PAGEKITE "</noframes></frameset>"
 
+/* An SKB report: frame and chunk headers, a SID and a number. */
+#define PK_SKB_MAXSIZE 128
+
 #define PK_REJECT_TLS_DATA "\x15\x03\0\0\x02\x02\x31"
 #define PK_REJECT_TLS_LEN  7
 
@@ -71,6 +75,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #define PK_PROTOCOL_LENGTH   24
 #define PK_DOMAIN_LENGTH   1024
 #define PK_SECRET_LENGTH    256
+#define PK_LOCAL_ADDRS_MAX    4
 struct  pk_pagekite {
   PK_MEMORY_CANARY
   char  protocol[PK_PROTOCOL_LENGTH+1];
@@ -79,6 +84,13 @@ struct  pk_pagekite {
   char  local_domain[PK_DOMAIN_LENGTH+1];
   int   local_port;
   char  auth_secret[PK_SECRET_LENGTH+1];
+  int   connect_timeout;      /* Seconds allowed to reach the backend */
+  /* Cache of resolved local_domain addresses, see pkm_resolve_backends() */
+  struct sockaddr_storage local_addrs[PK_LOCAL_ADDRS_MAX];
+  socklen_t local_addr_lens[PK_LOCAL_ADDRS_MAX];
+  int   local_addr_count;
+  int   local_addr_next;      /* Index of the address to try first */
+  time_t local_addrs_expire;  /* 0 if never resolved */
 };
 
 /* Data structure describing a kite request */
@@ -135,10 +147,14 @@ struct pk_chunk {
 /* Callback for when a chunk is ready. */
 typedef void(pkChunkCallback)(void *, struct pk_chunk *);
 
-/* Parser object. */
+/* Parser object.  Frames are parsed in place: chunk and header pointers
+ * alias the buffer, which data may be read into directly, see
+ * pk_parser_buffer() and pk_parser_parse_new_data(). */
 struct pk_parser {
   PK_MEMORY_CANARY
-  int              buffer_bytes_left;
+  int              buffer_bytes_left;  /* Free space after current frame */
+  int              buffer_size;
+  char*            buffer;
   struct pk_chunk* chunk;
   pkChunkCallback* chunk_callback;
   void*            chunk_callback_data;
@@ -147,11 +163,18 @@ struct pk_parser {
 struct pk_parser* pk_parser_init (int, char*,
                                   pkChunkCallback*, void *);
 int               pk_parser_parse(struct pk_parser*, int, char*);
+char*             pk_parser_buffer(struct pk_parser*, int*);
+int               pk_parser_parse_new_data(struct pk_parser*, int);
 void              pk_parser_reset(struct pk_parser*);
 
 void              pk_reset_pagekite(struct pk_pagekite* kite);
 
+size_t            pk_hex_digits(size_t);
+size_t            pk_format_hex(char*, size_t);
 size_t            pk_format_frame(char*, const char*, const char *, size_t);
+size_t            pk_format_sid_prefix(char*, const char*);
+size_t            pk_reply_header_overhead(size_t, size_t);
+size_t            pk_format_reply_header(char*, const char*, size_t, size_t);
 size_t            pk_reply_overhead(const char *sid, size_t);
 size_t            pk_format_reply(char*, const char*, size_t, const char*);
 size_t            pk_format_skb(char*, const char*, int);
@@ -163,6 +186,11 @@ int               pk_make_bsalt(struct pk_kite_request*);
 char*             pk_sign(const char*, const char*, const char*, int, char *);
 int               pk_sign_kite_request(char *, struct pk_kite_request*, int);
 char*             pk_parse_kite_request(struct pk_kite_request*, const char*);
+int               pk_write_handshake(struct pk_conn*, unsigned int,
+                                     struct pk_kite_request*, char*);
+int               pk_handshake_length(const char*, int);
+int               pk_parse_handshake(char*, int, unsigned int,
+                                     struct pk_kite_request*, char*);
 int               pk_connect_ai(struct pk_conn*, struct addrinfo*, int,
                                 unsigned int, struct pk_kite_request*, char*,
                                 SSL_CTX*);
@@ -171,3 +199,4 @@ int               pk_connect(struct pk_conn*, char*, int,
                              SSL_CTX*);
 
 int pkproto_test(void);
+int pkproto_bench(void);
@@ -46,6 +46,8 @@ struct pk_global_state {
   /* Settings */
   unsigned int    bail_on_errors;
   time_t          conn_eviction_idle_s;
+  int             conn_buffer_max; /* 0: CONN_BUFFER_MAX_DEFAULT */
+  int             tunnel_read_budget; /* 0: CONN_READ_BUDGET_DEFAULT */
   unsigned int    fake_ping:1;
 
   /* Global program state */
@@ -38,6 +38,7 @@ struct pk_global_state pk_state;
 int sha1_test();
 int utils_test();
 int pkproto_test();
+int pkconn_test();
 int pkmanager_test();
 
 int main(void) {
@@ -56,6 +57,7 @@ int main(void) {
   assert(sha1_test());
   assert(utils_test());
   assert(pkproto_test());
+  assert(pkconn_test());
   assert(pkmanager_test());
   return 0;
 }